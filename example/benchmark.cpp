@@ -0,0 +1,485 @@
+
+
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__linux__)
+#   include <linux/perf_event.h>
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#   define WITH_PERF_COUNTERS 1
+#else
+#   define WITH_PERF_COUNTERS 0
+#endif
+
+#include "../luaaa.hpp"
+
+#define LOG printf
+
+using namespace luaaa;
+
+class Cat
+{
+public:
+	Cat() : m_age(1), m_weight(1.0f) {}
+	Cat(const std::string& name) : m_name(name), m_age(1), m_weight(1.0f) {}
+
+	void setName(const std::string& name) { m_name = name; }
+	const std::string& getName() const { return m_name; }
+	void setAge(int age) { m_age = age; }
+	int getAge() const { return m_age; }
+	void setWeight(float weight) { m_weight = weight; }
+	float getWeight() const { return m_weight; }
+	void eat(int food) { m_weight += food * 0.1f; }
+	void run(int distance) { m_weight -= distance * 0.01f; }
+	bool isHungry() const { return m_weight < 2.0f; }
+	std::string toString() const { return m_name + ":" + std::to_string(m_age); }
+
+private:
+	std::string m_name;
+	int m_age;
+	float m_weight;
+};
+
+int add(int a, int b) { return a + b; }
+int sub(int a, int b) { return a - b; }
+int mul(int a, int b) { return a * b; }
+float divide(float a, float b) { return a / b; }
+double sqr(double a) { return a * a; }
+bool isZero(int a) { return a == 0; }
+std::string concat(const std::string& a, const std::string& b) { return a + b; }
+int length(const std::string& s) { return int(s.size()); }
+
+
+static const auto catFunctions = bindings(
+	entry("setName", &Cat::setName),
+	entry("getName", &Cat::getName),
+	entry("setAge", &Cat::setAge),
+	entry("getAge", &Cat::getAge),
+	entry("setWeight", &Cat::setWeight),
+	entry("getWeight", &Cat::getWeight),
+	entry("eat", &Cat::eat),
+	entry("run", &Cat::run),
+	entry("isHungry", &Cat::isHungry),
+	entry("toString", &Cat::toString));
+
+static const auto mathFunctions = bindings(
+	entry("add", add),
+	entry("sub", sub),
+	entry("mul", mul),
+	entry("divide", divide),
+	entry("sqr", sqr),
+	entry("isZero", isZero),
+	entry("concat", concat),
+	entry("length", length));
+
+
+void bindByCalls(lua_State * L)
+{
+	LuaClass<Cat>(L, "Cat")
+		.ctor<std::string>()
+		.fun("setName", &Cat::setName)
+		.fun("getName", &Cat::getName)
+		.fun("setAge", &Cat::setAge)
+		.fun("getAge", &Cat::getAge)
+		.fun("setWeight", &Cat::setWeight)
+		.fun("getWeight", &Cat::getWeight)
+		.fun("eat", &Cat::eat)
+		.fun("run", &Cat::run)
+		.fun("isHungry", &Cat::isHungry)
+		.fun("toString", &Cat::toString);
+
+	LuaModule(L, "math2")
+		.fun("add", add)
+		.fun("sub", sub)
+		.fun("mul", mul)
+		.fun("divide", divide)
+		.fun("sqr", sqr)
+		.fun("isZero", isZero)
+		.fun("concat", concat)
+		.fun("length", length);
+}
+
+void bindByTables(lua_State * L)
+{
+	LuaClass<Cat>(L, "Cat").ctor<std::string>().fun(catFunctions);
+	LuaModule(L, "math2").fun(mathFunctions);
+}
+
+void bindLazy(lua_State * L)
+{
+	lazy(L, "Cat", [](lua_State * L) { LuaClass<Cat>(L, "Cat").ctor<std::string>().fun(catFunctions); });
+	lazy(L, "math2", [](lua_State * L) { LuaModule(L, "math2").fun(mathFunctions); });
+}
+
+
+// create, bind and close states, return average nanoseconds per state.
+double measureStartup(void(*bind)(lua_State *), int rounds)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; ++i)
+	{
+		lua_State * L = luaL_newstate();
+		bind(L);
+		lua_settop(L, 0);
+		lua_close(L);
+	}
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::nano>(elapsed).count() / rounds;
+}
+
+double measureEmpty(int rounds)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; ++i)
+	{
+		lua_State * L = luaL_newstate();
+		lua_close(L);
+	}
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::nano>(elapsed).count() / rounds;
+}
+
+// generated script with many small functions, like a rule script.
+std::string makeScript(int functions)
+{
+	std::string script;
+	for (int i = 0; i < functions; ++i)
+	{
+		std::string n = std::to_string(i);
+		script += "function rule" + n + "(cat)\n"
+			"\tlocal age = cat:getAge()\n"
+			"\tif age > " + n + " and not cat:isHungry() then return age * 2 + " + n + " end\n"
+			"\treturn nil\n"
+			"end\n";
+	}
+	return script;
+}
+
+// load (without running) script into new states, return average nanoseconds per load.
+double measureLoad(const std::string& script, ScriptLoader * loader, int rounds)
+{
+	lua_State * L = luaL_newstate();
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; ++i)
+	{
+		if (loader)
+		{
+			loader->loadBuffer(L, script.data(), script.size(), "=rules");
+		}
+		else
+		{
+			luaL_loadbuffer(L, script.data(), script.size(), "=rules");
+		}
+		lua_settop(L, 0);
+	}
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	lua_close(L);
+	return std::chrono::duration<double, std::nano>(elapsed).count() / rounds;
+}
+
+
+// hardware counters of the calling thread, user space only.
+// counters not provided by kernel or cpu (containers, vms) read as -1.
+class PerfCounters
+{
+public:
+	enum { Instructions, Cycles, BranchMisses, L1dMisses, LlcMisses, DtlbMisses, Count };
+
+	PerfCounters()
+	{
+		for (int i = 0; i < Count; ++i)
+		{
+			m_fds[i] = -1;
+			m_values[i] = -1;
+#if WITH_PERF_COUNTERS
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			switch (i)
+			{
+			case Instructions:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+				break;
+			case Cycles:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_CPU_CYCLES;
+				break;
+			case BranchMisses:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+				break;
+			case L1dMisses:
+				attr.type = PERF_TYPE_HW_CACHE;
+				attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+				break;
+			case LlcMisses:
+				attr.type = PERF_TYPE_HW_CACHE;
+				attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+				break;
+			case DtlbMisses:
+				attr.type = PERF_TYPE_HW_CACHE;
+				attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+				break;
+			}
+			// counters are opened one by one, so missing ones don't fail the others.
+			m_fds[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+		}
+	}
+
+	~PerfCounters()
+	{
+#if WITH_PERF_COUNTERS
+		for (int i = 0; i < Count; ++i)
+		{
+			if (m_fds[i] >= 0)
+			{
+				close(m_fds[i]);
+			}
+		}
+#endif
+	}
+
+	bool available() const
+	{
+		for (int i = 0; i < Count; ++i)
+		{
+			if (m_fds[i] >= 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void start()
+	{
+#if WITH_PERF_COUNTERS
+		for (int i = 0; i < Count; ++i)
+		{
+			if (m_fds[i] >= 0)
+			{
+				ioctl(m_fds[i], PERF_EVENT_IOC_RESET, 0);
+				ioctl(m_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	void stop()
+	{
+#if WITH_PERF_COUNTERS
+		for (int i = 0; i < Count; ++i)
+		{
+			if (m_fds[i] >= 0)
+			{
+				ioctl(m_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			}
+		}
+		for (int i = 0; i < Count; ++i)
+		{
+			// value, time enabled, time running. counters multiplexed on the pmu are scaled.
+			unsigned long long data[3] = { 0, 0, 0 };
+			m_values[i] = -1;
+			if (m_fds[i] >= 0 && read(m_fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0)
+			{
+				m_values[i] = (long long)(double(data[0]) * double(data[1]) / double(data[2]));
+			}
+		}
+#endif
+	}
+
+	long long value(int counter) const
+	{
+		return m_values[counter];
+	}
+
+	static const char * name(int counter)
+	{
+		static const char * names[Count] = { "instr", "cycles", "br-miss", "L1d-miss", "LLC-miss", "dTLB-miss" };
+		return names[counter];
+	}
+
+private:
+	int m_fds[Count];
+	long long m_values[Count];
+};
+
+// run body iterations times, print wall time and counters per iteration.
+template<typename F>
+void perfRun(PerfCounters& counters, const char * name, int iterations, F body)
+{
+	for (int i = 0; i < iterations / 10; ++i)
+	{
+		body();
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	counters.start();
+	for (int i = 0; i < iterations; ++i)
+	{
+		body();
+	}
+	counters.stop();
+	auto elapsed = std::chrono::steady_clock::now() - start;
+
+	LOG("%-42s %9.1f", name, std::chrono::duration<double, std::nano>(elapsed).count() / iterations);
+	for (int i = 0; i < PerfCounters::Count; ++i)
+	{
+		if (counters.value(i) < 0)
+		{
+			LOG(" %9s", "-");
+		}
+		else
+		{
+			LOG(" %9.2f", double(counters.value(i)) / iterations);
+		}
+	}
+	LOG("\n");
+}
+
+// push and read back value, get takes absolute index like in callers.
+template<typename T>
+void perfMarshal(PerfCounters& counters, lua_State * L, const char * name, const T& value, int iterations)
+{
+	perfRun(counters, name, iterations, [&]() {
+		LuaStack<T>::put(L, value);
+		T result = LuaStack<T>::get(L, lua_gettop(L));
+		lua_pop(L, 1);
+		(void)result;
+	});
+}
+
+// call global function by lua_call, args pushed by push.
+template<typename F>
+void perfCall(PerfCounters& counters, lua_State * L, const char * name, const char * chunk, int args, int iterations, F push)
+{
+	luaL_loadstring(L, chunk);
+	lua_call(L, 0, 1);
+	int fn = lua_gettop(L);
+	perfRun(counters, name, iterations, [&]() {
+		lua_pushvalue(L, fn);
+		push(L);
+		lua_call(L, args, 1);
+		lua_pop(L, 1);
+	});
+	lua_settop(L, fn - 1);
+}
+
+static int nop(lua_State *)
+{
+	return 0;
+}
+
+// counters of marshalers and callers, per operation.
+int runPerf(int iterations)
+{
+	PerfCounters counters;
+	if (!counters.available())
+	{
+		LOG("hardware counters unavailable (no pmu, or denied by kernel.perf_event_paranoid), wall clock only.\n\n");
+	}
+
+	LOG("%-42s %9s", "per operation", "ns");
+	for (int i = 0; i < PerfCounters::Count; ++i)
+	{
+		LOG(" %9s", PerfCounters::name(i));
+	}
+	LOG("\n--------------------------------------------------------------------------------------------------------------\n");
+
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	bindByCalls(L);
+	lua_register(L, "nop", nop);
+
+	perfMarshal(counters, L, "LuaStack<bool>", true, iterations);
+	perfMarshal(counters, L, "LuaStack<int>", 42, iterations);
+	perfMarshal(counters, L, "LuaStack<float>", 4.2f, iterations);
+	perfMarshal(counters, L, "LuaStack<double>", 4.2, iterations);
+	perfMarshal(counters, L, "LuaStack<const char*>", (const char *)"tom", iterations);
+	perfMarshal(counters, L, "LuaStack<std::string>", std::string("tom"), iterations);
+	perfMarshal(counters, L, "LuaStack<std::vector<int>> (8)", std::vector<int>{ 1, 2, 3, 4, 5, 6, 7, 8 }, iterations / 10);
+	perfMarshal(counters, L, "LuaStack<std::map<string, int>> (4)", std::map<std::string, int>{ { "a", 1 }, { "b", 2 }, { "c", 3 }, { "d", 4 } }, iterations / 10);
+
+	perfCall(counters, L, "lua_CFunction nop()", "return nop", 0, iterations, [](lua_State *) {});
+	perfCall(counters, L, "NonMemberFunctionCaller add(int, int)", "return math2.add", 2, iterations, [](lua_State * L) {
+		lua_pushinteger(L, 1);
+		lua_pushinteger(L, 2);
+	});
+	perfCall(counters, L, "NonMemberFunctionCaller concat(str, str)", "return math2.concat", 2, iterations, [](lua_State * L) {
+		lua_pushliteral(L, "tom");
+		lua_pushliteral(L, "cat");
+	});
+
+	luaL_dostring(L, "cat = Cat.new('tom')");
+	lua_getglobal(L, "cat");
+	int cat = lua_gettop(L);
+	perfCall(counters, L, "MemberFunctionCaller getAge()", "return cat.getAge", 1, iterations, [cat](lua_State * L) {
+		lua_pushvalue(L, cat);
+	});
+	perfCall(counters, L, "MemberFunctionCaller setName(str)", "return cat.setName", 2, iterations, [cat](lua_State * L) {
+		lua_pushvalue(L, cat);
+		lua_pushliteral(L, "tom");
+	});
+
+	// collect outside of counted loop.
+	lua_gc(L, LUA_GCSTOP, 0);
+	perfCall(counters, L, "ConstructorCaller Cat(str)", "return Cat.new", 1, iterations, [](lua_State * L) {
+		lua_pushliteral(L, "tom");
+	});
+	lua_gc(L, LUA_GCRESTART, 0);
+
+	lua_close(L);
+	return 0;
+}
+
+
+int main(int argc, char * argv[])
+{
+	// benchmark perf: counters of marshalers and callers.
+	if (argc > 1 && strcmp(argv[1], "perf") == 0)
+	{
+		return runPerf(argc > 2 ? atoi(argv[2]) : 200000);
+	}
+
+	const int rounds = 20000;
+
+	LOG("state startup, %d rounds\n", rounds);
+	LOG("------------------------------------------\n");
+
+	// warm up
+	measureStartup(bindByCalls, rounds / 10);
+	measureStartup(bindByTables, rounds / 10);
+	measureStartup(bindLazy, rounds / 10);
+
+	double empty = measureEmpty(rounds);
+	double calls = measureStartup(bindByCalls, rounds);
+	double tables = measureStartup(bindByTables, rounds);
+	double lazies = measureStartup(bindLazy, rounds);
+
+	LOG("%-28s %10.0f ns/state\n", "empty state", empty);
+	LOG("%-28s %10.0f ns/state (bindings %.0f ns)\n", "fun() calls", calls, calls - empty);
+	LOG("%-28s %10.0f ns/state (bindings %.0f ns)\n", "binding descriptor tables", tables, tables - empty);
+	LOG("%-28s %10.0f ns/state (bindings %.0f ns)\n", "lazy bindings", lazies, lazies - empty);
+
+	const int loads = 500;
+	std::string script = makeScript(200);
+	ScriptLoader loader;
+	measureLoad(script, &loader, 1);
+
+	LOG("\nscript load, %d bytes, %d rounds\n", int(script.size()), loads);
+	LOG("------------------------------------------\n");
+	LOG("%-28s %10.0f ns/load\n", "luaL_loadbuffer", measureLoad(script, nullptr, loads));
+	LOG("%-28s %10.0f ns/load\n", "ScriptLoader (cached)", measureLoad(script, &loader, loads));
+
+	return 0;
+}
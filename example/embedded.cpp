@@ -29,6 +29,8 @@ void runLuaExample(lua_State * ls)
     getchar();
 }
 
+// all memory of lua state comes from this buffer.
+static char luaHeap[1024 * 1024];
 
 int main()
 {
@@ -44,7 +46,8 @@ int main()
 		{ NULL, NULL }
 	};
 
-	auto ls = luaL_newstate();
+	luaaa::TlsfAllocator allocator(luaHeap, sizeof(luaHeap));
+	auto ls = allocator.newState();
 
 	if (ls != NULL)
 	{
@@ -58,6 +61,8 @@ int main()
 		runLuaExample(ls);
 
 		lua_close(ls);
+
+		LOG("lua memory peak: %d bytes, failed allocations: %d\n", int(allocator.stats().peak), int(allocator.stats().failures));
 	}
 	return 0;
 }
@@ -0,0 +1,521 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+
+#define LUAAA_WITH_PROFILER 1
+#include "../luaaa.hpp"
+
+#define LOG printf
+
+using namespace luaaa;
+
+// regression checks, exit code is count of failed checks.
+// build with -fsanitize=address to catch dangling arguments.
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			LOG("FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			++failures; \
+		} \
+	} while (0)
+
+class Cat
+{
+public:
+	static int alive;
+
+	Cat(const std::string& name) : m_name(name), m_age(1) { ++alive; }
+	~Cat() { --alive; }
+
+	void setName(const char * name) { m_name = name; }
+	const std::string& getName() const { return m_name; }
+	void setAge(int age) { m_age = age; }
+	int getAge() const { return m_age; }
+
+private:
+	std::string m_name;
+	int m_age;
+};
+
+int Cat::alive = 0;
+
+static int total = 0;
+
+static bool run(lua_State * L, const char * code)
+{
+	if (luaL_dostring(L, code))
+	{
+		LOG("lua err: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return false;
+	}
+	return true;
+}
+
+static std::string global(lua_State * L, const char * name)
+{
+	lua_getglobal(L, name);
+	std::string value = lua_isnil(L, -1) ? "nil" : LuaStack<std::string>::get(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
+// arguments of async functions must outlive the yield of the calling coroutine.
+static void checkAsyncArguments()
+{
+	std::vector<std::function<void()>> jobs;
+	CompletionQueue queue([&jobs](std::function<void()> job) { jobs.push_back(std::move(job)); });
+
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	LuaClass<Cat>(L, "Cat").ctor<std::string>().fun("getAge", &Cat::getAge);
+	LuaModule(L, "w")
+		.fun("len", queue.async([](const char * s) { return int(strlen(s)); }))
+		.fun("name", queue.async([](Cat * cat) { return cat->getName(); }))
+		.fun("grow", queue.async([](Cat & cat) { cat.setAge(cat.getAge() + 1); }));
+
+	CHECK(run(L,
+		"local x = 'y'\n"
+		"cat = Cat.new('tom')\n"
+		"local function go(f) local co = coroutine.create(f) coroutine.resume(co) end\n"
+		"go(function() len = w.len(string.rep('x', 1000) .. x) end)\n"
+		"go(function() name = w.name(Cat.new('kitty')) end)\n"
+		"go(function() w.grow(cat) end)\n"
+		"collectgarbage() collectgarbage()\n"));
+	CHECK(Cat::alive == 2);
+
+	for (auto& job : jobs)
+	{
+		job();
+	}
+	CHECK(queue.drain() == 3);
+	CHECK(global(L, "len") == "1001");
+	CHECK(global(L, "name") == "kitty");
+	CHECK(run(L, "age = cat:getAge()"));
+	CHECK(global(L, "age") == "2");
+
+	CHECK(run(L, "collectgarbage() collectgarbage()"));
+	CHECK(Cat::alive == 1);
+	lua_close(L);
+}
+
+static std::string takesInt(int) { return "int"; }
+static std::string takesNumber(double) { return "number"; }
+
+// integral overload only takes numbers in range of its type.
+static void checkIntegralOverload()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	LuaModule(L, "w").fun("which", overload(takesInt, takesNumber));
+	CHECK(run(L, "a = w.which(3) b = w.which(3.5) c = w.which(2^40) d = w.which(0/0) e = w.which(-1/0) f = w.which(-2^31)"));
+	CHECK(global(L, "a") == "int");
+	CHECK(global(L, "b") == "number");
+	CHECK(global(L, "c") == "number");
+	CHECK(global(L, "d") == "number");
+	CHECK(global(L, "e") == "number");
+	CHECK(global(L, "f") == "int");
+	lua_close(L);
+}
+
+// closures of one callable type share the metatable which destroys them.
+static void checkCalleeMetatable()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	std::shared_ptr<Cat> tom = std::make_shared<Cat>("tom");
+	LuaModule(L, "w")
+		.fun("a", std::function<int()>([tom]() { return tom->getAge(); }))
+		.fun("b", std::function<int()>([tom]() { return tom->getAge() + 1; }));
+	tom.reset();
+	CHECK(Cat::alive == 1);
+
+	CHECK(run(L, "a = w.a() b = w.b()"));
+	CHECK(global(L, "b") == "2");
+	lua_getglobal(L, "w");
+	lua_getfield(L, -1, "a");
+	CHECK(lua_getupvalue(L, -1, 1) != nullptr);
+	CHECK(lua_getmetatable(L, -1));
+	lua_getfield(L, -4, "b");
+	CHECK(lua_getupvalue(L, -1, 1) != nullptr);
+	CHECK(lua_getmetatable(L, -1));
+	CHECK(lua_rawequal(L, -1, -4));
+	lua_settop(L, 0);
+
+	lua_close(L);
+	CHECK(Cat::alive == 0);
+}
+
+// async call which cannot suspend its coroutine submits nothing.
+static void checkAsyncCannotSuspend()
+{
+	std::vector<std::function<void()>> jobs;
+	CompletionQueue queue([&jobs](std::function<void()> job) { jobs.push_back(std::move(job)); });
+
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	LuaModule(L, "w").fun("twice", queue.async([](int x) { return x * 2; }));
+
+	CHECK(run(L,
+		"co = coroutine.create(function()\n"
+		"	gsub = pcall(string.gsub, 'a', '.', function() w.twice(1) end)\n"
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM < 503
+		"	plain = pcall(w.twice, 1)\n"
+#endif
+		"	user = coroutine.yield('user')\n"
+		"end)\n"
+		"ok, yielded = coroutine.resume(co)\n"));
+	CHECK(global(L, "gsub") == "false");
+	CHECK(global(L, "plain") == "false" || global(L, "plain") == "nil");
+	CHECK(global(L, "yielded") == "user");
+	CHECK(jobs.empty());
+	CHECK(queue.pending() == 0);
+	CHECK(queue.drain() == 0);
+	CHECK(global(L, "user") == "nil");
+	lua_close(L);
+}
+
+// arguments of deferred commands must outlive the call which recorded them.
+static void checkDeferredArguments()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	{
+		CommandBuffer commands(L);
+		LuaClass<Cat>(L, "Cat").ctor<std::string>()
+			.fun("getName", &Cat::getName)
+			.fun("getAge", &Cat::getAge)
+			.fun("setName", commands.defer(&Cat::setName));
+		LuaModule(L, "w")
+			.fun("rename", commands.defer([](Cat * cat, const char * name) { cat->setName(name); }))
+			.fun("grow", commands.defer([](Cat & cat) { cat.setAge(cat.getAge() + 1); }));
+
+		CHECK(run(L,
+			"local x = 'y'\n"
+			"cat = Cat.new('tom')\n"
+			"cat:setName(string.rep('x', 1000) .. x)\n"
+			"w.rename(Cat.new('kitty'), string.rep('z', 100) .. x)\n"
+			"w.grow(cat)\n"
+			"collectgarbage() collectgarbage()\n"));
+		CHECK(Cat::alive == 2);
+		CHECK(commands.apply() == 3);
+		CHECK(run(L, "name = cat:getName() age = cat:getAge()"));
+		CHECK(global(L, "name") == std::string(1000, 'x') + "y");
+		CHECK(global(L, "age") == "2");
+
+		CHECK(run(L, "collectgarbage() collectgarbage()"));
+		CHECK(Cat::alive == 1);
+	}
+	lua_close(L);
+}
+
+// commands recorded after a small block was skipped are still applied.
+static void checkDeferredSkippedBlock()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	{
+		CommandBuffer commands(L, 64);
+		LuaModule(L, "w")
+			.fun("add", commands.defer([](int x) { total += x; }))
+			.fun("add6", commands.defer([](double a, double b, double c, double d, double e, double f) { total += int(a + b + c + d + e + f); }));
+
+		total = 0;
+		CHECK(run(L, "w.add(1) w.add6(1, 2, 3, 4, 0, 0)"));
+		CHECK(commands.apply() == 2);
+		CHECK(total == 11);
+		CHECK(run(L, "w.add6(1, 1, 1, 1, 0, 0)"));
+		CHECK(commands.apply() == 1);
+		CHECK(total == 15);
+		CHECK(run(L, "w.add6(2, 2, 2, 2, 0, 0) w.add(3)"));
+		CHECK(commands.apply() == 2);
+		CHECK(total == 26);
+		CHECK(commands.size() == 0);
+	}
+	lua_close(L);
+}
+
+static int hostLines = 0;
+
+static void hostHook(lua_State *, lua_Debug * ar)
+{
+	if (ar->event == LUA_HOOKLINE)
+	{
+		++hostLines;
+	}
+}
+
+// watchdog keeps the hook installed before it armed.
+static void checkWatchdogHooks()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	{
+		lua_sethook(L, hostHook, LUA_MASKLINE, 0);
+		Watchdog watchdog(L);
+		watchdog.setBudget(100000, 0);
+
+		CHECK(luaL_loadstring(L, "local n = 0\nfor i = 1, 1e9 do\nn = n + i\nend") == 0);
+		CHECK(watchdog.pcall(0, 0) != 0);
+		CHECK(watchdog.exceeded());
+		lua_pop(L, 1);
+		CHECK(hostLines > 1000);
+		CHECK(lua_gethook(L) == hostHook);
+		CHECK(lua_gethookmask(L) == LUA_MASKLINE);
+
+		hostLines = 0;
+		CHECK(luaL_loadstring(L, "local n = 0\nfor i = 1, 10 do\nn = n + i\nend") == 0);
+		CHECK(watchdog.pcall(0, 0) == 0);
+		CHECK(!watchdog.exceeded());
+		CHECK(hostLines > 10);
+		CHECK(lua_gethook(L) == hostHook);
+	}
+	CHECK(lua_gethook(L) == hostHook);
+	lua_close(L);
+}
+
+// sampling profiler doesn't replace an armed watchdog budget.
+static void checkProfilerHooks()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	{
+		Watchdog watchdog(L);
+		watchdog.setBudget(0, 200000);
+		SamplingProfiler profiler(L, 1000);
+
+		CHECK(luaL_loadstring(L, "local n = 0\nwhile true do\nn = n + 1\nend") == 0);
+		watchdog.arm();
+		profiler.start();
+		CHECK(lua_pcall(L, 0, 0, 0) != 0);
+		profiler.stop();
+		watchdog.disarm();
+		lua_pop(L, 1);
+		CHECK(watchdog.exceeded());
+		CHECK(profiler.samples() > 0);
+		CHECK(lua_gethook(L) == nullptr);
+
+		profiler.start();
+		CHECK(luaL_loadstring(L, "local n = 0\nwhile true do\nn = n + 1\nend") == 0);
+		CHECK(watchdog.pcall(0, 0) != 0);
+		lua_pop(L, 1);
+		CHECK(watchdog.exceeded());
+		CHECK(lua_gethook(L) != nullptr);
+		profiler.stop();
+		CHECK(lua_gethook(L) == nullptr);
+	}
+	lua_close(L);
+}
+
+// turning lua tracing off keeps an armed watchdog budget.
+static void checkTracerHooks()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	{
+		Watchdog watchdog(L);
+		watchdog.setBudget(100000, 0);
+		Tracer::start();
+
+		watchdog.arm();
+		Tracer::traceLua(L, true);
+		CHECK(run(L, "local function f() return 1 end f()"));
+		Tracer::traceLua(L, false);
+		CHECK(lua_gethookmask(L) == LUA_MASKCOUNT);
+		CHECK(luaL_loadstring(L, "while true do end") == 0);
+		CHECK(lua_pcall(L, 0, 0, 0) != 0);
+		lua_pop(L, 1);
+		CHECK(watchdog.exceeded());
+		watchdog.disarm();
+		CHECK(lua_gethook(L) == nullptr);
+
+		Tracer::traceLua(L, true);
+		CHECK(luaL_loadstring(L, "while true do end") == 0);
+		CHECK(watchdog.pcall(0, 0) != 0);
+		lua_pop(L, 1);
+		CHECK(lua_gethookmask(L) == (LUA_MASKCALL | LUA_MASKRET));
+		Tracer::traceLua(L, false);
+		CHECK(lua_gethook(L) == nullptr);
+
+		Tracer::stop();
+	}
+	lua_close(L);
+}
+
+// allocation tracer line hook survives watchdog runs.
+static void checkAllocTracerHooks()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	{
+		lua_sethook(L, hostHook, LUA_MASKLINE, 0);
+		AllocTracer tracer(L);
+		Watchdog watchdog(L);
+		watchdog.setBudget(100000, 0);
+
+		hostLines = 0;
+		CHECK(luaL_loadstring(L, "local t = {}\nfor i = 1, 100 do\nt[i] = {}\nend") == 0);
+		CHECK(watchdog.pcall(0, 0) == 0);
+		CHECK(lua_gethookmask(L) == LUA_MASKLINE);
+		CHECK(hostLines > 100);
+		CHECK(!tracer.top(1).empty() && tracer.top(1)[0].name == "[string \"local t = {}...\"]:3");
+	}
+	CHECK(lua_gethook(L) == hostHook);
+	lua_sethook(L, nullptr, 0, 0);
+	lua_close(L);
+}
+
+// class bound to several states works after some of them are closed.
+static void checkClassAcrossStates()
+{
+	lua_State * states[3];
+	for (auto& L : states)
+	{
+		L = luaL_newstate();
+		luaL_openlibs(L);
+		LuaClass<Cat>(L, "Cat").ctor<std::string>().fun("getName", &Cat::getName);
+		CHECK(run(L, "cat = Cat.new('tom')"));
+	}
+	lua_close(states[0]);
+	lua_close(states[1]);
+	CHECK(run(states[2], "name = cat:getName() cat = nil collectgarbage()"));
+	CHECK(global(states[2], "name") == "tom");
+	lua_close(states[2]);
+	CHECK(Cat::alive == 0);
+
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	LuaClass<Cat>(L, "Cat").ctor<std::string>().fun("getName", &Cat::getName);
+	CHECK(run(L, "name = Cat.new('kitty'):getName()"));
+	CHECK(global(L, "name") == "kitty");
+	lua_close(L);
+}
+
+struct Sensors
+{
+	double temperature;
+	int samples;
+};
+
+// snapshot view may outlive the state it was bound to.
+static void checkSnapshotView()
+{
+	Snapshot<Sensors> sensors;
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	auto view = sensors.bind(L, "sensors");
+	view.field("temperature", &Sensors::temperature);
+	view.field("samples", &Sensors::samples);
+
+	Sensors frame = { 21.5, 3 };
+	sensors.publish(frame);
+	CHECK(sensors.acquire());
+	CHECK(run(L, "t = sensors.temperature n = sensors.samples"));
+	CHECK(global(L, "t") == "21.5");
+	CHECK(global(L, "n") == "3");
+	lua_close(L);
+}
+
+// globals table gets its own __index back once all lazy binders ran.
+static void checkLazyUnhook()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	CHECK(run(L, "setmetatable(_G, { __index = function(t, k) return 'default' end })"));
+	lazy(L, "Cat", [](lua_State * L) { LuaClass<Cat>(L, "Cat").ctor<std::string>().fun("getName", &Cat::getName); });
+	lazy(L, "util", [](lua_State * L) { LuaModule(L, "util").def("answer", 42); });
+
+	CHECK(run(L, "name = Cat.new('tom'):getName() other = missing"));
+	CHECK(global(L, "name") == "tom");
+	CHECK(global(L, "other") == "default");
+	CHECK(run(L, "hooked = type(getmetatable(_G).__index) == 'function' and getmetatable(_G).__index ~= nil"));
+
+	CHECK(run(L, "answer = require('util').answer index = getmetatable(_G).__index('x', 'y')"));
+	CHECK(global(L, "answer") == "42");
+	CHECK(global(L, "index") == "default");
+	lua_getglobal(L, "getmetatable");
+	lua_getglobal(L, "_G");
+	lua_call(L, 1, 1);
+	lua_getfield(L, -1, "__index");
+	CHECK(lua_tocfunction(L, -1) == nullptr);
+	lua_pop(L, 2);
+
+	lazy(L, "broken", [](lua_State * L) { luaL_error(L, "binder failed"); });
+	CHECK(!run(L, "x = broken"));
+	CHECK(run(L, "again = broken"));
+	CHECK(global(L, "again") == "default");
+
+	lazy(L, "later", [](lua_State * L) { LuaModule(L, "later").def("value", 1); });
+	CHECK(run(L, "value = later.value other = missing"));
+	CHECK(global(L, "value") == "1");
+	CHECK(global(L, "other") == "default");
+	lua_getglobal(L, "getmetatable");
+	lua_getglobal(L, "_G");
+	lua_call(L, 1, 1);
+	lua_getfield(L, -1, "__index");
+	CHECK(lua_tocfunction(L, -1) == nullptr);
+	lua_pop(L, 2);
+	lua_close(L);
+}
+
+// task whose suspension failed is not left linked in the scheduler.
+static void checkSchedulerFailedYield()
+{
+	lua_State * L = luaL_newstate();
+	luaL_openlibs(L);
+	{
+		Scheduler scheduler(L, "task");
+		CHECK(run(L,
+			"task.spawn(function()\n"
+			"	failed = not pcall(string.gsub, 'a', '.', function() task.sleep(10) end)\n"
+			"	task.sleep(5)\n"
+			"	slept = true\n"
+			"	failed = failed and not pcall(string.gsub, 'a', '.', function() task.wait(3) end)\n"
+			"	task.wait(7)\n"
+			"	done = true\n"
+			"end)"));
+		scheduler.tick(1);
+		CHECK(global(L, "failed") == "true");
+		scheduler.tick(4);
+		CHECK(global(L, "slept") == "nil");
+		scheduler.tick(6);
+		CHECK(global(L, "slept") == "true");
+		CHECK(scheduler.signal(3) == 0);
+		scheduler.tick(11);
+		CHECK(global(L, "done") == "nil");
+		CHECK(scheduler.signal(7) == 1);
+		scheduler.tick(12);
+		CHECK(global(L, "failed") == "true");
+		CHECK(global(L, "done") == "true");
+		CHECK(scheduler.size() == 0);
+	}
+	lua_close(L);
+}
+
+int main()
+{
+	checkIntegralOverload();
+	checkCalleeMetatable();
+	checkAsyncArguments();
+	checkAsyncCannotSuspend();
+	checkDeferredArguments();
+	checkDeferredSkippedBlock();
+	checkWatchdogHooks();
+	checkProfilerHooks();
+	checkTracerHooks();
+	checkAllocTracerHooks();
+	checkClassAcrossStates();
+	checkSnapshotView();
+	checkLazyUnhook();
+	checkSchedulerFailedYield();
+
+	LOG("%s, %d failed\n", failures == 0 ? "passed" : "FAILED", failures);
+	return failures;
+}
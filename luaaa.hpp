@@ -43,6 +43,13 @@ inline void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup) {
 
 #include <typeinfo>
 #include <utility>
+#include <type_traits>
+#include <limits>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cassert>
+#include <new>
 
 #if defined(_MSC_VER)
 #   define RTTI_CLASS_NAME(a) typeid(a).name() //vc always has this operator even if RTTI was disabled.
@@ -56,9 +63,18 @@ inline void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup) {
 
 #ifndef LUAAA_WITHOUT_CPP_STDLIB
 #   include <string>
-#else
-#   include <type_traits>
-#   include <cstring>
+#   include <atomic>
+#endif
+
+/// set LUAAA_WITH_PROFILER to record calls, time and allocations of each binding, see luaaa::Profiler.
+//#define LUAAA_WITH_PROFILER 1
+#if LUAAA_WITH_PROFILER
+#   ifdef LUAAA_WITHOUT_CPP_STDLIB
+#       error "LUAAA_WITH_PROFILER needs C++ std libs"
+#   endif
+#   include <atomic>
+#   include <chrono>
+#   include <mutex>
 #endif
 
 
@@ -96,6 +112,15 @@ namespace LUAAA_NS
 
 	template <typename>	struct LuaClass;
 
+    //========================================================
+    // compile-time helpers
+    //========================================================
+    template<size_t ...I> struct IndexSequence {};
+    template<size_t N, size_t ...I> struct MakeIndexSequence : public MakeIndexSequence<N - 1, N - 1, I...> {};
+    template<size_t ...I> struct MakeIndexSequence<0, I...> { typedef IndexSequence<I...> type; };
+
+    template<typename> struct VoidType { typedef void type; };
+
 	//========================================================
 	// Lua stack operator
 	//========================================================
@@ -335,14 +360,340 @@ namespace LUAAA_NS
         }
     };
 
-	// push ret data to stack
+	//========================================================
+	// Lua type matcher, used by overload dispatch
+	//========================================================
+    inline bool isLuaClassInstance(lua_State * L, int idx, const char * klassName)
+    {
+        if (klassName == nullptr || lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx))
+        {
+            return false;
+        }
+        luaL_getmetatable(L, klassName);
+        const bool matched = lua_rawequal(L, -1, -2) != 0;
+        lua_pop(L, 2);
+        return matched;
+    }
+
+    // specialize LuaStackMatcher along with custom LuaStack to make the type overloadable.
+    template <typename T, typename = void> struct LuaStackMatcher
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            if (LuaClass<T>::klassName != nullptr)
+            {
+                return isLuaClassInstance(L, idx, LuaClass<T>::klassName);
+            }
+            return !lua_isnone(L, idx);
+        }
+    };
+
+    template <typename T> struct LuaStackMatcher<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            return lua_type(L, idx) == LUA_TNUMBER;
+        }
+    };
+
+    template <typename T> struct LuaStackMatcher<T, typename std::enable_if<std::is_integral<T>::value>::type>
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            if (lua_type(L, idx) != LUA_TNUMBER)
+            {
+                return false;
+            }
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L, idx))
+            {
+                return fits(lua_tointeger(L, idx), std::is_signed<T>());
+            }
+#endif
+            return fits(lua_tonumber(L, idx));
+        }
+
+    private:
+        // casting NaN, infinity or out of range number is undefined, range of T is checked first.
+        inline static bool fits(lua_Number n)
+        {
+            const lua_Number lower = lua_Number(std::numeric_limits<T>::min());
+            // 2^digits of T, exact in lua_Number unlike max().
+            const lua_Number upper = (lua_Number(std::numeric_limits<T>::max() / 2) + 1) * 2;
+            return n >= lower && n < upper && lua_Number(T(n)) == n;
+        }
+
+        inline static bool fits(long long n, std::true_type)
+        {
+            return n >= (long long)std::numeric_limits<T>::min() && n <= (long long)std::numeric_limits<T>::max();
+        }
+
+        inline static bool fits(long long n, std::false_type)
+        {
+            return n >= 0 && (unsigned long long)n <= (unsigned long long)std::numeric_limits<T>::max();
+        }
+    };
+
+    template <typename T> struct LuaStackMatcher<T*>
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            switch (lua_type(L, idx))
+            {
+            case LUA_TNIL:
+                return true;
+            case LUA_TFUNCTION:
+                return std::is_function<T>::value;
+            case LUA_TLIGHTUSERDATA:
+                return !std::is_function<T>::value;
+            case LUA_TUSERDATA:
+                return isLuaClassInstance(L, idx, LuaClass<T*>::klassName) || isLuaClassInstance(L, idx, LuaClass<T>::klassName);
+            default:
+                return false;
+            }
+        }
+    };
+
+    template<> struct LuaStackMatcher<bool>
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            return lua_type(L, idx) == LUA_TBOOLEAN;
+        }
+    };
+
+    template<> struct LuaStackMatcher<const char *>
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            return lua_type(L, idx) == LUA_TSTRING;
+        }
+    };
+
+    template<> struct LuaStackMatcher<char *> : public LuaStackMatcher<const char *> {};
+
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+    template<> struct LuaStackMatcher<std::string> : public LuaStackMatcher<const char *> {};
+#endif
+
+    template<> struct LuaStackMatcher<lua_State *>
+    {
+        inline static bool match(lua_State *, int)
+        {
+            return true;
+        }
+    };
+
+	// push ret data to stack, return count of values pushed.
 	template <typename T>
-	inline void LuaStackReturn(lua_State * L, T t)
+	struct LuaStackReturnValue
 	{
-		lua_settop(L, 0);
-		LuaStack<T>::put(L, t);
+		inline static int put(lua_State * L, const T & t)
+		{
+			lua_settop(L, 0);
+			LuaStack<T>::put(L, t);
+			return 1;
+		}
+	};
+
+	template <typename T> struct LuaStackReturnValue<const T> : public LuaStackReturnValue<T> {};
+	template <typename T> struct LuaStackReturnValue<T&> : public LuaStackReturnValue<T> {};
+	template <typename T> struct LuaStackReturnValue<const T&> : public LuaStackReturnValue<T> {};
+
+	template <typename T>
+	inline int LuaStackReturn(lua_State * L, T t)
+	{
+		return LuaStackReturnValue<T>::put(L, std::forward<T>(t));
 	}
 
+	// returned by bound function to suspend the calling coroutine,
+	// host resumes it with resumePending or failPending when the operation completes.
+	struct LuaPending
+	{
+		// count of results returned by Invoke for pending call, output arguments are dropped.
+		enum { results = -0x10000 };
+	};
+
+	template <>
+	struct LuaStackReturnValue<LuaPending>
+	{
+		inline static int put(lua_State *, const LuaPending&)
+		{
+			return LuaPending::results;
+		}
+	};
+
+	//========================================================
+	// struct binding, declared with LUAAA_STRUCT(TYPE, fields...)
+	//========================================================
+
+    // field list of a plain struct, specialized by LUAAA_STRUCT.
+    template <typename T> struct LuaStructFields;
+
+    template <typename T>
+    struct LuaStructStack
+    {
+        typedef LuaStructFields<T> Fields;
+
+        inline static T get(lua_State * L, int idx)
+        {
+            T result = T();
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (idx < 0 && idx > LUA_REGISTRYINDEX)
+            {
+                idx = lua_gettop(L) + idx + 1;
+            }
+            luaL_checkstack(L, 3, "struct too deep");
+            Getter getter = { L, pushKeys(L), idx, 0 };
+            Fields::visit(getter, result);
+            lua_pop(L, 1);
+            return result;
+        }
+
+        inline static void put(lua_State * L, const T & t)
+        {
+            luaL_checkstack(L, 4, "struct too deep");
+            const int keys = pushKeys(L);
+            lua_createtable(L, 0, Fields::count);
+            Putter putter = { L, keys, keys + 1, 0 };
+            Fields::visit(putter, t);
+            lua_remove(L, keys);
+        }
+
+    private:
+        struct Getter
+        {
+            lua_State * L;
+            int keys;
+            int table;
+            int index;
+
+            template <typename M> void operator()(M & value)
+            {
+                lua_rawgeti(L, keys, ++index);
+                lua_rawget(L, table);
+                if (!lua_isnil(L, -1))
+                {
+                    value = LuaStack<M>::get(L, lua_gettop(L));
+                }
+                lua_pop(L, 1);
+            }
+        };
+
+        struct Putter
+        {
+            lua_State * L;
+            int keys;
+            int table;
+            int index;
+
+            template <typename M> void operator()(const M & value)
+            {
+                lua_rawgeti(L, keys, ++index);
+                LuaStack<M>::put(L, value);
+                lua_rawset(L, table);
+            }
+        };
+
+        // field names are interned once per state, the key array lives in registry.
+        inline static int pushKeys(lua_State * L)
+        {
+            static const char tag = 0;
+            lua_pushlightuserdata(L, (void*)&tag);
+            lua_rawget(L, LUA_REGISTRYINDEX);
+            if (lua_isnil(L, -1))
+            {
+                lua_pop(L, 1);
+                lua_createtable(L, Fields::count, 0);
+                const char * const * names = Fields::names();
+                for (int i = 0; i < Fields::count; ++i)
+                {
+                    lua_pushstring(L, names[i]);
+                    lua_rawseti(L, -2, i + 1);
+                }
+                lua_pushlightuserdata(L, (void*)&tag);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, LUA_REGISTRYINDEX);
+            }
+            return lua_gettop(L);
+        }
+    };
+
+    struct LuaStructMatcher
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            return lua_istable(L, idx);
+        }
+    };
+
+#define LUAAA_STRUCT_EXPAND(x) x
+#define LUAAA_STRUCT_CONCAT_(a, b) a##b
+#define LUAAA_STRUCT_CONCAT(a, b) LUAAA_STRUCT_CONCAT_(a, b)
+#define LUAAA_STRUCT_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, N, ...) N
+#define LUAAA_STRUCT_COUNT(...) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_COUNT_(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define LUAAA_STRUCT_EACH(M, ...) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_CONCAT(LUAAA_STRUCT_EACH_, LUAAA_STRUCT_COUNT(__VA_ARGS__))(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_1(M, a) M(a)
+#define LUAAA_STRUCT_EACH_2(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_1(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_3(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_2(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_4(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_3(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_5(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_4(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_6(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_5(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_7(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_6(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_8(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_7(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_9(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_8(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_10(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_9(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_11(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_10(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_12(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_11(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_13(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_12(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_14(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_13(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_15(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_14(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_16(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_15(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_17(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_16(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_18(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_17(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_19(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_18(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_20(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_19(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_21(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_20(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_22(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_21(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_23(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_22(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_24(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_23(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_25(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_24(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_26(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_25(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_27(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_26(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_28(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_27(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_29(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_28(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_30(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_29(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_31(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_30(M, __VA_ARGS__))
+#define LUAAA_STRUCT_EACH_32(M, a, ...) M(a) LUAAA_STRUCT_EXPAND(LUAAA_STRUCT_EACH_31(M, __VA_ARGS__))
+#define LUAAA_STRUCT_NAME(field) #field,
+#define LUAAA_STRUCT_VISIT(field) visitor(value.field);
+
+// LUAAA_STRUCT(Point, x, y, z) maps a plain struct to lua table and back, up to 32 fields.
+// use it at global scope after the struct definition.
+#define LUAAA_STRUCT(TYPE, ...) \
+    namespace LUAAA_NS \
+    { \
+        template <> struct LuaStructFields<TYPE> \
+        { \
+            enum { count = LUAAA_STRUCT_COUNT(__VA_ARGS__) }; \
+            inline static const char * const * names() \
+            { \
+                static const char * const fields[] = { LUAAA_STRUCT_EACH(LUAAA_STRUCT_NAME, __VA_ARGS__) }; \
+                return fields; \
+            } \
+            template <typename V> inline static void visit(V & visitor, TYPE & value) \
+            { \
+                LUAAA_STRUCT_EACH(LUAAA_STRUCT_VISIT, __VA_ARGS__) \
+            } \
+            template <typename V> inline static void visit(V & visitor, const TYPE & value) \
+            { \
+                LUAAA_STRUCT_EACH(LUAAA_STRUCT_VISIT, __VA_ARGS__) \
+            } \
+        }; \
+        template <> struct LuaStack<TYPE> : public LuaStructStack<TYPE> {}; \
+        template <> struct LuaStackMatcher<TYPE> : public LuaStructMatcher {}; \
+    }
+
 #define IMPLEMENT_CALLBACK_INVOKER(CALLCONV) \
 	template<typename RET, typename ...ARGS> \
 	struct LuaStack<RET(CALLCONV*)(ARGS...)> \
@@ -429,1340 +780,7023 @@ namespace LUAAA_NS
 
 
 	//========================================================
-	// non-member function caller & static member function caller
+	// argument list operator
 	//========================================================
-    template<typename TRET>
-    inline TRET stackOperatorCaller(lua_State* state, TRET(*getter)(lua_State*, int), const int count, const int skip, int * pidx)
+    // value list, stores default values of arguments.
+    template<size_t I, typename T>
+    struct LuaValue
     {
-#if defined(__clang__)
-        int offset = (*pidx) + skip + 1;
-#else
-        int offset = (count - (*pidx)) + skip;
-#endif
-        ++(*pidx);
-        return (*getter)(state, offset);
-    }
+        T value;
+    };
 
-#define IMPLEMENT_FUNCTION_CALLER(CALLERNAME, CALLCONV, SKIPPARAM) \
-    template<typename TRET, typename ...ARGS> \
-	lua_CFunction CALLERNAME(TRET(CALLCONV*func)(ARGS...)) \
-	{ \
-		typedef decltype(func) FTYPE; (void)(func); \
-		struct HelperClass \
-		{ \
-			static int Invoke(lua_State* state) \
-			{ \
-				void * calleePtr = lua_touserdata(state, lua_upvalueindex(1)); \
-				luaL_argcheck(state, calleePtr, 1, "cpp closure function not found."); \
-				if (calleePtr) \
-				{ \
-					int idx = 0; (void)(idx); \
-					LuaStackReturn<TRET>(state, (*(FTYPE*)(calleePtr))(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), SKIPPARAM, &idx)...)); \
-					return 1; \
-				} \
-				return 0; \
-			} \
-		}; \
-		return HelperClass::Invoke; \
-	} \
-	template<typename ...ARGS> \
-	lua_CFunction CALLERNAME(void(CALLCONV*func)(ARGS...)) \
-	{ \
-		typedef decltype(func) FTYPE; (void)(func); \
-		struct HelperClass \
-		{ \
-			static int Invoke(lua_State* state) \
-			{ \
-				void * calleePtr = lua_touserdata(state, lua_upvalueindex(1)); \
-				luaL_argcheck(state, calleePtr, 1, "cpp closure function not found."); \
-				if (calleePtr) \
-				{ \
-					int idx = 0; (void)(idx); \
-					(*(FTYPE*)(calleePtr))(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), SKIPPARAM, &idx)...); \
-				} \
-				return 0; \
-			} \
-		}; \
-		return HelperClass::Invoke; \
-	}
+    template<typename SEQ, typename ...T> struct LuaValueList;
 
-#if defined(_MSC_VER)	
-	IMPLEMENT_FUNCTION_CALLER(NonMemberFunctionCaller, __cdecl, 0);
-	IMPLEMENT_FUNCTION_CALLER(MemberFunctionCaller, __cdecl, 1);
-	IMPLEMENT_CALLBACK_INVOKER(__cdecl);
+    template<size_t ...I, typename ...T>
+    struct LuaValueList<IndexSequence<I...>, T...> : public LuaValue<I, T>...
+    {
+        LuaValueList(T... values) : LuaValue<I, T>{ values }... {}
+    };
 
-#	ifdef _M_CEE
-	IMPLEMENT_FUNCTION_CALLER(NonMemberFunctionCaller, __clrcall, 0);
-	IMPLEMENT_FUNCTION_CALLER(MemberFunctionCaller, __clrcall, 1);
-	IMPLEMENT_CALLBACK_INVOKER(__clrcall);
-#	endif
+    template<typename ...T>
+    struct LuaValues : public LuaValueList<typename MakeIndexSequence<sizeof...(T)>::type, T...>
+    {
+        enum { size = sizeof...(T) };
 
-#	if defined(_M_IX86) && !defined(_M_CEE)
-	IMPLEMENT_FUNCTION_CALLER(NonMemberFunctionCaller, __fastcall, 0);
-	IMPLEMENT_FUNCTION_CALLER(MemberFunctionCaller, __fastcall, 1);
-	IMPLEMENT_CALLBACK_INVOKER(__fastcall);
-#	endif
+        LuaValues(T... values) : LuaValueList<typename MakeIndexSequence<sizeof...(T)>::type, T...>(values...) {}
 
-#	ifdef _M_IX86
-	IMPLEMENT_FUNCTION_CALLER(NonMemberFunctionCaller, __stdcall, 0);
-	IMPLEMENT_FUNCTION_CALLER(MemberFunctionCaller, __stdcall, 1);
-	IMPLEMENT_CALLBACK_INVOKER(__stdcall);
-#	endif
+        template<size_t I, typename V>
+        inline static const V & at(const LuaValue<I, V>& v)
+        {
+            return v.value;
+        }
+    };
 
-#	if ((defined(_M_IX86) && _M_IX86_FP >= 2) || defined(_M_X64)) && !defined(_M_CEE)
-	IMPLEMENT_FUNCTION_CALLER(NonMemberFunctionCaller, __vectorcall, 0);
-	IMPLEMENT_FUNCTION_CALLER(MemberFunctionCaller, __vectorcall, 1);
-	IMPLEMENT_CALLBACK_INVOKER(__vectorcall);
-#	endif
-#elif defined(__clang__)
-#	define _NOTHING
-    IMPLEMENT_FUNCTION_CALLER(NonMemberFunctionCaller, _NOTHING, 0);
-    IMPLEMENT_FUNCTION_CALLER(MemberFunctionCaller, _NOTHING, 1);
-    IMPLEMENT_CALLBACK_INVOKER(_NOTHING);
-#	undef _NOTHING	
-#elif defined(__GNUC__)
-#	define _NOTHING
-	IMPLEMENT_FUNCTION_CALLER(NonMemberFunctionCaller, _NOTHING, 0);
-	IMPLEMENT_FUNCTION_CALLER(MemberFunctionCaller, _NOTHING, 1);
-	IMPLEMENT_CALLBACK_INVOKER(_NOTHING);
-#	undef _NOTHING	
-#else
-#	define _NOTHING	
-	IMPLEMENT_FUNCTION_CALLER(NonMemberFunctionCaller, _NOTHING, 0);
-	IMPLEMENT_FUNCTION_CALLER(MemberFunctionCaller, _NOTHING, 1);
-	IMPLEMENT_CALLBACK_INVOKER(_NOTHING);
-#	undef _NOTHING		
-#endif	
+    // non-const lvalue reference to value type is an output argument:
+    // it takes no lua argument, callee writes to a stack-local temporary,
+    // which is pushed back to lua as extra result after the return value.
+    template<typename T>
+    struct LuaOutputArgument
+    {
+        enum { value = false };
+    };
 
-	//========================================================
-	// member function invoker
-	//========================================================
-    template<typename TCLASS, typename TRET, typename ...ARGS>
-    lua_CFunction MemberFunctionCaller(TRET(TCLASS::*func)(ARGS...))
+    template<typename T>
+    struct LuaOutputArgument<T&>
     {
-        typedef decltype(func) FTYPE; (void)(func);
-        struct HelperClass
-        {
-            static int Invoke(lua_State* state)
-            {
-                void * calleePtr = lua_touserdata(state, lua_upvalueindex(1));
-                luaL_argcheck(state, calleePtr, 1, "cpp closure function not found.");
-                if (calleePtr)
-                {
-                    int idx = 0; (void)(idx);
-                    LuaStackReturn<TRET>(state, (LuaStack<TCLASS>::get(state, 1).**(FTYPE*)(calleePtr))(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), 1, &idx)...));
-                    return 1;
-                }
-                return 0;
-            }
-        };
-        return HelperClass::Invoke;
-    }
+        enum { value = !std::is_const<T>::value && !std::is_lvalue_reference<decltype(LuaStack<T>::get(nullptr, 0))>::value };
+    };
 
-    template<typename TCLASS, typename TRET, typename ...ARGS>
-    lua_CFunction MemberFunctionCaller(TRET(TCLASS::*func)(ARGS...)const)
+    // argument which can be absent from lua side, e.g. std::optional<T>.
+    template<typename T>
+    struct LuaOptionalArgument
     {
-        typedef decltype(func) FTYPE; (void)(func);
-        struct HelperClass
-        {
-            static int Invoke(lua_State* state)
-            {
-                void * calleePtr = lua_touserdata(state, lua_upvalueindex(1));
-                luaL_argcheck(state, calleePtr, 1, "cpp closure function not found.");
-                if (calleePtr)
-                {
-                    int idx = 0; (void)(idx);
-                    LuaStackReturn<TRET>(state, (LuaStack<TCLASS>::get(state, 1).**(FTYPE*)(calleePtr))(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), 1, &idx)...));
-                    return 1;
-                }
-                return 0;
-            }
-        };
-        return HelperClass::Invoke;
-    }
+        enum { value = false };
+    };
 
-    template<typename TCLASS, typename ...ARGS>
-    lua_CFunction MemberFunctionCaller(void(TCLASS::*func)(ARGS...))
+    template<typename T> struct LuaOptionalArgument<const T> : public LuaOptionalArgument<T> {};
+    template<typename T> struct LuaOptionalArgument<T&> : public LuaOptionalArgument<T> {};
+    template<typename T> struct LuaOptionalArgument<const T&> : public LuaOptionalArgument<T> {};
+    template<typename T> struct LuaOptionalArgument<T&&> : public LuaOptionalArgument<T> {};
+
+    template<size_t I, typename T, bool = LuaOutputArgument<T>::value>
+    struct LuaArgument
     {
-        typedef decltype(func) FTYPE; (void)(func);
-        struct HelperClass
+        typedef decltype(LuaStack<T>::get(nullptr, 0)) ValueType;
+
+        enum { slots = 1, required = !LuaOptionalArgument<T>::value };
+
+        inline static bool match(lua_State * state, int idx)
         {
-            static int Invoke(lua_State* state)
-            {
-                void * calleePtr = lua_touserdata(state, lua_upvalueindex(1));
-                luaL_argcheck(state, calleePtr, 1, "cpp closure function not found.");
-                if (calleePtr)
-                {
-                    int idx = 0; (void)(idx);
-                    (LuaStack<TCLASS>::get(state, 1).**(FTYPE*)(calleePtr))(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), 1, &idx)...);
-                }
-                return 0;
-            }
-        };
-        return HelperClass::Invoke;
-    }
+            return LuaStackMatcher<typename std::decay<T>::type>::match(state, idx);
+        }
 
-    template<typename TCLASS, typename ...ARGS>
-    lua_CFunction MemberFunctionCaller(void(TCLASS::*func)(ARGS...)const)
-    {
-        typedef decltype(func) FTYPE; (void)(func);
-        struct HelperClass
+        inline ValueType get(lua_State * state, int idx)
         {
-            static int Invoke(lua_State* state)
-            {
-                void * calleePtr = lua_touserdata(state, lua_upvalueindex(1));
-                luaL_argcheck(state, calleePtr, 1, "cpp closure function not found.");
-                if (calleePtr)
-                {
-                    int idx = 0; (void)(idx);
-                    (LuaStack<TCLASS>::get(state, 1).**(FTYPE*)(calleePtr))(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), 1, &idx)...);
-                }
-                return 0;
-            }
-        };
-        return HelperClass::Invoke;
-    }
-    
-	//========================================================
-	// constructor invoker
-	//========================================================
-    template<typename TCLASS, typename ...ARGS>
-    struct ConstructorCaller
-    {
-        static TCLASS * Invoke(lua_State * state)
+            return LuaStack<T>::get(state, idx);
+        }
+
+        inline int put(lua_State *)
         {
-            (void)(state);
-            int idx = 0; (void)(idx);
-            return new TCLASS(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), 0, &idx)...);
+            return 0;
         }
     };
 
-    //========================================================
-    // Destructor invoker
-    //========================================================
-    template<typename TCLASS, bool = std::is_destructible<TCLASS>::value>
-    struct DestructorCaller {
-        static void Invoke(TCLASS * obj) {
-            delete obj;
+    template<size_t I, typename T>
+    struct LuaArgument<I, T&, true>
+    {
+        typedef T & ValueType;
+
+        enum { slots = 0, required = false };
+
+        LuaArgument() : value() {}
+
+        inline static bool match(lua_State *, int)
+        {
+            return true;
         }
-    };
 
-    template<typename TCLASS>
-    struct DestructorCaller<TCLASS, false> {
-        static void Invoke(TCLASS * obj) {
+        inline ValueType get(lua_State *, int)
+        {
+            return value;
         }
-    };
 
-    //========================================================
-    // export class
-    //========================================================
-	template <typename TCLASS>
-	struct LuaClass
-	{
-         friend struct DestructorCaller<TCLASS>;
-         template<typename> friend struct LuaStack;
-	public:
-		LuaClass(lua_State * state, const char * name, const luaL_Reg * functions = nullptr)
-			: m_state(state)
-		{
-            assert(state != nullptr);
-            assert(klassName == nullptr);
+        inline int put(lua_State * state)
+        {
+            LuaStack<T>::put(state, value);
+            return 1;
+        }
 
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
-			luaL_argcheck(state, (klassName == nullptr), 1, (std::string("C++ class `") + RTTI_CLASS_NAME(TCLASS) + "` bind to conflict lua name `" + name + "`, origin name: " + klassName).c_str());
-#else
-            luaL_argcheck(state, (klassName == nullptr), 1, "C++ class bind to conflict lua class name");
-#endif
+        T value;
+    };
 
-            struct HelperClass {
-                static int f__clsgc(lua_State* state) {
-                    LuaClass<TCLASS>::klassName = nullptr;
-                    return 0;
-                }
-            };
+    // lua_State * argument takes no lua argument, it receives the calling state (or coroutine).
+    template<size_t I>
+    struct LuaArgument<I, lua_State *, false>
+    {
+        typedef lua_State * ValueType;
 
-            size_t strBufLen = strlen(name) + 1;
-            klassName = reinterpret_cast<char *>(lua_newuserdata(state, strBufLen));
-            memcpy(klassName, name, strBufLen);
+        enum { slots = 0, required = false };
 
-            luaL_newmetatable(state, klassName);
-			lua_pushvalue(state, -1);
-			lua_setfield(state, -2, "__index");
-            luaL_Reg destructor[] = { { "__gc", HelperClass::f__clsgc }, { nullptr, nullptr } };
-            luaL_setfuncs(state, destructor, 0);
-			if (functions)
-			{
-				luaL_setfuncs(state, functions, 0);
-			}
-			lua_pop(state, 1);
-		}
+        inline static bool match(lua_State *, int)
+        {
+            return true;
+        }
 
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
-        LuaClass(lua_State * state, const std::string& name, const luaL_Reg * functions = nullptr)
-            : LuaClass(state, name.c_str(), functions)
-        {}
-#endif
+        inline ValueType get(lua_State * state, int)
+        {
+            return state;
+        }
 
-		template<typename ...ARGS>
-		inline LuaClass<TCLASS>& ctor(const char * name = "new")
-		{
-			struct HelperClass {
-                
-                static int f_gc(lua_State* state) {
-                    TCLASS ** objPtr = (TCLASS**)luaL_checkudata(state, -1, LuaClass<TCLASS>::klassName);
-                    if (objPtr)
-                    {
-                        DestructorCaller<TCLASS>::Invoke(*objPtr);
-                    }
-                    return 0;
-                }
+        inline int put(lua_State *)
+        {
+            return 0;
+        }
+    };
 
-				static int f_new(lua_State* state) {
-					auto obj = ConstructorCaller<TCLASS, ARGS...>::Invoke(state);
-					if (obj)
-					{   
-						TCLASS ** objPtr = (TCLASS**)lua_newuserdata(state, sizeof(TCLASS*));
-						if (objPtr)
-						{
-							*objPtr = obj;
-                            luaL_Reg destructor[] = { { "__gc", HelperClass::f_gc }, { nullptr, nullptr } };
-							luaL_getmetatable(state, LuaClass<TCLASS>::klassName);
-                            luaL_setfuncs(state, destructor, 0);
-                            lua_setmetatable(state, -2);
-							return 1;
-						}
-						else
-						{
-                            DestructorCaller<TCLASS>::Invoke(obj);
-						}
-					}
-					lua_pushnil(state);			
-					return 1;
-				}
-			};
+    // argument with a default value, J is index of the default value, -1 for none.
+    template<typename ARG, int J, bool = (J >= 0)>
+    struct LuaDefaultArgument
+    {
+        inline static bool match(lua_State * state, int idx)
+        {
+            return ARG::match(state, idx);
+        }
 
-			luaL_Reg constructor[] = { { name, HelperClass::f_new },{ nullptr, nullptr } };
-#if USE_NEW_MODULE_REGISTRY
-            lua_getglobal(m_state, klassName);
-            if (lua_isnil(m_state, -1))
+        template<typename VALUES>
+        inline static typename ARG::ValueType get(ARG & arg, lua_State * state, int idx, const VALUES&)
+        {
+            return arg.get(state, idx);
+        }
+    };
+
+    template<typename ARG, int J>
+    struct LuaDefaultArgument<ARG, J, true>
+    {
+        inline static bool match(lua_State * state, int idx)
+        {
+            return lua_isnoneornil(state, idx) || ARG::match(state, idx);
+        }
+
+        template<typename VALUES>
+        inline static typename ARG::ValueType get(ARG & arg, lua_State * state, int idx, const VALUES& values)
+        {
+            if (lua_isnoneornil(state, idx))
             {
-                lua_pop(m_state, 1);
-                lua_newtable(m_state);
+                return typename ARG::ValueType(VALUES::template at<J>(values));
             }
-            luaL_setfuncs(m_state, constructor, 0);
-            lua_setglobal(m_state, klassName);
-#else
-            luaL_openlib(m_state, klassName, constructor, 0);
-#endif
-
-			return (*this);
-		}
+            return arg.get(state, idx);
+        }
+    };
 
-        template<typename ...ARGS>
-        inline LuaClass<TCLASS>& ctor(const char * name, TCLASS*(*spawner)(ARGS...)) {
-            typedef decltype(spawner) SPAWNERFTYPE;
-            struct HelperClass {
-                static int f_gc(lua_State* state) {
-                    TCLASS ** objPtr = (TCLASS**)luaL_checkudata(state, -1, LuaClass<TCLASS>::klassName);
-                    if (objPtr)
-                    {
-                        DestructorCaller<TCLASS>::Invoke(*objPtr);
-                    }
-                    return 0;
-                }
+    // count of lua arguments taken by the first N arguments.
+    template<size_t N, typename ...ARGS>
+    struct LuaArgumentOffset
+    {
+        enum { value = 0 };
+    };
 
-                static int f_new(lua_State* state) {
-                    void * spawner = lua_touserdata(state, lua_upvalueindex(1));
-                    luaL_argcheck(state, spawner, 1, "cpp closure spawner not found.");
-                    if (spawner) {
-                        int idx = 0; (void)(idx);
-                        auto obj = (*(SPAWNERFTYPE*)(spawner))(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), 0, &idx)...);
-                        if (obj)
-                        {
-                            TCLASS ** objPtr = (TCLASS**)lua_newuserdata(state, sizeof(TCLASS*));
-                            if (objPtr)
-                            {
-                                *objPtr = obj;
+    template<size_t N, typename FIRST, typename ...REST>
+    struct LuaArgumentOffset<N, FIRST, REST...>
+    {
+        enum { value = LuaArgument<0, FIRST>::slots + LuaArgumentOffset<N - 1, REST...>::value };
+    };
 
-                                luaL_Reg destructor[] = { { "__gc", HelperClass::f_gc }, { nullptr, nullptr } };
-                                luaL_getmetatable(state, LuaClass<TCLASS>::klassName);
-                                luaL_setfuncs(state, destructor, 0);
-                                lua_setmetatable(state, -2);
-                                
-                                return 1;
-                            }
-                            else
-                            {
-                                DestructorCaller<TCLASS>::Invoke(obj);
-                            }
-                        }
-                    }
-                    lua_pushnil(state);
-                    return 1;
-                }
+    template<typename FIRST, typename ...REST>
+    struct LuaArgumentOffset<0, FIRST, REST...>
+    {
+        enum { value = 0 };
+    };
 
-            };
+    // count of output arguments.
+    template<typename ...ARGS>
+    struct LuaOutputCount
+    {
+        enum { value = 0 };
+    };
 
-            luaL_Reg constructor[] = { { name, HelperClass::f_new },{ nullptr, nullptr } };
-#if USE_NEW_MODULE_REGISTRY
-            lua_getglobal(m_state, klassName);
-            if (lua_isnil(m_state, -1))
-            {
-                lua_pop(m_state, 1);
-                lua_newtable(m_state);
-            }
-#endif
+    template<typename FIRST, typename ...REST>
+    struct LuaOutputCount<FIRST, REST...>
+    {
+        enum { value = int(LuaOutputArgument<FIRST>::value) + LuaOutputCount<REST...>::value };
+    };
 
-            SPAWNERFTYPE * spawnerPtr = (SPAWNERFTYPE*)lua_newuserdata(m_state, sizeof(SPAWNERFTYPE));
-#   ifndef LUAAA_WITHOUT_CPP_STDLIB
-            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, (std::string("faild to alloc mem to store spawner for ctor `") + name + "`").c_str());
-#   else
-            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, "faild to alloc mem to store spawner for ctor");
-#   endif
-            *spawnerPtr = spawner;
+    // count of lua arguments up to the last required one.
+    template<typename ...ARGS>
+    struct LuaRequiredArity
+    {
+        enum { value = 0 };
+    };
 
-#if USE_NEW_MODULE_REGISTRY
-            luaL_setfuncs(m_state, constructor, 1);
-            lua_setglobal(m_state, klassName);
-#else
-            luaL_openlib(m_state, klassName, constructor, 1);
-#endif
+    template<typename FIRST, typename ...REST>
+    struct LuaRequiredArity<FIRST, REST...>
+    {
+        enum { value = (LuaRequiredArity<REST...>::value > 0 || LuaArgument<0, FIRST>::required) ? LuaArgument<0, FIRST>::slots + LuaRequiredArity<REST...>::value : 0 };
+    };
 
-            return (*this);
-        }
+    // index of default value for argument at lua argument OFFSET, when last K lua arguments have default values.
+    template<int SLOTS, int OFFSET, int ARITY, int K>
+    struct LuaDefaultIndex
+    {
+        enum { value = (SLOTS == 1 && OFFSET + K >= ARITY) ? OFFSET + K - ARITY : -1 };
+    };
 
-        template<typename TRET, typename ...ARGS>
-        inline LuaClass<TCLASS>& ctor(const char * name, TCLASS*(*spawner)(ARGS...), TRET(*deleter)(TCLASS*)){
-            typedef decltype(spawner) SPAWNERFTYPE;
-            typedef decltype(deleter) DELETERFTYPE;
+    // arguments are read from stack index (skip + 1) on, in declaration order.
+    template<typename SEQ, typename ...ARGS> struct LuaArguments;
 
-            struct HelperClass {
-                static int f_gc(lua_State* state) {
-                    void * deleter = lua_touserdata(state, lua_upvalueindex(1));
-                    luaL_argcheck(state, deleter, 1, "cpp closure deleter not found.");
-                    if (deleter) {
-                        TCLASS ** objPtr = (TCLASS**)luaL_checkudata(state, -1, LuaClass<TCLASS>::klassName);
-                        if (objPtr)
-                        {
-                            (*(DELETERFTYPE*)(deleter))(*objPtr);
-                        }
-                    }
-                    
-                    return 0;
-                }
+    template<size_t ...I, typename ...ARGS>
+    struct LuaArguments<IndexSequence<I...>, ARGS...> : public LuaArgument<I, ARGS>...
+    {
+        enum
+        {
+            arity = LuaArgumentOffset<sizeof...(ARGS), ARGS...>::value,
+            required = LuaRequiredArity<ARGS...>::value,
+            outputs = LuaOutputCount<ARGS...>::value
+        };
 
-                static int f_new(lua_State* state) {
-                    void * spawner = lua_touserdata(state, lua_upvalueindex(1));
-                    luaL_argcheck(state, spawner, 1, "cpp closure spawner not found.");
+        // check lua types of arguments on stack, used by overload dispatch.
+        // the last K lua arguments have default values.
+        template<int K>
+        inline static bool match(lua_State * state, int skip)
+        {
+            (void)(state); (void)(skip);
+            bool matched = true;
+            bool results[] = { true, (matched = matched && LuaDefaultArgument<LuaArgument<I, ARGS>,
+                LuaDefaultIndex<LuaArgument<I, ARGS>::slots, LuaArgumentOffset<I, ARGS...>::value, arity, K>::value>::match(
+                    state, skip + 1 + LuaArgumentOffset<I, ARGS...>::value))... };
+            (void)(results);
+            return matched;
+        }
 
-                    void * deleter = lua_touserdata(state, lua_upvalueindex(2));
-                    luaL_argcheck(state, deleter, 1, "cpp closure deleter not found.");
+        // fetch arguments from stack and call callee with them.
+        template<typename TRET, typename CALLEE, typename ...D>
+        inline TRET call(lua_State * state, int skip, CALLEE & callee, const LuaValues<D...>& defaults)
+        {
+            static_assert(sizeof...(D) <= arity, "too many default values.");
+            (void)(state); (void)(skip); (void)(defaults);
+            return callee(LuaDefaultArgument<LuaArgument<I, ARGS>,
+                LuaDefaultIndex<LuaArgument<I, ARGS>::slots, LuaArgumentOffset<I, ARGS...>::value, arity, sizeof...(D)>::value>::get(
+                    *this, state, skip + 1 + LuaArgumentOffset<I, ARGS...>::value, defaults)...);
+        }
 
-                    if (spawner) {
-                        int idx = 0; (void)(idx);
-                        auto obj = (*(SPAWNERFTYPE*)(spawner))(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), 0, &idx)...);
-                        if (obj)
-                        {
-                            TCLASS ** objPtr = (TCLASS**)lua_newuserdata(state, sizeof(TCLASS*));
-                            if (objPtr)
-                            {
-                                *objPtr = obj;
+        // push output arguments to stack, return count of them.
+        inline int put(lua_State * state)
+        {
+            if (outputs > 0)
+            {
+                luaL_checkstack(state, outputs, "too many output arguments");
+            }
+            int results[] = { 0, LuaArgument<I, ARGS>::put(state)... };
+            (void)(results);
+            return outputs;
+        }
+    };
 
-                                luaL_Reg destructor[] = {
-                                    { "__gc", HelperClass::f_gc },
-                                    { nullptr, nullptr }
-                                };
+    template<typename TRET, typename ...ARGS>
+    struct LuaSignatureBase
+    {
+        typedef LuaArguments<typename MakeIndexSequence<sizeof...(ARGS)>::type, ARGS...> Arguments;
 
-                               
-                                luaL_getmetatable(state, LuaClass<TCLASS>::klassName);
+        enum { arity = Arguments::arity, minArity = Arguments::required };
 
-                                DELETERFTYPE * deleterPtr = (DELETERFTYPE*)lua_newuserdata(state, sizeof(DELETERFTYPE));
-#   ifndef LUAAA_WITHOUT_CPP_STDLIB
-                                luaL_argcheck(state, deleterPtr != nullptr, 1, (std::string("faild to alloc mem to store deleter for ctor meta table `") + LuaClass<TCLASS>::klassName + "`").c_str());
-#   else
-                                luaL_argcheck(state, deleterPtr != nullptr, 1, "faild to alloc mem to store deleter for ctor meta table");
-#   endif
-                                *deleterPtr = *(DELETERFTYPE*)(deleter);
+        template<int K = 0>
+        inline static bool match(lua_State * state, int skip)
+        {
+            return Arguments::template match<K>(state, skip);
+        }
 
-                                luaL_setfuncs(state, destructor, 1);
+        // fetch arguments from stack and call callee with them, output arguments are dropped.
+        template<typename CALLEE>
+        inline static TRET call(lua_State * state, int skip, CALLEE && callee)
+        {
+            Arguments args;
+            return args.template call<TRET>(state, skip, callee, LuaValues<>());
+        }
+    };
 
-                                lua_setmetatable(state, -2);
+    template<typename TRET, typename ...ARGS>
+    struct LuaSignature : public LuaSignatureBase<TRET, ARGS...>
+    {
+        // call callee and push result and output arguments to stack, return count of results.
+        template<typename CALLEE, typename ...D>
+        inline static int invoke(lua_State * state, int skip, CALLEE && callee, const LuaValues<D...>& defaults)
+        {
+            typename LuaSignatureBase<TRET, ARGS...>::Arguments args;
+            const int results = LuaStackReturn<TRET>(state, args.template call<TRET>(state, skip, callee, defaults));
+            return results + args.put(state);
+        }
+    };
 
-                                return 1;
-                            }
-                            else
-                            {
-                                DestructorCaller<TCLASS>::Invoke(obj);
-                            }
-                        }
-                    }
-                    lua_pushnil(state);
-                    return 1;
-                }
+    template<typename ...ARGS>
+    struct LuaSignature<void, ARGS...> : public LuaSignatureBase<void, ARGS...>
+    {
+        template<typename CALLEE, typename ...D>
+        inline static int invoke(lua_State * state, int skip, CALLEE && callee, const LuaValues<D...>& defaults)
+        {
+            typename LuaSignatureBase<void, ARGS...>::Arguments args;
+            args.template call<void>(state, skip, callee, defaults);
+            return args.put(state);
+        }
+    };
 
-            };
+	//========================================================
+	// function caller
+	//========================================================
+    // FunctionCaller<F> calls a callee of type F with arguments from stack:
+    //   arity, minArity                      max and min count of lua arguments, self excluded.
+    //   Match<K>(state, skip)                check lua types of arguments, the last K have default values.
+    //   Invoke(state, skip, func, defaults)  call func, push results, return count of results.
+    // member functions take self from stack index skip.
+    template<typename F> struct FunctionCaller;
+
+#define IMPLEMENT_FUNCTION_CALLER(CALLCONV) \
+    template<typename TRET, typename ...ARGS> \
+    struct FunctionCaller<TRET(CALLCONV*)(ARGS...)> \
+    { \
+        enum { arity = LuaSignature<TRET, ARGS...>::arity, minArity = LuaSignature<TRET, ARGS...>::minArity }; \
+        template<int K = 0> \
+        inline static bool Match(lua_State * state, int skip) \
+        { \
+            return LuaSignature<TRET, ARGS...>::template match<K>(state, skip); \
+        } \
+        template<typename ...D> \
+        inline static int Invoke(lua_State * state, int skip, TRET(CALLCONV*func)(ARGS...), const LuaValues<D...>& defaults = LuaValues<>()) \
+        { \
+            return LuaSignature<TRET, ARGS...>::invoke(state, skip, func, defaults); \
+        } \
+    };
 
-            luaL_Reg constructor[] = { { name, HelperClass::f_new },{ nullptr, nullptr } };
+#if defined(_MSC_VER)	
+	IMPLEMENT_FUNCTION_CALLER(__cdecl);
+	IMPLEMENT_CALLBACK_INVOKER(__cdecl);
 
-#if USE_NEW_MODULE_REGISTRY
-            lua_getglobal(m_state, klassName);
-            if (lua_isnil(m_state, -1))
-            {
-                lua_pop(m_state, 1);
-                lua_newtable(m_state);
-            }
-#endif
+#	ifdef _M_CEE
+	IMPLEMENT_FUNCTION_CALLER(__clrcall);
+	IMPLEMENT_CALLBACK_INVOKER(__clrcall);
+#	endif
 
-            SPAWNERFTYPE * spawnerPtr = (SPAWNERFTYPE*)lua_newuserdata(m_state, sizeof(SPAWNERFTYPE));
-#   ifndef LUAAA_WITHOUT_CPP_STDLIB
-            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, (std::string("faild to alloc mem to store spawner for ctor `") + name + "`").c_str());
-#   else
-            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, ("faild to alloc mem to store spawner for ctor"));
-#   endif
-            *spawnerPtr = spawner;
+#	if defined(_M_IX86) && !defined(_M_CEE)
+	IMPLEMENT_FUNCTION_CALLER(__fastcall);
+	IMPLEMENT_CALLBACK_INVOKER(__fastcall);
+#	endif
 
-            DELETERFTYPE * deleterPtr = (DELETERFTYPE*)lua_newuserdata(m_state, sizeof(DELETERFTYPE));
-#   ifndef LUAAA_WITHOUT_CPP_STDLIB
-            luaL_argcheck(m_state, deleterPtr != nullptr, 1, (std::string("faild to alloc mem to store deleter for ctor `") + name + "`").c_str());
-#   else
-            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, ("faild to alloc mem to store deleter for ctor"));
-#   endif
-            *deleterPtr = deleter;
+#	ifdef _M_IX86
+	IMPLEMENT_FUNCTION_CALLER(__stdcall);
+	IMPLEMENT_CALLBACK_INVOKER(__stdcall);
+#	endif
 
-#if USE_NEW_MODULE_REGISTRY
-            luaL_setfuncs(m_state, constructor, 2);
-            lua_setglobal(m_state, klassName);
+#	if ((defined(_M_IX86) && _M_IX86_FP >= 2) || defined(_M_X64)) && !defined(_M_CEE)
+	IMPLEMENT_FUNCTION_CALLER(__vectorcall);
+	IMPLEMENT_CALLBACK_INVOKER(__vectorcall);
+#	endif
+#elif defined(__clang__)
+#	define _NOTHING
+    IMPLEMENT_FUNCTION_CALLER(_NOTHING);
+    IMPLEMENT_CALLBACK_INVOKER(_NOTHING);
+#	undef _NOTHING	
+#elif defined(__GNUC__)
+#	define _NOTHING
+	IMPLEMENT_FUNCTION_CALLER(_NOTHING);
+	IMPLEMENT_CALLBACK_INVOKER(_NOTHING);
+#	undef _NOTHING	
 #else
-            luaL_openlib(m_state, klassName, constructor, 2);
-#endif
+#	define _NOTHING	
+	IMPLEMENT_FUNCTION_CALLER(_NOTHING);
+	IMPLEMENT_CALLBACK_INVOKER(_NOTHING);
+#	undef _NOTHING		
+#endif	
 
-            return (*this);
-        }
+	//========================================================
+	// member function invoker
+	//========================================================
+    template<typename TCLASS, typename FTYPE, typename TRET, typename ...ARGS>
+    struct MemberFunctionInvoker
+    {
+        enum { arity = LuaSignature<TRET, ARGS...>::arity, minArity = LuaSignature<TRET, ARGS...>::minArity };
 
-        template<typename ...ARGS>
-        inline LuaClass<TCLASS>& ctor(const char * name, TCLASS*(*spawner)(ARGS...), std::nullptr_t) {
-            typedef decltype(spawner) SPAWNERFTYPE;
+        struct Callee
+        {
+            TCLASS & obj;
+            FTYPE func;
 
-            struct HelperClass {
-                static int f_nogc(lua_State* state) {
-                    return 0;
-                }
+            inline TRET operator()(ARGS... args) const
+            {
+                return (obj.*func)(std::forward<ARGS>(args)...);
+            }
+        };
 
-                static int f_new(lua_State* state) {
-                    void * spawner = lua_touserdata(state, lua_upvalueindex(1));
-                    luaL_argcheck(state, spawner, 1, "cpp closure spawner not found.");
-                    if (spawner) {
-                        int idx = 0; (void)(idx);
-                        auto obj = (*(SPAWNERFTYPE*)(spawner))(stackOperatorCaller(state, LuaStack<ARGS>::get, sizeof...(ARGS), 0, &idx)...);
-                        if (obj)
-                        {
-                            TCLASS ** objPtr = (TCLASS**)lua_newuserdata(state, sizeof(TCLASS*));
-                            if (objPtr)
-                            {
-                                *objPtr = obj;
+        template<int K = 0>
+        inline static bool Match(lua_State * state, int skip)
+        {
+            return LuaSignature<TRET, ARGS...>::template match<K>(state, skip);
+        }
 
-                                luaL_Reg destructor[] = {
-                                    { "__gc", HelperClass::f_nogc },
-                                    { nullptr, nullptr }
-                                };
+        template<typename ...D>
+        inline static int Invoke(lua_State * state, int skip, FTYPE func, const LuaValues<D...>& defaults = LuaValues<>())
+        {
+            Callee callee = { LuaStack<TCLASS>::get(state, skip), func };
+            return LuaSignature<TRET, ARGS...>::invoke(state, skip, callee, defaults);
+        }
+    };
 
-                                luaL_getmetatable(state, LuaClass<TCLASS>::klassName);
-                                luaL_setfuncs(state, destructor, 0);
-                                lua_setmetatable(state, -2);
-                                return 1;
-                            }
-                            else
-                            {
-                                DestructorCaller<TCLASS>::Invoke(obj);
-                            }
-                        }
-                        
-                    }
-                    lua_pushnil(state);
-                    return 1;
-                }
+    template<typename TCLASS, typename TRET, typename ...ARGS>
+    struct FunctionCaller<TRET(TCLASS::*)(ARGS...)>
+        : public MemberFunctionInvoker<TCLASS, TRET(TCLASS::*)(ARGS...), TRET, ARGS...>
+    {
+    };
 
-            };
+    template<typename TCLASS, typename TRET, typename ...ARGS>
+    struct FunctionCaller<TRET(TCLASS::*)(ARGS...)const>
+        : public MemberFunctionInvoker<TCLASS, TRET(TCLASS::*)(ARGS...)const, TRET, ARGS...>
+    {
+    };
 
-            luaL_Reg constructor[] = { { name, HelperClass::f_new },{ nullptr, nullptr } };
+	//========================================================
+	// callable object invoker
+	//========================================================
+    template<typename ...T> struct LuaFirstType { typedef void type; };
+    template<typename FIRST, typename ...REST> struct LuaFirstType<FIRST, REST...> { typedef FIRST type; };
 
-#if USE_NEW_MODULE_REGISTRY
-            lua_getglobal(m_state, klassName);
-            if (lua_isnil(m_state, -1))
-            {
-                lua_pop(m_state, 1);
-                lua_newtable(m_state);
-            }
-#endif
-            SPAWNERFTYPE * spawnerPtr = (SPAWNERFTYPE*)lua_newuserdata(m_state, sizeof(SPAWNERFTYPE));
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
-            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, (std::string("faild to alloc mem to store spawner for ctor `") + name + "`").c_str());
-#else
-            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, "faild to alloc mem to store spawner for ctor of cpp class");
-#endif
-            *spawnerPtr = spawner;
+    template<typename F, typename TRET, typename ...ARGS>
+    struct CallableInvoker
+    {
+        enum { arity = LuaSignature<TRET, ARGS...>::arity, minArity = LuaSignature<TRET, ARGS...>::minArity };
 
-#if USE_NEW_MODULE_REGISTRY
-            luaL_setfuncs(m_state, constructor, 1);
-            lua_setglobal(m_state, klassName);
-#else
-            luaL_openlib(m_state, klassName, constructor, 1);
-#endif
+        typedef typename LuaFirstType<ARGS...>::type FirstArgument;
 
-            return (*this);
+        template<int K = 0>
+        inline static bool Match(lua_State * state, int skip)
+        {
+            return LuaSignature<TRET, ARGS...>::template match<K>(state, skip);
         }
 
-       
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
-        template<typename ...ARGS>
-        inline LuaClass<TCLASS>& ctor(const std::string& name)
+        template<typename ...D>
+        inline static int Invoke(lua_State * state, int skip, F & func, const LuaValues<D...>& defaults = LuaValues<>())
         {
-            return ctor<ARGS...>(name.c_str());
+            return LuaSignature<TRET, ARGS...>::invoke(state, skip, func, defaults);
         }
+    };
 
-        template<typename ...ARGS>
-        inline LuaClass<TCLASS>& ctor(const std::string& name, TCLASS*(*spawner)(ARGS...)) {
-            return ctor(name.c_str(), spawner);
-        }
+    template<typename F, typename OPERATOR> struct CallableOperator;
 
-        template<typename TRET, typename ...ARGS>
-        inline LuaClass<TCLASS>& ctor(const std::string& name, TCLASS*(*spawner)(ARGS...), TRET(*deleter)(TCLASS*)) {
-            return ctor(name.c_str(), spawner, deleter);
-        }
+    template<typename F, typename TCALLABLE, typename TRET, typename ...ARGS>
+    struct CallableOperator<F, TRET(TCALLABLE::*)(ARGS...)> : public CallableInvoker<F, TRET, ARGS...>
+    {
+    };
 
-        template<typename ...ARGS>
-        inline LuaClass<TCLASS>& ctor(const std::string& name, TCLASS*(*spawner)(ARGS...), std::nullptr_t) {
-            return ctor(name.c_str(), spawner, nullptr);
-        }
-#endif
+    template<typename F, typename TCALLABLE, typename TRET, typename ...ARGS>
+    struct CallableOperator<F, TRET(TCALLABLE::*)(ARGS...)const> : public CallableInvoker<F, TRET, ARGS...>
+    {
+    };
 
-		template<typename F>
-		inline LuaClass<TCLASS>& fun(const char * name, F f)
-		{
-			luaL_getmetatable(m_state, klassName);
-			lua_pushstring(m_state, name);
+    // lambda, std::function or functor, signature is deduced from its non-template operator().
+    template<typename F>
+    struct FunctionCaller : public CallableOperator<F, decltype(&F::operator())>
+    {
+    };
 
-			F * funPtr = (F*)lua_newuserdata(m_state, sizeof(F));
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
-			luaL_argcheck(m_state, funPtr != nullptr, 1, (std::string("faild to alloc mem to store function `") + name + "`").c_str());
-#else
-            luaL_argcheck(m_state, funPtr != nullptr, 1, "faild to alloc mem to store function");
-#endif
-			*funPtr = f;
-			lua_pushcclosure(m_state, MemberFunctionCaller(f), 1);
-			lua_settable(m_state, -3);
-			lua_pop(m_state, 1);
-			return (*this);
-		}
+    // callable bound to LuaClass takes self as its first argument if the first parameter is the class itself.
+    template<typename TCLASS, typename F, typename = void>
+    struct CallableTakesSelf
+    {
+        enum { value = false };
+    };
 
-		inline LuaClass<TCLASS>& fun(const char * name, lua_CFunction f)
-		{
-			luaL_getmetatable(m_state, klassName);
-			lua_pushstring(m_state, name);
-			lua_pushcclosure(m_state, f, 0);
-			lua_settable(m_state, -3);
-			lua_pop(m_state, 1);
-			return (*this);
-		}
+    template<typename TCLASS, typename F>
+    struct CallableTakesSelf<TCLASS, F, typename VoidType<decltype(&F::operator())>::type>
+    {
+        typedef typename std::decay<typename FunctionCaller<F>::FirstArgument>::type FirstArgument;
+        typedef typename std::remove_cv<typename std::remove_pointer<FirstArgument>::type>::type SelfType;
+        enum { value = std::is_same<SelfType, TCLASS>::value };
+    };
 
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
-		template <typename F>
-		inline LuaClass<TCLASS>& fun(const std::string& name, F f)
-		{
-			return fun(name.c_str(), f);
-		}
-#endif
+	//========================================================
+	// overload set
+	//========================================================
+    template<typename ...F> struct LuaOverload;
 
-		template <typename V>
-		inline LuaClass<TCLASS>& def(const char * name, const V& val)
-		{
-			luaL_getmetatable(m_state, klassName);
-			lua_pushstring(m_state, name);
-			LuaStack<V>::put(m_state, val);
-			lua_settable(m_state, -3);
-			lua_pop(m_state, 1);
-			return (*this);
-		}
+    template<>
+    struct LuaOverload<>
+    {
+    };
 
-		// disable cast from "const char [#]" to "char (*)[#]"
-		inline LuaClass<TCLASS>& def(const char * name, const char * str)
-		{
-			luaL_getmetatable(m_state, klassName);
-			lua_pushstring(m_state, name);
-			LuaStack<decltype(str)>::put(m_state, str);
-			lua_settable(m_state, -3);
-			lua_pop(m_state, 1);
-			return (*this);
-		}
+    template<typename F, typename ...REST>
+    struct LuaOverload<F, REST...>
+    {
+        LuaOverload(F f, REST... rest) : func(std::move(f)), next(std::move(rest)...) {}
 
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
-		template <typename V>
-		inline LuaClass<TCLASS>& def(const std::string& name, const V& val)
-		{
-			return def(name.c_str(), val);
-		}
-#endif
+        F func;
+        LuaOverload<REST...> next;
+    };
 
-	private:
-		lua_State *	m_state;
-
-	private:
-        static char * klassName;
-	};
-
-    template <typename TCLASS> char * LuaClass<TCLASS>::klassName = nullptr;
+    // bind several C++ functions to one lua name, e.g.
+    //     fun("f", overload(&A::f1, &A::f2));
+    // candidate is selected by count of arguments first, then by lua types of arguments,
+    // the first matched candidate in declaration order wins.
+    template<typename ...F>
+    inline LuaOverload<F...> overload(F... funcs)
+    {
+        return LuaOverload<F...>(std::move(funcs)...);
+    }
 
+    // CALLER<F> provides arity, Match and Invoke of candidate F, see FunctionCaller.
+    template<template<typename> class CALLER, typename TRESULT>
+    struct OverloadDispatcher
+    {
+        template<typename ...F>
+        inline static TRESULT Invoke(lua_State * state, int skip, LuaOverload<F...>& funcs)
+        {
+            return Dispatch(state, skip, lua_gettop(state) - skip, funcs);
+        }
 
-	// -----------------------------------
-	// export module
-	// -----------------------------------
-	struct LuaModule
-	{
-	public:
+    private:
+        template<typename FIRST, typename ...REST>
+        inline static TRESULT Dispatch(lua_State * state, int skip, int argc, LuaOverload<FIRST, REST...>& funcs)
+        {
+            if (argc <= CALLER<FIRST>::arity && argc >= CALLER<FIRST>::minArity && CALLER<FIRST>::Match(state, skip))
+            {
+                return CALLER<FIRST>::Invoke(state, skip, funcs.func);
+            }
+            return Dispatch(state, skip, argc, funcs.next);
+        }
 
-        LuaModule(lua_State * state, const char * name = "_G")
-            : m_state(state)
+        inline static TRESULT Dispatch(lua_State * state, int, int argc, LuaOverload<>&)
         {
-            size_t strBufLen = strlen(name) + 1;
-            m_moduleName = reinterpret_cast<char *>(lua_newuserdata(state, strBufLen));
-            memcpy(m_moduleName, name, strBufLen);
+            luaL_error(state, "no matching overload found for %d argument(s).", argc);
+            return TRESULT();
         }
+    };
 
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
-        LuaModule(lua_State * state, const std::string& name)
-            : LuaModule(state, name.empty() ? "_G" : name.c_str())
-        {}
-#endif
+    template<typename ...F>
+    struct FunctionCaller<LuaOverload<F...>>
+    {
+        inline static int Invoke(lua_State * state, int skip, LuaOverload<F...>& funcs)
+        {
+            return OverloadDispatcher<FunctionCaller, int>::Invoke(state, skip, funcs);
+        }
+    };
 
-	public:
-		template<typename F>
-		inline LuaModule& fun(const char * name, F f)
-		{
-			luaL_Reg regtab[] = { { name, NonMemberFunctionCaller(f) },{ nullptr, nullptr } };
+	//========================================================
+	// default values of arguments
+	//========================================================
+    template<typename F, typename ...D>
+    struct LuaDefaults
+    {
+        LuaDefaults(F f, D... values) : func(std::move(f)), defaults(values...) {}
 
-#if USE_NEW_MODULE_REGISTRY
-			lua_getglobal(m_state, m_moduleName);
-			if (lua_isnil(m_state, -1)) 
-			{
-				lua_pop(m_state, 1);
-				lua_newtable(m_state);
-			}
+        F func;
+        LuaValues<D...> defaults;
+    };
 
-			F * funPtr = (F*)lua_newuserdata(m_state, sizeof(F));
-#   ifndef LUAAA_WITHOUT_CPP_STDLIB
-			luaL_argcheck(m_state, funPtr != nullptr, 1, (std::string("faild to alloc mem to store function `") + name + "`").c_str());
-#   else
-            luaL_argcheck(m_state, funPtr != nullptr, 1, "faild to alloc mem to store function of module");
-#   endif
-			*funPtr = f;
+    // bind function with default values of its last lua arguments, e.g.
+    //     fun("f", defaults(&A::f, 1, "str"));
+    // default values are stored in the closure, absent or nil argument takes its default value.
+    template<typename F, typename ...D>
+    inline LuaDefaults<F, typename std::decay<D>::type...> defaults(F f, D&&... values)
+    {
+        return LuaDefaults<F, typename std::decay<D>::type...>(std::move(f), std::forward<D>(values)...);
+    }
 
-			luaL_setfuncs(m_state, regtab, 1);
-			lua_setglobal(m_state, m_moduleName);
-#else
-			F * funPtr = (F*)lua_newuserdata(m_state, sizeof(F));
-#   ifndef LUAAA_WITHOUT_CPP_STDLIB
-			luaL_argcheck(m_state, funPtr != nullptr, 1, (std::string("faild to alloc mem to store function `") + name + "`").c_str());
-#   else
-            luaL_argcheck(m_state, funPtr != nullptr, 1, "faild to alloc mem to store function of module");
-#   endif
-			*funPtr = f;
+    template<typename F, typename ...D>
+    struct FunctionCaller<LuaDefaults<F, D...>>
+    {
+        enum
+        {
+            arity = FunctionCaller<F>::arity,
+            minArity = (int(FunctionCaller<F>::minArity) < int(FunctionCaller<F>::arity) - int(sizeof...(D))) ?
+                int(FunctionCaller<F>::minArity) : int(FunctionCaller<F>::arity) - int(sizeof...(D))
+        };
 
-			luaL_openlib(m_state, m_moduleName, regtab, 1);
-#endif
+        inline static bool Match(lua_State * state, int skip)
+        {
+            return FunctionCaller<F>::template Match<int(sizeof...(D))>(state, skip);
+        }
 
-			return (*this);
-		}
+        inline static int Invoke(lua_State * state, int skip, LuaDefaults<F, D...>& funcs)
+        {
+            return FunctionCaller<F>::Invoke(state, skip, funcs.func, funcs.defaults);
+        }
+    };
 
-		inline LuaModule& fun(const char * name, lua_CFunction f)
-		{
-			luaL_Reg regtab[] = { { name, f },{ nullptr, nullptr } };
-#if USE_NEW_MODULE_REGISTRY
-			lua_getglobal(m_state, m_moduleName);
-			if (lua_isnil(m_state, -1))
-			{
-				lua_pop(m_state, 1);
-				lua_newtable(m_state);
-			}
-			luaL_setfuncs(m_state, regtab, 0);
-			lua_setglobal(m_state, m_moduleName);
-#else
-			luaL_openlib(m_state, m_moduleName, regtab, 0);
-#endif
-			return (*this);
-		}
+    template<typename TCLASS, typename F, typename ...D>
+    struct CallableTakesSelf<TCLASS, LuaDefaults<F, D...>> : public CallableTakesSelf<TCLASS, F>
+    {
+    };
 
-		template <typename V>
-		inline LuaModule& def(const char * name, const V& val)
-		{
-#if USE_NEW_MODULE_REGISTRY
-			lua_getglobal(m_state, m_moduleName);
-			if (lua_isnil(m_state, -1))
-			{
-				lua_pop(m_state, 1);
-				lua_newtable(m_state);
-			}
-			LuaStack<V>::put(m_state, val);
-			lua_setfield(m_state, -2, name);
-			lua_setglobal(m_state, m_moduleName);
-#else
-			luaL_Reg regtab = { nullptr, nullptr };
-			luaL_openlib(m_state, m_moduleName, &regtab, 0);
-			LuaStack<V>::put(m_state, val);
-			lua_setfield(m_state, -2, name);
-#endif
-			return (*this);
-		}
+	//========================================================
+	// callee storage
+	//========================================================
+    // move callee to a new userdata on top of stack,
+    // callee with non-trivial destructor is destroyed by __gc of the userdata, the metatable is shared per type.
+    template<typename F, bool = std::is_trivially_destructible<F>::value>
+    struct CalleeStorage
+    {
+        inline static F * New(lua_State * state, F f)
+        {
+            void * ptr = lua_newuserdata(state, sizeof(F));
+            return ptr ? new (ptr) F(std::move(f)) : nullptr;
+        }
+    };
 
-        template <typename V>
-        inline LuaModule& def(const char * name, const V val[], size_t length)
+    template<typename F>
+    struct CalleeStorage<F, false>
+    {
+        static int f_gc(lua_State * state)
         {
-#if USE_NEW_MODULE_REGISTRY
-            lua_getglobal(m_state, m_moduleName);
-            if (lua_isnil(m_state, -1))
+            F * ptr = (F*)lua_touserdata(state, 1);
+            if (ptr)
             {
-                lua_pop(m_state, 1);
-                lua_newtable(m_state);
+                ptr->~F();
             }
-            lua_newtable(m_state);
-            for (size_t idx = 0; idx < length; ++idx)
+            return 0;
+        }
+
+        inline static F * New(lua_State * state, F f)
+        {
+            void * ptr = lua_newuserdata(state, sizeof(F));
+            if (ptr == nullptr)
             {
-                LuaStack<V>::put(m_state, val[idx]);
-                lua_rawseti(m_state, -2, idx + 1);
+                return nullptr;
             }
-            lua_setfield(m_state, -2, name);
-            lua_setglobal(m_state, m_moduleName);
-#else
-            luaL_Reg regtab = { nullptr, nullptr };
-            luaL_openlib(m_state, m_moduleName, &regtab, 0);
-            lua_newtable(m_state);
-            for (size_t idx = 0; idx < length; ++idx)
+            F * callee = new (ptr) F(std::move(f));
+            lua_pushlightuserdata(state, MetatableKey());
+            lua_rawget(state, LUA_REGISTRYINDEX);
+            if (!lua_istable(state, -1))
             {
-                LuaStack<V>::put(m_state, val[idx]);
-                lua_rawseti(m_state, -2, idx + 1);
+                lua_pop(state, 1);
+                lua_createtable(state, 0, 1);
+                lua_pushcfunction(state, f_gc);
+                lua_setfield(state, -2, "__gc");
+                lua_pushlightuserdata(state, MetatableKey());
+                lua_pushvalue(state, -2);
+                lua_rawset(state, LUA_REGISTRYINDEX);
             }
-            lua_setfield(m_state, -2, name);
-#endif
-            return (*this);
+            lua_setmetatable(state, -2);
+            return callee;
         }
 
-		// disable the cast from "const char [#]" to "char (*)[#]"
-		inline LuaModule& def(const char * name, const char * str)
-		{
-			
-#if USE_NEW_MODULE_REGISTRY
-			lua_getglobal(m_state, m_moduleName);
-			if (lua_isnil(m_state, -1))
-			{
-				lua_pop(m_state, 1);
-				lua_newtable(m_state);
-			}
-			LuaStack<decltype(str)>::put(m_state, str);
-			lua_setfield(m_state, -2, name);
-			lua_setglobal(m_state, m_moduleName);
-#else
-			luaL_Reg regtab = { nullptr, nullptr };
-			luaL_openlib(m_state, m_moduleName.c_str(), &regtab, 0);
-			LuaStack<decltype(str)>::put(m_state, str);
-			lua_setfield(m_state, -2, name);
-#endif
-			return (*this);
-		}
+    private:
+        // registry key of the metatable, unique per F without RTTI.
+        inline static void * MetatableKey()
+        {
+            static char key = 0;
+            return &key;
+        }
+    };
 
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
-		template <typename V>
-		inline LuaModule& def(const std::string& name, const V& val)
-		{
-			return def(name.c_str(), val);
-		}
+	//========================================================
+	// pending call, yield and resume
+	//========================================================
+    // lua_resume of lua 5.1 ~ 5.4, nres receives count of values yielded or returned.
+    inline int LuaResume(lua_State * thread, lua_State * from, int narg, int * nres = nullptr)
+    {
+#if !defined LUA_VERSION_NUM || LUA_VERSION_NUM <= 501
+        (void)from;
+        int status = lua_resume(thread, narg);
+        if (nres) *nres = lua_gettop(thread);
+        return status;
+#elif LUA_VERSION_NUM <= 503
+        int status = lua_resume(thread, from, narg);
+        if (nres) *nres = lua_gettop(thread);
+        return status;
+#else
+        int count = 0;
+        int status = lua_resume(thread, from, narg, &count);
+        if (nres) *nres = count;
+        return status;
 #endif
+    }
 
-	private:
-		lua_State *	m_state;
-        char * m_moduleName;
-	};
-
-}
+    // yielded by pending call, tells resumer the coroutine waits for resumePending or failPending.
+    inline void * LuaPendingKey()
+    {
+        static char key = 0;
+        return &key;
+    }
 
+    inline void * LuaPendingErrorKey()
+    {
+        static char key = 0;
+        return &key;
+    }
 
+    // push error to be raised from pending call on resume, return count of values pushed.
+    // lua 5.1 has no continuation, pending call returns nil and message instead.
+    inline int LuaPendingError(lua_State * thread, const char * message)
+    {
+        luaL_checkstack(thread, 2, "too many results");
+#if !defined LUA_VERSION_NUM || LUA_VERSION_NUM <= 501
+        lua_pushnil(thread);
+#else
+        lua_pushlightuserdata(thread, LuaPendingErrorKey());
+#endif
+        lua_pushstring(thread, message);
+        return 2;
+    }
 
-#ifndef LUAAA_WITHOUT_CPP_STDLIB
+    // runs in the resumed coroutine, values passed to resume become results of the pending call.
+    inline int LuaPendingFinish(lua_State * state)
+    {
+        if (lua_gettop(state) >= 1 && lua_touserdata(state, 1) == LuaPendingKey())
+        {
+            lua_remove(state, 1);
+        }
+        if (lua_gettop(state) >= 2 && lua_touserdata(state, 1) == LuaPendingErrorKey())
+        {
+            lua_settop(state, 2);
+            return lua_error(state);
+        }
+        return lua_gettop(state);
+    }
 
-#include <array>
-#include <vector>
-#include <deque>
-#include <list>
-#include <forward_list>
-#include <set>
-#include <map>
-#include <unordered_set>
-#include <unordered_map>
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 503
+    inline int LuaPendingContinuation(lua_State * state, int, lua_KContext)
+    {
+        return LuaPendingFinish(state);
+    }
+#elif defined(LUA_VERSION_NUM) && LUA_VERSION_NUM == 502
+    inline int LuaPendingContinuation(lua_State * state)
+    {
+        return LuaPendingFinish(state);
+    }
+#endif
 
-namespace LUAAA_NS
-{
-    // array
-    template<typename K, size_t N>
-    struct LuaStack<std::array<K, N>>
+    // must be called as the last step of a lua_CFunction, all C++ locals should be destroyed already,
+    // because lua 5.2+ yields with longjmp. LuaPendingKey is yielded to the resumer, after tag if any.
+    inline int LuaYieldPending(lua_State * state, void * tag = nullptr)
     {
-        typedef std::array<K, N> Container;
-        inline static Container get(lua_State * L, int idx)
+        lua_settop(state, 0);
+        if (tag)
         {
-            Container result;
+            lua_pushlightuserdata(state, tag);
+        }
+        lua_pushlightuserdata(state, LuaPendingKey());
+#if !defined LUA_VERSION_NUM || LUA_VERSION_NUM <= 501
+        return lua_yield(state, lua_gettop(state));
+#else
+        return lua_yieldk(state, lua_gettop(state), 0, LuaPendingContinuation);
+#endif
+    }
 
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
-            {
-                int index = 0;
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx) && index < N)
-                {
-                    result[index++] = LuaStack<typename Container::value_type>::get(L, lua_gettop(L));
-                    lua_pop(L, 1);
-                }
-                lua_pop(L, 0);
-            }
-            return result;
+    // whether the running C function may yield before it changes anything.
+    // lua 5.1 and 5.2 have no lua_isyieldable, a C function between the caller and the coroutine, e.g. pcall,
+    // is taken as a boundary. metamethods are not detected on lua 5.1.
+    inline bool LuaCanSuspend(lua_State * state)
+    {
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 503
+        return lua_isyieldable(state) != 0;
+#else
+        const bool main = lua_pushthread(state) != 0;
+        lua_pop(state, 1);
+        if (main)
+        {
+            return false;
         }
-        inline static void put(lua_State * L, const Container& s)
+        lua_Debug ar;
+        for (int level = 1; lua_getstack(state, level, &ar); ++level)
         {
-            lua_newtable(L);
-            int index = 1;
-            for (auto it = s.begin(); it != s.end(); ++it)
+            lua_getinfo(state, "S", &ar);
+            if (ar.what[0] == 'C')
             {
-                LuaStack<typename Container::value_type>::put(L, *it);
-                lua_rawseti(L, -2, index++);
+                return false;
             }
         }
-    };
+        return true;
+#endif
+    }
 
-    // vector
-    template<typename K, typename ...ARGS>
-    struct LuaStack<std::vector<K, ARGS...>>
+    // true if coroutine was suspended by a pending call, check after lua_resume returns LUA_YIELD.
+    inline bool isPending(lua_State * thread)
     {
-        typedef std::vector<K, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        return lua_gettop(thread) > 0 && lua_touserdata(thread, -1) == LuaPendingKey();
+    }
+
+    // true if coroutine was suspended by a pending call which yielded tag.
+    inline bool isPending(lua_State * thread, void * tag)
+    {
+        return isPending(thread) && lua_gettop(thread) > 1 && lua_touserdata(thread, -2) == tag;
+    }
+
+    // resume coroutine suspended by LuaPending, values become results of the pending call.
+    // return status of lua_resume.
+    template<typename ...T>
+    inline int resumePending(lua_State * thread, T&&... results)
+    {
+        lua_settop(thread, 0);
+        luaL_checkstack(thread, int(sizeof...(T)) + 1, "too many results");
+        int pushed[] = { 0, (LuaStack<typename std::decay<T>::type>::put(thread, std::forward<T>(results)), 0)... };
+        (void)pushed;
+        return LuaResume(thread, nullptr, int(sizeof...(T)));
+    }
+
+    // resume coroutine suspended by LuaPending, error is raised from the pending call.
+    inline int failPending(lua_State * thread, const char * message)
+    {
+        lua_settop(thread, 0);
+        return LuaResume(thread, nullptr, LuaPendingError(thread, message));
+    }
+
+	//========================================================
+	// hook chain
+	//========================================================
+    // a state has one hook, component installing its own keeps the hook it found installed:
+    // events that hook asked for are forwarded to it, count events at its own rate,
+    // and it is restored when the component removes its hook.
+    // remove hooks in reverse order of install, remove() leaves a hook which is not on top installed,
+    // its events keep coming through the hook above it.
+    class LuaHookChain
+    {
+    public:
+        LuaHookChain() : m_state(nullptr), m_hook(nullptr), m_mask(0), m_count(0), m_counted(0), m_ownMask(0), m_ownCount(0), m_ownCounted(0), m_step(0) {}
+
+        // install hook over the current one, again to change its mask and count.
+        void install(lua_State * state, lua_Hook hook, int mask, int count)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            m_ownMask = mask;
+            m_ownCount = count > 0 ? count : 1;
+            m_ownCounted = 0;
+            if (lua_gethook(state) != hook)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
+                if (m_state == state)
                 {
-                    result.push_back(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
-                    lua_pop(L, 1);
+                    // below another hook, which forwards events at the rate it saved.
+                    return;
                 }
-                lua_pop(L, 0);
+                m_hook = lua_gethook(state);
+                m_mask = m_hook ? lua_gethookmask(state) : 0;
+                m_count = lua_gethookcount(state) > 0 ? lua_gethookcount(state) : 1;
+                m_counted = 0;
+                m_state = state;
             }
-            return result;
+            m_step = (mask & LUA_MASKCOUNT) ? m_ownCount : 0;
+            if ((m_mask & LUA_MASKCOUNT) && (m_step == 0 || m_count < m_step))
+            {
+                m_step = m_count;
+            }
+            lua_sethook(state, hook, mask | m_mask, m_step);
         }
-        inline static void put(lua_State * L, const Container& s)
+
+        // restore the saved hook if hook is on top, return false otherwise.
+        // also for coroutines which inherited the hook.
+        bool remove(lua_State * state, lua_Hook hook)
         {
-            lua_newtable(L);
-            int index = 1;
-            for (auto it = s.begin(); it != s.end(); ++it)
+            if (lua_gethook(state) != hook)
             {
-                LuaStack<typename Container::value_type>::put(L, *it);
-                lua_rawseti(L, -2, index++);
+                return false;
+            }
+            lua_sethook(state, m_hook, m_mask, m_count);
+            if (m_state == state)
+            {
+                m_state = nullptr;
             }
+            return true;
         }
-    };
 
-    // deque
-    template<typename K, typename ...ARGS>
-    struct LuaStack<std::deque<K, ARGS...>>
-    {
-        typedef std::deque<K, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        // call first in the hook: forward event to the saved hook, return true if the hook asked for the event.
+        bool dispatch(lua_State * state, lua_Debug * ar)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            int event = EventMask(ar->event);
+            bool saved = (m_mask & event) != 0;
+            bool own = (m_ownMask & event) != 0;
+            if (event == LUA_MASKCOUNT)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
-                {
-                    result.push_back(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
-                    lua_pop(L, 1);
-                }
-                lua_pop(L, 0);
+                saved = saved && Counted(m_counted, m_step, m_count);
+                own = own && Counted(m_ownCounted, m_step, m_ownCount);
             }
-            return result;
+            if (saved)
+            {
+                m_hook(state, ar);
+            }
+            return own;
         }
-        inline static void put(lua_State * L, const Container& s)
+
+    private:
+        static bool Counted(int & counted, int step, int count)
         {
-            lua_newtable(L);
-            int index = 1;
-            for (auto it = s.begin(); it != s.end(); ++it)
+            counted += step;
+            if (counted < count)
             {
-                LuaStack<typename Container::value_type>::put(L, *it);
-                lua_rawseti(L, -2, index++);
+                return false;
             }
+            counted -= count;
+            return true;
+        }
+
+        static int EventMask(int event)
+        {
+#if !defined LUA_VERSION_NUM || LUA_VERSION_NUM <= 501
+            // LUA_HOOKTAILRET
+            return event == 4 ? LUA_MASKRET : (1 << event);
+#else
+            // LUA_HOOKTAILCALL
+            return event == 4 ? LUA_MASKCALL : (1 << event);
+#endif
         }
+
+    private:
+        lua_State * m_state;
+        lua_Hook m_hook;
+        int m_mask;
+        int m_count;
+        int m_counted;
+        int m_ownMask;
+        int m_ownCount;
+        int m_ownCounted;
+        int m_step;
     };
 
-    // list
-    template<typename K, typename ...ARGS>
-    struct LuaStack<std::list<K, ARGS...>>
+#if LUAAA_WITH_PROFILER
+	//========================================================
+	// binding profiler
+	//========================================================
+    struct LuaProfileRecord
     {
-        typedef std::list<K, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        enum { HistogramSize = 40 };
+
+        LuaProfileRecord(const std::string& o, const std::string& b)
+            : name(o.empty() ? b : o + "." + b), owner(o), binding(b), next(nullptr)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            reset();
+        }
+
+        void reset()
+        {
+            calls = 0;
+            totalNs = 0;
+            allocations = 0;
+            allocBytes = 0;
+            for (int i = 0; i < HistogramSize; ++i)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
-                {
-                    result.push_back(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
-                    lua_pop(L, 1);
-                }
-                lua_pop(L, 0);
+                histogram[i] = 0;
             }
-            return result;
         }
-        inline static void put(lua_State * L, const Container& s)
+
+        void add(unsigned long long ns, unsigned long long allocs, unsigned long long bytes)
         {
-            lua_newtable(L);
-            int index = 1;
-            for (auto it = s.begin(); it != s.end(); ++it)
+            int bucket = 0;
+            while (bucket < HistogramSize - 1 && (ns >> bucket) != 0)
             {
-                LuaStack<typename Container::value_type>::put(L, *it);
-                lua_rawseti(L, -2, index++);
+                ++bucket;
             }
+            calls.fetch_add(1, std::memory_order_relaxed);
+            totalNs.fetch_add(ns, std::memory_order_relaxed);
+            allocations.fetch_add(allocs, std::memory_order_relaxed);
+            allocBytes.fetch_add(bytes, std::memory_order_relaxed);
+            histogram[bucket].fetch_add(1, std::memory_order_relaxed);
         }
-    };
 
-    // forward_list
-    template<typename K, typename ...ARGS>
-    struct LuaStack<std::forward_list<K, ARGS...>>
-    {
-        typedef std::forward_list<K, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        // call time in nanoseconds below which fraction p (0..1) of calls fall, upper bound from histogram.
+        unsigned long long percentile(double p) const
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            unsigned long long rank = (unsigned long long)(p * double(calls.load(std::memory_order_relaxed)));
+            unsigned long long seen = 0;
+            for (int i = 0; i < HistogramSize; ++i)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
+                seen += histogram[i].load(std::memory_order_relaxed);
+                if (seen > rank)
                 {
-                    result.push_back(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
-                    lua_pop(L, 1);
+                    return i == 0 ? 0 : (1ULL << i) - 1;
                 }
-                lua_pop(L, 0);
             }
-            return result;
+            return (1ULL << (HistogramSize - 1)) - 1;
         }
-        inline static void put(lua_State * L, const Container& s)
+
+        const std::string name;         // "owner.binding"
+        const std::string owner;        // LuaClass or LuaModule name, empty for globals
+        const std::string binding;
+        std::atomic<unsigned long long> calls;
+        std::atomic<unsigned long long> totalNs;
+        std::atomic<unsigned long long> allocations;    // lua allocations, counted for states of StateAllocator only
+        std::atomic<unsigned long long> allocBytes;     // lua bytes allocated, growth of lua heap for other states
+        std::atomic<unsigned long long> histogram[HistogramSize];  // bucket i counts calls in [2^(i-1), 2^i) ns
+        LuaProfileRecord * next;
+    };
+
+    // records of all bindings, shared by all states and threads, they live until exit.
+    class Profiler
+    {
+    public:
+        // record of binding "owner.name", created on first use.
+        static LuaProfileRecord * record(const char * owner, const char * name)
         {
-            lua_newtable(L);
-            int index = 1;
-            for (auto it = s.begin(); it != s.end(); ++it)
+            std::string ownerName = (owner == nullptr || strcmp(owner, "_G") == 0) ? std::string() : std::string(owner);
+            std::lock_guard<std::mutex> lock(Mutex());
+            LuaProfileRecord * record = find(ownerName.empty() ? std::string(name) : ownerName + "." + name);
+            if (record == nullptr)
             {
-                LuaStack<typename Container::value_type>::put(L, *it);
-                lua_rawseti(L, -2, index++);
+                record = new LuaProfileRecord(ownerName, name);
+                record->next = Head().load(std::memory_order_relaxed);
+                Head().store(record, std::memory_order_release);
             }
+            return record;
         }
-    };
 
-    // set
-    template<typename K, typename ...ARGS>
-    struct LuaStack<std::set<K, ARGS...>>
-    {
-        typedef std::set<K, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        // iterate by next.
+        static LuaProfileRecord * first()
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            return Head().load(std::memory_order_acquire);
+        }
+
+        static LuaProfileRecord * find(const std::string& name)
+        {
+            for (LuaProfileRecord * record = first(); record; record = record->next)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
+                if (record->name == name)
                 {
-                    result.insert(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
-                    lua_pop(L, 1);
+                    return record;
                 }
-                lua_pop(L, 0);
             }
-            return result;
+            return nullptr;
         }
-        inline static void put(lua_State * L, const Container& s)
+
+        static void reset()
         {
-            lua_newtable(L);
-            int index = 1;
-            for (auto it = s.begin(); it != s.end(); ++it)
+            for (LuaProfileRecord * record = first(); record; record = record->next)
             {
-                LuaStack<typename Container::value_type>::put(L, *it);
-                lua_rawseti(L, -2, index++);
+                record->reset();
             }
         }
-    };
 
-    // multiset
-    template<typename K, typename ...ARGS>
-    struct LuaStack<std::multiset<K, ARGS...>>
-    {
-        typedef std::multiset<K, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        // lua function, returns { [name] = { calls, time, mean, p50, p99, allocations, bytes } } of called bindings,
+        // times in seconds.
+        static int stats(lua_State * state)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            lua_newtable(state);
+            for (LuaProfileRecord * record = first(); record; record = record->next)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
+                unsigned long long calls = record->calls.load(std::memory_order_relaxed);
+                if (calls == 0)
                 {
-                    result.insert(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
-                    lua_pop(L, 1);
+                    continue;
                 }
-                lua_pop(L, 0);
+                double totalNs = double(record->totalNs.load(std::memory_order_relaxed));
+                lua_createtable(state, 0, 7);
+                lua_pushinteger(state, lua_Integer(calls));
+                lua_setfield(state, -2, "calls");
+                lua_pushnumber(state, lua_Number(totalNs * 1e-9));
+                lua_setfield(state, -2, "time");
+                lua_pushnumber(state, lua_Number(totalNs * 1e-9 / double(calls)));
+                lua_setfield(state, -2, "mean");
+                lua_pushnumber(state, lua_Number(double(record->percentile(0.5)) * 1e-9));
+                lua_setfield(state, -2, "p50");
+                lua_pushnumber(state, lua_Number(double(record->percentile(0.99)) * 1e-9));
+                lua_setfield(state, -2, "p99");
+                lua_pushinteger(state, lua_Integer(record->allocations.load(std::memory_order_relaxed)));
+                lua_setfield(state, -2, "allocations");
+                lua_pushinteger(state, lua_Integer(record->allocBytes.load(std::memory_order_relaxed)));
+                lua_setfield(state, -2, "bytes");
+                lua_setfield(state, -2, record->name.c_str());
             }
-            return result;
+            return 1;
         }
-        inline static void put(lua_State * L, const Container& s)
+
+        // set luaaa.stats in lua.
+        static void open(lua_State * state)
         {
-            lua_newtable(L);
-            int index = 1;
-            for (auto it = s.begin(); it != s.end(); ++it)
+            lua_getglobal(state, "luaaa");
+            if (!lua_istable(state, -1))
             {
-                LuaStack<typename Container::value_type>::put(L, *it);
-                lua_rawseti(L, -2, index++);
+                lua_pop(state, 1);
+                lua_newtable(state);
             }
+            lua_pushcfunction(state, stats);
+            lua_setfield(state, -2, "stats");
+            lua_setglobal(state, "luaaa");
+        }
+
+    private:
+        static std::mutex& Mutex()
+        {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        static std::atomic<LuaProfileRecord*>& Head()
+        {
+            static std::atomic<LuaProfileRecord*> head(nullptr);
+            return head;
         }
     };
 
-    // unordered_set
-    template<typename K, typename ...ARGS>
-    struct LuaStack<std::unordered_set<K, ARGS...>>
+    // allocations and bytes allocated so far by state, defined after StateAllocator.
+    inline void LuaAllocCounters(lua_State * state, unsigned long long& allocations, unsigned long long& bytes);
+
+    // event of trace ring, 64 bytes.
+    struct LuaTraceEvent
     {
-        typedef std::unordered_set<K, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        unsigned long long ns;
+        const LuaProfileRecord * record;    // binding, nullptr for lua function
+        int args;
+        char phase;                         // 'B' begin, 'E' end
+        char name[43];                      // lua function, "name (source:line)"
+    };
+
+    // chrome trace-event recorder of binding calls and optionally lua function calls,
+    // events go to lock-free ring of the calling thread, flush() writes them as json (chrome://tracing, perfetto).
+    class Tracer
+    {
+    public:
+        // start recording, ring of each thread keeps up to eventsPerThread events until flush, newer events are dropped.
+        static void start(size_t eventsPerThread = 65536)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            Capacity().store(eventsPerThread < 16 ? 16 : eventsPerThread, std::memory_order_relaxed);
+            Enabled().store(true, std::memory_order_release);
+        }
+
+        static void stop()
+        {
+            Enabled().store(false, std::memory_order_release);
+        }
+
+        static bool enabled()
+        {
+            return Enabled().load(std::memory_order_relaxed);
+        }
+
+        // record enter and exit of lua functions run by state and coroutines it creates afterwards.
+        // uses the call and return hooks, slows down function calls.
+        // hook found installed keeps its events, and is restored when tracing is off.
+        static void traceLua(lua_State * state, bool on)
+        {
+            Traced * traced = FindTraced(state, on);
+            if (traced == nullptr)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
-                {
-                    result.insert(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
-                    lua_pop(L, 1);
-                }
-                lua_pop(L, 0);
+                return;
+            }
+            traced->on = on;
+            if (on)
+            {
+                traced->hooks.install(state, Hook, LUA_MASKCALL | LUA_MASKRET, 0);
+            }
+            else
+            {
+                traced->hooks.remove(state, Hook);
             }
-            return result;
         }
 
-        inline static void put(lua_State * L, const Container& s)
+        static void record(char phase, const LuaProfileRecord * record, int args, const char * name = nullptr)
         {
-            lua_newtable(L);
-            int index = 1;
-            for (auto it = s.begin(); it != s.end(); ++it)
+            Ring * ring = CurrentRing();
+            if (ring == nullptr)
             {
-                LuaStack<typename Container::value_type>::put(L, *it);
-                lua_rawseti(L, -2, index++);
+                return;
+            }
+            size_t head = ring->head.load(std::memory_order_relaxed);
+            if (head - ring->tail.load(std::memory_order_acquire) >= ring->capacity)
+            {
+                ring->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            LuaTraceEvent & event = ring->events[head % ring->capacity];
+            event.ns = Now();
+            event.record = record;
+            event.args = args;
+            event.phase = phase;
+            event.name[0] = 0;
+            if (name)
+            {
+                strncpy(event.name, name, sizeof(event.name) - 1);
+                event.name[sizeof(event.name) - 1] = 0;
             }
+            ring->head.store(head + 1, std::memory_order_release);
         }
-    };
 
-    // unordered_multiset
-    template<typename K, typename ...ARGS>
-    struct LuaStack<std::unordered_multiset<K, ARGS...>>
-    {
-        typedef std::unordered_multiset<K, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        // write recorded events of all threads as json object and release them, may run while threads record.
+        static bool flush(FILE * file)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            std::lock_guard<std::mutex> lock(Mutex());
+            bool first = true;
+            fputs("{\"traceEvents\":[\n", file);
+            int tid = 0;
+            for (Ring * ring = Rings().load(std::memory_order_acquire); ring; ring = ring->next.load(std::memory_order_acquire), ++tid)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
+                size_t tail = ring->tail.load(std::memory_order_relaxed);
+                size_t head = ring->head.load(std::memory_order_acquire);
+                for (; tail != head; ++tail)
                 {
-                    result.insert(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
-                    lua_pop(L, 1);
+                    const LuaTraceEvent & event = ring->events[tail % ring->capacity];
+                    fputs(first ? "" : ",\n", file);
+                    first = false;
+                    writeEvent(file, event, tid);
+                }
+                ring->tail.store(tail, std::memory_order_release);
+                unsigned long long dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+                if (dropped)
+                {
+                    fprintf(file, "%s{\"name\":\"dropped %llu events\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+                        first ? "" : ",\n", dropped, double(Now()) / 1000.0, tid);
+                    first = false;
                 }
-                lua_pop(L, 0);
             }
-            return result;
+            fputs("\n]}\n", file);
+            return ferror(file) == 0;
         }
 
-        inline static void put(lua_State * L, const Container& s)
+        static bool flush(const char * path)
         {
-            lua_newtable(L);
-            int index = 1;
-            for (auto it = s.begin(); it != s.end(); ++it)
+            FILE * file = fopen(path, "wb");
+            if (file == nullptr)
             {
-                LuaStack<typename Container::value_type>::put(L, *it);
-                lua_rawseti(L, -2, index++);
+                return false;
             }
+            bool ok = flush(file);
+            return (fclose(file) == 0) && ok;
         }
-    };
 
-    // map
-    template<typename K, typename V, typename ...ARGS>
-    struct LuaStack<std::map<K, V, ARGS...>>
-    {
-        typedef std::map<K, V, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+    private:
+        struct Ring
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            explicit Ring(size_t size) : events(new LuaTraceEvent[size]), capacity(size), head(0), tail(0), dropped(0), inUse(true), next(nullptr) {}
+
+            LuaTraceEvent * events;
+            const size_t capacity;
+            std::atomic<size_t> head;       // written by owner thread
+            std::atomic<size_t> tail;       // written by flush
+            std::atomic<unsigned long long> dropped;
+            std::atomic<bool> inUse;
+            std::atomic<Ring*> next;
+        };
+
+        // ring of calling thread, released for reuse when the thread exits. rings live until exit.
+        struct RingHolder
+        {
+            Ring * ring = nullptr;
+
+            ~RingHolder()
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
+                if (ring)
                 {
-                    const int top = lua_gettop(L);
-                    result[LuaStack<typename Container::key_type>::get(L, top - 1)] = LuaStack<typename Container::mapped_type>::get(L, top);
-                    lua_pop(L, 1);
+                    ring->inUse.store(false, std::memory_order_release);
                 }
-                lua_pop(L, 0);
             }
-            return result;
+        };
+
+        static Ring * CurrentRing()
+        {
+            static thread_local RingHolder holder;
+            if (holder.ring == nullptr)
+            {
+                std::lock_guard<std::mutex> lock(Mutex());
+                // start() may run on another thread meanwhile.
+                const size_t capacity = Capacity().load(std::memory_order_relaxed);
+                for (Ring * ring = Rings().load(std::memory_order_relaxed); ring; ring = ring->next.load(std::memory_order_relaxed))
+                {
+                    bool idle = false;
+                    if (ring->capacity == capacity && ring->inUse.compare_exchange_strong(idle, true))
+                    {
+                        holder.ring = ring;
+                        return ring;
+                    }
+                }
+                Ring * ring = new Ring(capacity);
+                // append, position in list is the tid in json.
+                (Last() ? Last()->next : Rings()).store(ring, std::memory_order_release);
+                Last() = ring;
+                holder.ring = ring;
+            }
+            return holder.ring;
         }
-        inline static void put(lua_State * L, const Container& s)
+
+        // hook chain of traced state, kept in registry.
+        struct Traced
         {
-            lua_newtable(L);
-            for (auto it = s.begin(); it != s.end(); ++it)
+            LuaHookChain hooks;
+            bool on;
+        };
+
+        static Traced * FindTraced(lua_State * state, bool create)
+        {
+            static char key = 0;
+            lua_pushlightuserdata(state, &key);
+            lua_rawget(state, LUA_REGISTRYINDEX);
+            Traced * traced = static_cast<Traced*>(lua_touserdata(state, -1));
+            lua_pop(state, 1);
+            if (traced == nullptr && create)
             {
-                LuaStack<typename Container::key_type>::put(L, it->first);
-                LuaStack<typename Container::mapped_type>::put(L, it->second);
-                lua_rawset(L, -3);
+                lua_pushlightuserdata(state, &key);
+                traced = new (lua_newuserdata(state, sizeof(Traced))) Traced();
+                lua_rawset(state, LUA_REGISTRYINDEX);
             }
+            return traced;
         }
-    };
 
-    // multimap
-    template<typename K, typename V, typename ...ARGS>
-    struct LuaStack<std::multimap<K, V, ARGS...>>
-    {
-        typedef std::multimap<K, V, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        static void Hook(lua_State * state, lua_Debug * ar)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            Traced * traced = FindTraced(state, false);
+            if (traced == nullptr)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
+                lua_sethook(state, nullptr, 0, 0);
+                return;
+            }
+            if (!traced->hooks.dispatch(state, ar))
+            {
+                return;
+            }
+            if (!traced->on)
+            {
+                // turned off while another hook was on top of it.
+                traced->hooks.remove(state, Hook);
+                return;
+            }
+            if (!enabled())
+            {
+                return;
+            }
+            if (ar->event == LUA_HOOKCALL
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+                || ar->event == LUA_HOOKTAILCALL
+#endif
+                )
+            {
+                char name[sizeof(LuaTraceEvent::name)] = "?";
+                if (lua_getinfo(state, "Sn", ar))
                 {
-                    const int top = lua_gettop(L);
-                    result[LuaStack<typename Container::key_type>::get(L, top - 1)] = LuaStack<typename Container::mapped_type>::get(L, top);
-                    lua_pop(L, 1);
+                    const char * function = strcmp(ar->what, "main") == 0 ? "main" : (ar->name ? ar->name : "?");
+                    // fields are bounded to fit the event, source keeps its tail which tells the file.
+                    if (strcmp(ar->what, "C") == 0)
+                    {
+                        snprintf(name, sizeof(name), "%.*s [C]", int(sizeof(name) - 5), function);
+                    }
+                    else
+                    {
+                        const size_t length = strlen(ar->short_src);
+                        const char * source = length > 20 ? ar->short_src + length - 20 : ar->short_src;
+                        snprintf(name, sizeof(name), "%.16s (%.20s:%d)", function, source, ar->linedefined);
+                    }
                 }
-                lua_pop(L, 0);
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+                // tail call replaces the running function, no return event comes for it.
+                if (ar->event == LUA_HOOKTAILCALL)
+                {
+                    record('E', nullptr, 0);
+                }
+#endif
+                record('B', nullptr, 0, name);
             }
-            return result;
-        }
-        inline static void put(lua_State * L, const Container& s)
-        {
-            lua_newtable(L);
-            for (auto it = s.begin(); it != s.end(); ++it)
+            else
             {
-                LuaStack<typename Container::key_type>::put(L, it->first);
-                LuaStack<typename Container::mapped_type>::put(L, it->second);
-                lua_rawset(L, -3);
+                record('E', nullptr, 0);
             }
         }
-    };
 
-    // unordered_map
-    template<typename K, typename V, typename ...ARGS>
-    struct LuaStack<std::unordered_map<K, V, ARGS...>>
-    {
-        typedef std::unordered_map<K, V, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+        static void writeString(FILE * file, const char * text)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            fputc('"', file);
+            for (; *text; ++text)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
+                unsigned char c = static_cast<unsigned char>(*text);
+                if (c == '"' || c == '\\')
                 {
-                    const int top = lua_gettop(L);
-                    result[LuaStack<typename Container::key_type>::get(L, top - 1)] = LuaStack<typename Container::mapped_type>::get(L, top);
-                    lua_pop(L, 1);
+                    fputc('\\', file);
+                    fputc(c, file);
+                }
+                else if (c < 0x20)
+                {
+                    fprintf(file, "\\u%04x", c);
+                }
+                else
+                {
+                    fputc(c, file);
                 }
-                lua_pop(L, 0);
             }
-            return result;
+            fputc('"', file);
         }
-        inline static void put(lua_State * L, const Container& s)
+
+        static void writeEvent(FILE * file, const LuaTraceEvent & event, int tid)
         {
-            lua_newtable(L);
-            for (auto it = s.begin(); it != s.end(); ++it)
+            fputs("{\"name\":", file);
+            writeString(file, event.record ? event.record->binding.c_str() : event.name);
+            fputs(",\"cat\":", file);
+            writeString(file, event.record ? (event.record->owner.empty() ? "_G" : event.record->owner.c_str()) : "lua");
+            fprintf(file, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", event.phase, double(event.ns) / 1000.0, tid);
+            if (event.phase == 'B' && event.record)
             {
-                LuaStack<typename Container::key_type>::put(L, it->first);
-                LuaStack<typename Container::mapped_type>::put(L, it->second);
-                lua_rawset(L, -3);
+                fprintf(file, ",\"args\":{\"argc\":%d}", event.args);
             }
+            fputc('}', file);
+        }
+
+        static unsigned long long Now()
+        {
+            static const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+            return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+        }
+
+        static std::atomic<bool>& Enabled()
+        {
+            static std::atomic<bool> enabled(false);
+            return enabled;
+        }
+
+        static std::atomic<size_t>& Capacity()
+        {
+            static std::atomic<size_t> capacity(65536);
+            return capacity;
+        }
+
+        static std::mutex& Mutex()
+        {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        static std::atomic<Ring*>& Rings()
+        {
+            static std::atomic<Ring*> rings(nullptr);
+            return rings;
+        }
+
+        static Ring *& Last()
+        {
+            static Ring * last = nullptr;
+            return last;
         }
     };
 
-    // unordered_multimap
-    template<typename K, typename V, typename ...ARGS>
-    struct LuaStack<std::unordered_multimap<K, V, ARGS...>>
+    // sample stack for SamplingProfiler if it asked for one, defined with SamplingProfiler.
+    inline void LuaSampleBinding(lua_State * state, LuaProfileRecord * record);
+
+    // records one call of a binding, on scope exit.
+    class LuaProfileScope
     {
-        typedef std::unordered_multimap<K, V, ARGS...> Container;
-        inline static Container get(lua_State * L, int idx)
+    public:
+        LuaProfileScope(lua_State * state, LuaProfileRecord * record) : m_state(state), m_record(record), m_outer(nullptr), m_traced(false)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            if (m_record)
             {
-                lua_pushnil(L);
-                while (0 != lua_next(L, idx))
+                m_outer = Current();
+                Current() = m_record;
+                m_traced = Tracer::enabled();
+                if (m_traced)
                 {
-                    const int top = lua_gettop(L);
-                    result[LuaStack<typename Container::key_type>::get(L, top - 1)] = LuaStack<typename Container::mapped_type>::get(L, top);
-                    lua_pop(L, 1);
+                    Tracer::record('B', m_record, lua_gettop(m_state));
                 }
-                lua_pop(L, 0);
+                LuaAllocCounters(m_state, m_allocations, m_bytes);
+                m_start = std::chrono::steady_clock::now();
             }
-            return result;
         }
-        inline static void put(lua_State * L, const Container& s)
+
+        ~LuaProfileScope()
         {
-            lua_newtable(L);
-            for (auto it = s.begin(); it != s.end(); ++it)
+            if (m_record)
             {
-                LuaStack<typename Container::key_type>::put(L, it->first);
-                LuaStack<typename Container::mapped_type>::put(L, it->second);
-                lua_rawset(L, -3);
+                unsigned long long ns = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+                unsigned long long allocations, bytes;
+                LuaAllocCounters(m_state, allocations, bytes);
+                m_record->add(ns, allocations - m_allocations, bytes > m_bytes ? bytes - m_bytes : 0);
+                LuaSampleBinding(m_state, m_record);
+                if (m_traced)
+                {
+                    Tracer::record('E', m_record, 0);
+                }
+                Current() = m_outer;
             }
         }
+
+        // innermost binding running on this thread. a binding left by lua_error stays current,
+        // until the next binding returns.
+        static LuaProfileRecord * current()
+        {
+            return Current();
+        }
+
+    private:
+        static LuaProfileRecord *& Current()
+        {
+            static thread_local LuaProfileRecord * record = nullptr;
+            return record;
+        }
+
+    private:
+        lua_State * m_state;
+        LuaProfileRecord * m_record;
+        LuaProfileRecord * m_outer;
+        bool m_traced;
+        unsigned long long m_allocations;
+        unsigned long long m_bytes;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    // record of ctor and __gc thunks, which have no upvalue to spare.
+    template<typename T, int I>
+    struct LuaProfileSlot
+    {
+        static LuaProfileRecord * record;
     };
 
+    template<typename T, int I> LuaProfileRecord * LuaProfileSlot<T, I>::record = nullptr;
 
-    // std::pair
-    template<typename U, typename V>
-    struct LuaStack<std::pair<U, V>>
+    // push record of binding as last upvalue of its closure, return count of upvalues pushed.
+    inline int LuaProfilePush(lua_State * state, const char * owner, const char * name)
     {
-        typedef std::pair<U, V> Container;
-        inline static Container get(lua_State * L, int idx)
+        lua_pushlightuserdata(state, Profiler::record(owner, name));
+        return 1;
+    }
+
+    // record is upvalue 2 of fun() closures and upvalue 3 of descriptor table closures, after callee block.
+    inline LuaProfileRecord * LuaProfileRecordOf(lua_State * state)
+    {
+        int index = lua_islightuserdata(state, lua_upvalueindex(2)) ? 2 : 3;
+        return static_cast<LuaProfileRecord*>(lua_touserdata(state, lua_upvalueindex(index)));
+    }
+
+#   define LUAAA_PROFILE(state, record) LUAAA_NS::LuaProfileScope luaaaProfileScope(state, record)
+#   define LUAAA_PROFILE_SLOT(T, I) LUAAA_NS::LuaProfileSlot<T, I>::record
+#   define LUAAA_PROFILE_NAME(slot, owner, name) ((slot) = LUAAA_NS::Profiler::record(owner, name))
+#else
+    inline int LuaProfilePush(lua_State *, const char *, const char *)
+    {
+        return 0;
+    }
+
+#   define LUAAA_PROFILE(state, record)
+#   define LUAAA_PROFILE_SLOT(T, I)
+#   define LUAAA_PROFILE_NAME(slot, owner, name) ((void)0)
+#endif
+
+	//========================================================
+	// closure caller, callee is stored in the first upvalue
+	//========================================================
+    template<typename F, int SKIPPARAM>
+    struct ClosureCaller
+    {
+        static int Invoke(lua_State * state)
         {
-            Container result;
-            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
-            if (lua_istable(L, idx))
+            void * calleePtr = lua_touserdata(state, lua_upvalueindex(1));
+            luaL_argcheck(state, calleePtr, 1, "cpp closure function not found.");
+            int results = 0;
+            if (calleePtr)
             {
-                result.first = LuaStack<typename Container::first_type>::get(L, idx + 1);
-                result.second = LuaStack<typename Container::second_type>::get(L, idx + 2);
+                LUAAA_PROFILE(state, LuaProfileRecordOf(state));
+                results = FunctionCaller<F>::Invoke(state, SKIPPARAM, *(F*)(calleePtr));
             }
-            return result;
+            return results < 0 ? LuaYieldPending(state) : results;
         }
+    };
 
-        inline static void put(lua_State * L, const Container& s)
+    // non-member function caller
+    template<typename F>
+    inline lua_CFunction NonMemberFunctionCaller(const F&)
+    {
+        return ClosureCaller<F, 0>::Invoke;
+    }
+
+    // member function caller, static member function skips the self parameter.
+    template<typename F>
+    inline lua_CFunction MemberFunctionCaller(const F&)
+    {
+        return ClosureCaller<F, 1>::Invoke;
+    }
+
+    // caller of callable bound to LuaClass, callable takes self if its first parameter is the class.
+    template<typename TCLASS>
+    struct ClassFunctionCaller
+    {
+        template<typename F>
+        inline static lua_CFunction Get(const F & f)
+        {
+            return CallableTakesSelf<TCLASS, F>::value ? NonMemberFunctionCaller(f) : MemberFunctionCaller(f);
+        }
+    };
+
+    struct ModuleFunctionCaller
+    {
+        template<typename F>
+        inline static lua_CFunction Get(const F & f)
+        {
+            return NonMemberFunctionCaller(f);
+        }
+    };
+
+	//========================================================
+	// batch invoker, calls a member function on each object of an array
+	//========================================================
+    inline size_t LuaRawLength(lua_State * state, int idx)
+    {
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+        return lua_rawlen(state, idx);
+#else
+        return lua_objlen(state, idx);
+#endif
+    }
+
+    // result of each call is stored to results table at index i.
+    template<typename TRET, typename ...ARGS>
+    struct LuaBatchCall
+    {
+        enum { results = 1 };
+
+        inline static void prepare(lua_State * state, int count)
+        {
+            lua_createtable(state, count, 0);
+        }
+
+        template<typename CALLEE>
+        inline static void call(lua_State * state, int skip, CALLEE & callee, int results, int i)
+        {
+            LuaStack<TRET>::put(state, LuaSignature<TRET, ARGS...>::call(state, skip, callee));
+            lua_rawseti(state, results, i);
+        }
+    };
+
+    template<typename ...ARGS>
+    struct LuaBatchCall<void, ARGS...>
+    {
+        enum { results = 0 };
+
+        inline static void prepare(lua_State *, int)
         {
-            lua_newtable(L);
-            LuaStack<typename Container::first_type>::put(L, s.first);
-            lua_rawseti(L, -2, 1);
-            LuaStack<typename Container::second_type>::put(L, s.second);
-            lua_rawseti(L, -2, 2);
+        }
+
+        template<typename CALLEE>
+        inline static void call(lua_State * state, int skip, CALLEE & callee, int, int)
+        {
+            LuaSignature<void, ARGS...>::call(state, skip, callee);
+        }
+    };
+
+    // lua arguments: array of objects, then for each argument an array parallel to objects,
+    // or a non-table value passed to every call. table arguments must be arrays of tables.
+    // objects are checked against the class metatable once per object, without registry lookups.
+    // returns array of results, or nothing for void functions.
+    template<typename TCLASS, typename FTYPE, typename TRET, typename ...ARGS>
+    struct BatchInvoker
+    {
+        typedef typename MemberFunctionInvoker<TCLASS, FTYPE, TRET, ARGS...>::Callee Callee;
+
+        enum { arity = LuaSignature<TRET, ARGS...>::arity };
+
+        static int Invoke(lua_State * state, FTYPE func, const char * klassName)
+        {
+            luaL_checktype(state, 1, LUA_TTABLE);
+            const int count = int(LuaRawLength(state, 1));
+            const int params = lua_gettop(state);
+            luaL_getmetatable(state, klassName);
+            const int meta = lua_gettop(state);
+            LuaBatchCall<TRET, ARGS...>::prepare(state, count);
+            const int base = lua_gettop(state);
+            luaL_checkstack(state, arity + 2, "too many arguments");
+            for (int i = 1; i <= count; ++i)
+            {
+                lua_rawgeti(state, 1, i);
+                if (!lua_getmetatable(state, -1) || !lua_rawequal(state, -1, meta))
+                {
+                    return luaL_error(state, "bad argument #1 (object %d is not %s)", i, klassName);
+                }
+                lua_pop(state, 1);
+                TCLASS ** objPtr = static_cast<TCLASS**>(lua_touserdata(state, -1));
+                luaL_argcheck(state, *objPtr != nullptr, 1, "invalid user data");
+                for (int arg = 2; arg <= arity + 1; ++arg)
+                {
+                    if (arg > params)
+                    {
+                        lua_pushnil(state);
+                    }
+                    else if (lua_istable(state, arg))
+                    {
+                        lua_rawgeti(state, arg, i);
+                    }
+                    else
+                    {
+                        lua_pushvalue(state, arg);
+                    }
+                }
+                Callee callee = { **objPtr, func };
+                LuaBatchCall<TRET, ARGS...>::call(state, base + 1, callee, base, i);
+                lua_settop(state, base);
+            }
+            return LuaBatchCall<TRET, ARGS...>::results;
+        }
+    };
+
+    template<typename TCLASS, typename F> struct BatchCaller;
+
+    template<typename TCLASS, typename TRET, typename ...ARGS>
+    struct BatchCaller<TCLASS, TRET(TCLASS::*)(ARGS...)>
+        : public BatchInvoker<TCLASS, TRET(TCLASS::*)(ARGS...), TRET, ARGS...>
+    {
+        // member function is stored in the first upvalue.
+        static int Call(lua_State * state)
+        {
+            typedef TRET(TCLASS::*FTYPE)(ARGS...);
+            FTYPE * funcPtr = static_cast<FTYPE*>(lua_touserdata(state, lua_upvalueindex(1)));
+            LUAAA_PROFILE(state, LuaProfileRecordOf(state));
+            return BatchInvoker<TCLASS, FTYPE, TRET, ARGS...>::Invoke(state, *funcPtr, LuaClass<TCLASS>::klassName);
         }
     };
+
+    template<typename TCLASS, typename TRET, typename ...ARGS>
+    struct BatchCaller<TCLASS, TRET(TCLASS::*)(ARGS...)const>
+        : public BatchInvoker<TCLASS, TRET(TCLASS::*)(ARGS...)const, TRET, ARGS...>
+    {
+        static int Call(lua_State * state)
+        {
+            typedef TRET(TCLASS::*FTYPE)(ARGS...)const;
+            FTYPE * funcPtr = static_cast<FTYPE*>(lua_touserdata(state, lua_upvalueindex(1)));
+            LUAAA_PROFILE(state, LuaProfileRecordOf(state));
+            return BatchInvoker<TCLASS, FTYPE, TRET, ARGS...>::Invoke(state, *funcPtr, LuaClass<TCLASS>::klassName);
+        }
+    };
+
+	//========================================================
+	// binding descriptor table
+	//========================================================
+    template<typename F>
+    struct LuaBindingEntry
+    {
+        constexpr LuaBindingEntry(const char * n, F f) : name(n), func(f) {}
+
+        const char * name;
+        F func;
+    };
+
+    template<typename F>
+    constexpr LuaBindingEntry<F> entry(const char * name, F func)
+    {
+        return LuaBindingEntry<F>(name, func);
+    }
+
+    template<typename SEQ, typename ...F> struct LuaBindingList;
+
+    template<size_t ...I, typename ...F>
+    struct LuaBindingList<IndexSequence<I...>, F...> : public LuaValue<I, LuaBindingEntry<F>>...
+    {
+        enum { size = sizeof...(F) };
+
+        constexpr LuaBindingList(const LuaBindingEntry<F>&... entries) : LuaValue<I, LuaBindingEntry<F>>{ entries }... {}
+
+        // set closures to table on top of stack.
+        // callees are copied to one userdata block, each closure refers to its callee by light userdata,
+        // and keeps the block alive by the second upvalue.
+        template<typename CALLER>
+        inline void apply(lua_State * state, const char * owner) const
+        {
+            typedef LuaValueList<IndexSequence<I...>, F...> Block;
+            luaL_checkstack(state, 4, "too many bindings");
+            Block * block = CalleeStorage<Block>::New(state, Block(static_cast<const LuaValue<I, LuaBindingEntry<F>>&>(*this).value.func...));
+            luaL_argcheck(state, block != nullptr, 1, "faild to alloc mem to store functions");
+            int results[] = { 0, (applyEntry<CALLER>(state, owner, static_cast<const LuaValue<I, LuaBindingEntry<F>>&>(*this).value.name,
+                static_cast<LuaValue<I, F>&>(*block).value), 0)... };
+            (void)(results);
+            lua_pop(state, 1);
+        }
+
+    private:
+        template<typename CALLER, typename E>
+        inline static void applyEntry(lua_State * state, const char * owner, const char * name, E & func)
+        {
+            lua_pushlightuserdata(state, &func);
+            lua_pushvalue(state, -2);
+            lua_pushcclosure(state, CALLER::Get(func), 2 + LuaProfilePush(state, owner, name));
+            lua_setfield(state, -3, name);
+        }
+    };
+
+    template<typename ...F>
+    using LuaBindings = LuaBindingList<typename MakeIndexSequence<sizeof...(F)>::type, F...>;
+
+    // declare bindings once, apply them to each new state with one table lookup, e.g.
+    //     static constexpr auto catFunctions = bindings(entry("getName", &Cat::getName), entry("eat", &Cat::eat));
+    //     LuaClass<Cat>(L, "Cat").ctor().fun(catFunctions);
+    template<typename ...F>
+    constexpr LuaBindings<F...> bindings(const LuaBindingEntry<F>&... entries)
+    {
+        return LuaBindings<F...>(entries...);
+    }
+
+	//========================================================
+	// constructor invoker
+	//========================================================
+    template<typename TCLASS, typename ...ARGS>
+    struct ConstructorCaller
+    {
+        struct Callee
+        {
+            inline TCLASS * operator()(ARGS... args) const
+            {
+                return new TCLASS(std::forward<ARGS>(args)...);
+            }
+        };
+
+        static TCLASS * Invoke(lua_State * state)
+        {
+            return LuaSignature<TCLASS*, ARGS...>::call(state, 0, Callee());
+        }
+    };
+
+    // constructor signature, used to overload ctor, e.g.
+    //     ctor("new", overload(constructor<>(), constructor<std::string>()));
+    template<typename ...ARGS>
+    struct LuaConstructor
+    {
+    };
+
+    template<typename ...ARGS>
+    inline LuaConstructor<ARGS...> constructor()
+    {
+        return LuaConstructor<ARGS...>();
+    }
+
+    // SpawnerCaller<TCLASS, F> creates instance by a ctor overload candidate.
+    template<typename TCLASS, typename F> struct SpawnerCaller;
+
+    template<typename TCLASS, typename ...ARGS>
+    struct SpawnerCaller<TCLASS, LuaConstructor<ARGS...>>
+    {
+        enum { arity = LuaSignature<TCLASS*, ARGS...>::arity, minArity = LuaSignature<TCLASS*, ARGS...>::minArity };
+
+        inline static bool Match(lua_State * state, int skip)
+        {
+            return LuaSignature<TCLASS*, ARGS...>::match(state, skip);
+        }
+
+        inline static TCLASS * Invoke(lua_State * state, int, const LuaConstructor<ARGS...>&)
+        {
+            return ConstructorCaller<TCLASS, ARGS...>::Invoke(state);
+        }
+    };
+
+    template<typename TCLASS, typename ...ARGS>
+    struct SpawnerCaller<TCLASS, TCLASS*(*)(ARGS...)>
+    {
+        enum { arity = LuaSignature<TCLASS*, ARGS...>::arity, minArity = LuaSignature<TCLASS*, ARGS...>::minArity };
+
+        inline static bool Match(lua_State * state, int skip)
+        {
+            return LuaSignature<TCLASS*, ARGS...>::match(state, skip);
+        }
+
+        inline static TCLASS * Invoke(lua_State * state, int skip, TCLASS*(*spawner)(ARGS...))
+        {
+            return LuaSignature<TCLASS*, ARGS...>::call(state, skip, spawner);
+        }
+    };
+
+    template<typename TCLASS, typename ...F>
+    struct SpawnerCaller<TCLASS, LuaOverload<F...>>
+    {
+        template<typename T> using Caller = SpawnerCaller<TCLASS, T>;
+
+        inline static TCLASS * Invoke(lua_State * state, int skip, LuaOverload<F...>& spawners)
+        {
+            return OverloadDispatcher<Caller, TCLASS*>::Invoke(state, skip, spawners);
+        }
+    };
+
+    //========================================================
+    // Destructor invoker
+    //========================================================
+    template<typename TCLASS, bool = std::is_destructible<TCLASS>::value>
+    struct DestructorCaller {
+        static void Invoke(TCLASS * obj) {
+            delete obj;
+        }
+    };
+
+    template<typename TCLASS>
+    struct DestructorCaller<TCLASS, false> {
+        static void Invoke(TCLASS * obj) {
+        }
+    };
+
+    //========================================================
+    // instance accounting
+    //========================================================
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+    template<typename T> using LuaCounter = std::atomic<T>;
+#else
+    template<typename T> using LuaCounter = T;
+#endif
+
+    struct LuaInstanceStats
+    {
+        size_t live;        // created and not collected yet
+        size_t created;
+        size_t peak;        // most live at once
+        size_t bytes;       // sizeof class of live instances
+    };
+
+    // instances of a LuaClass owned by lua, shared by all states.
+    // objects from ctors with nullptr deleter are borrowed and not counted.
+    struct LuaInstanceCounters
+    {
+        void add(size_t size)
+        {
+            size_t now = ++live;
+            ++created;
+            bytes += size;
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+            size_t most = peak.load(std::memory_order_relaxed);
+            while (now > most && !peak.compare_exchange_weak(most, now, std::memory_order_relaxed)) {}
+#else
+            if (now > peak)
+            {
+                peak = now;
+            }
+#endif
+        }
+
+        void remove(size_t size)
+        {
+            --live;
+            bytes -= size;
+        }
+
+        LuaInstanceStats stats() const
+        {
+            LuaInstanceStats stats = { live, created, peak, bytes };
+            return stats;
+        }
+
+        LuaCounter<size_t> live;
+        LuaCounter<size_t> created;
+        LuaCounter<size_t> peak;
+        LuaCounter<size_t> bytes;
+        char name[64];                  // lua class name
+        LuaCounter<LuaInstanceCounters*> next;
+        LuaCounter<bool> linked;
+    };
+
+    // counters of all bound classes.
+    class Instances
+    {
+    public:
+        // iterate by next.
+        static LuaInstanceCounters * first()
+        {
+            return Head();
+        }
+
+        static LuaInstanceCounters * find(const char * name)
+        {
+            for (LuaInstanceCounters * counters = first(); counters; counters = counters->next)
+            {
+                if (strcmp(counters->name, name) == 0)
+                {
+                    return counters;
+                }
+            }
+            return nullptr;
+        }
+
+        // count created and peak from live instances.
+        static void reset()
+        {
+            for (LuaInstanceCounters * counters = first(); counters; counters = counters->next)
+            {
+                size_t live = counters->live;
+                counters->created = live;
+                counters->peak = live;
+            }
+        }
+
+        // lua function, returns { [class] = { live, created, peak, bytes } }, or stats of one class by name.
+        static int stats(lua_State * state)
+        {
+            const char * name = lua_isstring(state, 1) ? lua_tostring(state, 1) : nullptr;
+            if (name == nullptr)
+            {
+                lua_newtable(state);
+            }
+            for (LuaInstanceCounters * counters = first(); counters; counters = counters->next)
+            {
+                if (name && strcmp(counters->name, name) != 0)
+                {
+                    continue;
+                }
+                LuaInstanceStats stats = counters->stats();
+                lua_createtable(state, 0, 4);
+                lua_pushinteger(state, lua_Integer(stats.live));
+                lua_setfield(state, -2, "live");
+                lua_pushinteger(state, lua_Integer(stats.created));
+                lua_setfield(state, -2, "created");
+                lua_pushinteger(state, lua_Integer(stats.peak));
+                lua_setfield(state, -2, "peak");
+                lua_pushinteger(state, lua_Integer(stats.bytes));
+                lua_setfield(state, -2, "bytes");
+                if (name)
+                {
+                    return 1;
+                }
+                lua_setfield(state, -2, counters->name);
+            }
+            if (name)
+            {
+                lua_pushnil(state);
+            }
+            return 1;
+        }
+
+        // set luaaa.instances in lua.
+        static void open(lua_State * state)
+        {
+            lua_getglobal(state, "luaaa");
+            if (!lua_istable(state, -1))
+            {
+                lua_pop(state, 1);
+                lua_newtable(state);
+            }
+            lua_pushcfunction(state, stats);
+            lua_setfield(state, -2, "instances");
+            lua_setglobal(state, "luaaa");
+        }
+
+        // called by LuaClass on binding, links counters once.
+        static void link(LuaInstanceCounters * counters, const char * name)
+        {
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+            if (counters->linked.exchange(true))
+            {
+                return;
+            }
+#else
+            if (counters->linked)
+            {
+                return;
+            }
+            counters->linked = true;
+#endif
+            strncpy(counters->name, name, sizeof(counters->name) - 1);
+            counters->name[sizeof(counters->name) - 1] = 0;
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+            LuaInstanceCounters * head = Head().load(std::memory_order_relaxed);
+            do
+            {
+                counters->next.store(head, std::memory_order_relaxed);
+            } while (!Head().compare_exchange_weak(head, counters, std::memory_order_release, std::memory_order_relaxed));
+#else
+            counters->next = Head();
+            Head() = counters;
+#endif
+        }
+
+    private:
+        static LuaCounter<LuaInstanceCounters*>& Head()
+        {
+            static LuaCounter<LuaInstanceCounters*> head(nullptr);
+            return head;
+        }
+    };
+
+    //========================================================
+    // export class
+    //========================================================
+	template <typename TCLASS>
+	struct LuaClass
+	{
+         friend struct DestructorCaller<TCLASS>;
+         template<typename> friend struct LuaStack;
+         template<typename, typename> friend struct LuaStackMatcher;
+         template<typename, typename> friend struct BatchCaller;
+	public:
+		LuaClass(lua_State * state, const char * name, const luaL_Reg * functions = nullptr)
+			: m_state(state)
+		{
+            assert(state != nullptr);
+            // class can be bound to several lua states, with the same lua name.
+            assert(klassName == nullptr || strcmp(klassName, name) == 0);
+
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+			luaL_argcheck(state, (klassName == nullptr || strcmp(klassName, name) == 0), 1, (std::string("C++ class `") + RTTI_CLASS_NAME(TCLASS) + "` bind to conflict lua name `" + name + "`, origin name: " + klassName).c_str());
+#else
+            luaL_argcheck(state, (klassName == nullptr || strcmp(klassName, name) == 0), 1, "C++ class bind to conflict lua class name");
+#endif
+
+            // the name lives until process exit, states of other threads may still use it.
+            // bind a class to its first state before other threads bind it.
+            if (klassName == nullptr)
+            {
+                size_t strBufLen = strlen(name) + 1;
+                klassName = new char[strBufLen];
+                memcpy(klassName, name, strBufLen);
+            }
+
+            Instances::link(&klassInstances, klassName);
+
+            luaL_newmetatable(state, klassName);
+			lua_pushvalue(state, -1);
+			lua_setfield(state, -2, "__index");
+			if (functions)
+			{
+				luaL_setfuncs(state, functions, 0);
+			}
+			lua_pop(state, 1);
+		}
+
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+        LuaClass(lua_State * state, const std::string& name, const luaL_Reg * functions = nullptr)
+            : LuaClass(state, name.c_str(), functions)
+        {}
+#endif
+
+		template<typename ...ARGS>
+		inline LuaClass<TCLASS>& ctor(const char * name = "new")
+		{
+			struct HelperClass {
+                
+                static int f_gc(lua_State* state) {
+                    LUAAA_PROFILE(state, LUAAA_PROFILE_SLOT(HelperClass, 1));
+                    TCLASS ** objPtr = (TCLASS**)luaL_checkudata(state, -1, LuaClass<TCLASS>::klassName);
+                    if (objPtr)
+                    {
+                        DestructorCaller<TCLASS>::Invoke(*objPtr);
+                        LuaClass<TCLASS>::klassInstances.remove(sizeof(TCLASS));
+                    }
+                    return 0;
+                }
+
+				static int f_new(lua_State* state) {
+				    LUAAA_PROFILE(state, LUAAA_PROFILE_SLOT(HelperClass, 0));
+					auto obj = ConstructorCaller<TCLASS, ARGS...>::Invoke(state);
+					if (obj)
+					{   
+						TCLASS ** objPtr = (TCLASS**)lua_newuserdata(state, sizeof(TCLASS*));
+						if (objPtr)
+						{
+							*objPtr = obj;
+                            luaL_Reg destructor[] = { { "__gc", HelperClass::f_gc }, { nullptr, nullptr } };
+							luaL_getmetatable(state, LuaClass<TCLASS>::klassName);
+                            luaL_setfuncs(state, destructor, 0);
+                            lua_setmetatable(state, -2);
+                            LuaClass<TCLASS>::klassInstances.add(sizeof(TCLASS));
+							return 1;
+						}
+						else
+						{
+                            DestructorCaller<TCLASS>::Invoke(obj);
+						}
+					}
+					lua_pushnil(state);			
+					return 1;
+				}
+			};
+
+			luaL_Reg constructor[] = { { name, HelperClass::f_new },{ nullptr, nullptr } };
+			LUAAA_PROFILE_NAME(LUAAA_PROFILE_SLOT(HelperClass, 0), klassName, name);
+			LUAAA_PROFILE_NAME(LUAAA_PROFILE_SLOT(HelperClass, 1), klassName, "__gc");
+#if USE_NEW_MODULE_REGISTRY
+            lua_getglobal(m_state, klassName);
+            if (lua_isnil(m_state, -1))
+            {
+                lua_pop(m_state, 1);
+                lua_newtable(m_state);
+            }
+            luaL_setfuncs(m_state, constructor, 0);
+            lua_setglobal(m_state, klassName);
+#else
+            luaL_openlib(m_state, klassName, constructor, 0);
+#endif
+
+			return (*this);
+		}
+
+        template<typename ...ARGS>
+        inline LuaClass<TCLASS>& ctor(const char * name, TCLASS*(*spawner)(ARGS...)) {
+            typedef decltype(spawner) SPAWNERFTYPE;
+            struct HelperClass {
+                static int f_gc(lua_State* state) {
+                    LUAAA_PROFILE(state, LUAAA_PROFILE_SLOT(HelperClass, 1));
+                    TCLASS ** objPtr = (TCLASS**)luaL_checkudata(state, -1, LuaClass<TCLASS>::klassName);
+                    if (objPtr)
+                    {
+                        DestructorCaller<TCLASS>::Invoke(*objPtr);
+                        LuaClass<TCLASS>::klassInstances.remove(sizeof(TCLASS));
+                    }
+                    return 0;
+                }
+
+                static int f_new(lua_State* state) {
+                    LUAAA_PROFILE(state, LUAAA_PROFILE_SLOT(HelperClass, 0));
+                    void * spawner = lua_touserdata(state, lua_upvalueindex(1));
+                    luaL_argcheck(state, spawner, 1, "cpp closure spawner not found.");
+                    if (spawner) {
+                        auto obj = LuaSignature<TCLASS*, ARGS...>::call(state, 0, *(SPAWNERFTYPE*)(spawner));
+                        if (obj)
+                        {
+                            TCLASS ** objPtr = (TCLASS**)lua_newuserdata(state, sizeof(TCLASS*));
+                            if (objPtr)
+                            {
+                                *objPtr = obj;
+
+                                luaL_Reg destructor[] = { { "__gc", HelperClass::f_gc }, { nullptr, nullptr } };
+                                luaL_getmetatable(state, LuaClass<TCLASS>::klassName);
+                                luaL_setfuncs(state, destructor, 0);
+                                lua_setmetatable(state, -2);
+                                LuaClass<TCLASS>::klassInstances.add(sizeof(TCLASS));
+                                
+                                return 1;
+                            }
+                            else
+                            {
+                                DestructorCaller<TCLASS>::Invoke(obj);
+                            }
+                        }
+                    }
+                    lua_pushnil(state);
+                    return 1;
+                }
+
+            };
+
+            luaL_Reg constructor[] = { { name, HelperClass::f_new },{ nullptr, nullptr } };
+            LUAAA_PROFILE_NAME(LUAAA_PROFILE_SLOT(HelperClass, 0), klassName, name);
+            LUAAA_PROFILE_NAME(LUAAA_PROFILE_SLOT(HelperClass, 1), klassName, "__gc");
+#if USE_NEW_MODULE_REGISTRY
+            lua_getglobal(m_state, klassName);
+            if (lua_isnil(m_state, -1))
+            {
+                lua_pop(m_state, 1);
+                lua_newtable(m_state);
+            }
+#endif
+
+            SPAWNERFTYPE * spawnerPtr = (SPAWNERFTYPE*)lua_newuserdata(m_state, sizeof(SPAWNERFTYPE));
+#   ifndef LUAAA_WITHOUT_CPP_STDLIB
+            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, (std::string("faild to alloc mem to store spawner for ctor `") + name + "`").c_str());
+#   else
+            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, "faild to alloc mem to store spawner for ctor");
+#   endif
+            *spawnerPtr = spawner;
+
+#if USE_NEW_MODULE_REGISTRY
+            luaL_setfuncs(m_state, constructor, 1);
+            lua_setglobal(m_state, klassName);
+#else
+            luaL_openlib(m_state, klassName, constructor, 1);
+#endif
+
+            return (*this);
+        }
+
+        template<typename TRET, typename ...ARGS>
+        inline LuaClass<TCLASS>& ctor(const char * name, TCLASS*(*spawner)(ARGS...), TRET(*deleter)(TCLASS*)){
+            typedef decltype(spawner) SPAWNERFTYPE;
+            typedef decltype(deleter) DELETERFTYPE;
+
+            struct HelperClass {
+                static int f_gc(lua_State* state) {
+                    LUAAA_PROFILE(state, LUAAA_PROFILE_SLOT(HelperClass, 1));
+                    void * deleter = lua_touserdata(state, lua_upvalueindex(1));
+                    luaL_argcheck(state, deleter, 1, "cpp closure deleter not found.");
+                    if (deleter) {
+                        TCLASS ** objPtr = (TCLASS**)luaL_checkudata(state, -1, LuaClass<TCLASS>::klassName);
+                        if (objPtr)
+                        {
+                            (*(DELETERFTYPE*)(deleter))(*objPtr);
+                            LuaClass<TCLASS>::klassInstances.remove(sizeof(TCLASS));
+                        }
+                    }
+                    
+                    return 0;
+                }
+
+                static int f_new(lua_State* state) {
+                    LUAAA_PROFILE(state, LUAAA_PROFILE_SLOT(HelperClass, 0));
+                    void * spawner = lua_touserdata(state, lua_upvalueindex(1));
+                    luaL_argcheck(state, spawner, 1, "cpp closure spawner not found.");
+
+                    void * deleter = lua_touserdata(state, lua_upvalueindex(2));
+                    luaL_argcheck(state, deleter, 1, "cpp closure deleter not found.");
+
+                    if (spawner) {
+                        auto obj = LuaSignature<TCLASS*, ARGS...>::call(state, 0, *(SPAWNERFTYPE*)(spawner));
+                        if (obj)
+                        {
+                            TCLASS ** objPtr = (TCLASS**)lua_newuserdata(state, sizeof(TCLASS*));
+                            if (objPtr)
+                            {
+                                *objPtr = obj;
+
+                                luaL_Reg destructor[] = {
+                                    { "__gc", HelperClass::f_gc },
+                                    { nullptr, nullptr }
+                                };
+
+                               
+                                luaL_getmetatable(state, LuaClass<TCLASS>::klassName);
+
+                                DELETERFTYPE * deleterPtr = (DELETERFTYPE*)lua_newuserdata(state, sizeof(DELETERFTYPE));
+#   ifndef LUAAA_WITHOUT_CPP_STDLIB
+                                luaL_argcheck(state, deleterPtr != nullptr, 1, (std::string("faild to alloc mem to store deleter for ctor meta table `") + LuaClass<TCLASS>::klassName + "`").c_str());
+#   else
+                                luaL_argcheck(state, deleterPtr != nullptr, 1, "faild to alloc mem to store deleter for ctor meta table");
+#   endif
+                                *deleterPtr = *(DELETERFTYPE*)(deleter);
+
+                                luaL_setfuncs(state, destructor, 1);
+
+                                lua_setmetatable(state, -2);
+                                LuaClass<TCLASS>::klassInstances.add(sizeof(TCLASS));
+
+                                return 1;
+                            }
+                            else
+                            {
+                                DestructorCaller<TCLASS>::Invoke(obj);
+                            }
+                        }
+                    }
+                    lua_pushnil(state);
+                    return 1;
+                }
+
+            };
+
+            luaL_Reg constructor[] = { { name, HelperClass::f_new },{ nullptr, nullptr } };
+            LUAAA_PROFILE_NAME(LUAAA_PROFILE_SLOT(HelperClass, 0), klassName, name);
+            LUAAA_PROFILE_NAME(LUAAA_PROFILE_SLOT(HelperClass, 1), klassName, "__gc");
+
+#if USE_NEW_MODULE_REGISTRY
+            lua_getglobal(m_state, klassName);
+            if (lua_isnil(m_state, -1))
+            {
+                lua_pop(m_state, 1);
+                lua_newtable(m_state);
+            }
+#endif
+
+            SPAWNERFTYPE * spawnerPtr = (SPAWNERFTYPE*)lua_newuserdata(m_state, sizeof(SPAWNERFTYPE));
+#   ifndef LUAAA_WITHOUT_CPP_STDLIB
+            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, (std::string("faild to alloc mem to store spawner for ctor `") + name + "`").c_str());
+#   else
+            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, ("faild to alloc mem to store spawner for ctor"));
+#   endif
+            *spawnerPtr = spawner;
+
+            DELETERFTYPE * deleterPtr = (DELETERFTYPE*)lua_newuserdata(m_state, sizeof(DELETERFTYPE));
+#   ifndef LUAAA_WITHOUT_CPP_STDLIB
+            luaL_argcheck(m_state, deleterPtr != nullptr, 1, (std::string("faild to alloc mem to store deleter for ctor `") + name + "`").c_str());
+#   else
+            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, ("faild to alloc mem to store deleter for ctor"));
+#   endif
+            *deleterPtr = deleter;
+
+#if USE_NEW_MODULE_REGISTRY
+            luaL_setfuncs(m_state, constructor, 2);
+            lua_setglobal(m_state, klassName);
+#else
+            luaL_openlib(m_state, klassName, constructor, 2);
+#endif
+
+            return (*this);
+        }
+
+        template<typename ...ARGS>
+        inline LuaClass<TCLASS>& ctor(const char * name, TCLASS*(*spawner)(ARGS...), std::nullptr_t) {
+            typedef decltype(spawner) SPAWNERFTYPE;
+
+            struct HelperClass {
+                static int f_nogc(lua_State* state) {
+                    return 0;
+                }
+
+                static int f_new(lua_State* state) {
+                    LUAAA_PROFILE(state, LUAAA_PROFILE_SLOT(HelperClass, 0));
+                    void * spawner = lua_touserdata(state, lua_upvalueindex(1));
+                    luaL_argcheck(state, spawner, 1, "cpp closure spawner not found.");
+                    if (spawner) {
+                        auto obj = LuaSignature<TCLASS*, ARGS...>::call(state, 0, *(SPAWNERFTYPE*)(spawner));
+                        if (obj)
+                        {
+                            TCLASS ** objPtr = (TCLASS**)lua_newuserdata(state, sizeof(TCLASS*));
+                            if (objPtr)
+                            {
+                                *objPtr = obj;
+
+                                luaL_Reg destructor[] = {
+                                    { "__gc", HelperClass::f_nogc },
+                                    { nullptr, nullptr }
+                                };
+
+                                luaL_getmetatable(state, LuaClass<TCLASS>::klassName);
+                                luaL_setfuncs(state, destructor, 0);
+                                lua_setmetatable(state, -2);
+                                return 1;
+                            }
+                            else
+                            {
+                                DestructorCaller<TCLASS>::Invoke(obj);
+                            }
+                        }
+                        
+                    }
+                    lua_pushnil(state);
+                    return 1;
+                }
+
+            };
+
+            luaL_Reg constructor[] = { { name, HelperClass::f_new },{ nullptr, nullptr } };
+            LUAAA_PROFILE_NAME(LUAAA_PROFILE_SLOT(HelperClass, 0), klassName, name);
+
+#if USE_NEW_MODULE_REGISTRY
+            lua_getglobal(m_state, klassName);
+            if (lua_isnil(m_state, -1))
+            {
+                lua_pop(m_state, 1);
+                lua_newtable(m_state);
+            }
+#endif
+            SPAWNERFTYPE * spawnerPtr = (SPAWNERFTYPE*)lua_newuserdata(m_state, sizeof(SPAWNERFTYPE));
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, (std::string("faild to alloc mem to store spawner for ctor `") + name + "`").c_str());
+#else
+            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, "faild to alloc mem to store spawner for ctor of cpp class");
+#endif
+            *spawnerPtr = spawner;
+
+#if USE_NEW_MODULE_REGISTRY
+            luaL_setfuncs(m_state, constructor, 1);
+            lua_setglobal(m_state, klassName);
+#else
+            luaL_openlib(m_state, klassName, constructor, 1);
+#endif
+
+            return (*this);
+        }
+
+        template<typename ...F>
+        inline LuaClass<TCLASS>& ctor(const char * name, const LuaOverload<F...>& spawners) {
+            typedef LuaOverload<F...> SPAWNERFTYPE;
+            struct HelperClass {
+                static int f_gc(lua_State* state) {
+                    LUAAA_PROFILE(state, LUAAA_PROFILE_SLOT(HelperClass, 1));
+                    TCLASS ** objPtr = (TCLASS**)luaL_checkudata(state, -1, LuaClass<TCLASS>::klassName);
+                    if (objPtr)
+                    {
+                        DestructorCaller<TCLASS>::Invoke(*objPtr);
+                        LuaClass<TCLASS>::klassInstances.remove(sizeof(TCLASS));
+                    }
+                    return 0;
+                }
+
+                static int f_new(lua_State* state) {
+                    LUAAA_PROFILE(state, LUAAA_PROFILE_SLOT(HelperClass, 0));
+                    void * spawner = lua_touserdata(state, lua_upvalueindex(1));
+                    luaL_argcheck(state, spawner, 1, "cpp closure spawner not found.");
+                    if (spawner) {
+                        auto obj = SpawnerCaller<TCLASS, SPAWNERFTYPE>::Invoke(state, 0, *(SPAWNERFTYPE*)(spawner));
+                        if (obj)
+                        {
+                            TCLASS ** objPtr = (TCLASS**)lua_newuserdata(state, sizeof(TCLASS*));
+                            if (objPtr)
+                            {
+                                *objPtr = obj;
+
+                                luaL_Reg destructor[] = { { "__gc", HelperClass::f_gc }, { nullptr, nullptr } };
+                                luaL_getmetatable(state, LuaClass<TCLASS>::klassName);
+                                luaL_setfuncs(state, destructor, 0);
+                                lua_setmetatable(state, -2);
+                                LuaClass<TCLASS>::klassInstances.add(sizeof(TCLASS));
+
+                                return 1;
+                            }
+                            else
+                            {
+                                DestructorCaller<TCLASS>::Invoke(obj);
+                            }
+                        }
+                    }
+                    lua_pushnil(state);
+                    return 1;
+                }
+
+            };
+
+            luaL_Reg constructor[] = { { name, HelperClass::f_new },{ nullptr, nullptr } };
+            LUAAA_PROFILE_NAME(LUAAA_PROFILE_SLOT(HelperClass, 0), klassName, name);
+            LUAAA_PROFILE_NAME(LUAAA_PROFILE_SLOT(HelperClass, 1), klassName, "__gc");
+#if USE_NEW_MODULE_REGISTRY
+            lua_getglobal(m_state, klassName);
+            if (lua_isnil(m_state, -1))
+            {
+                lua_pop(m_state, 1);
+                lua_newtable(m_state);
+            }
+#endif
+
+            SPAWNERFTYPE * spawnerPtr = (SPAWNERFTYPE*)lua_newuserdata(m_state, sizeof(SPAWNERFTYPE));
+#   ifndef LUAAA_WITHOUT_CPP_STDLIB
+            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, (std::string("faild to alloc mem to store spawners for ctor `") + name + "`").c_str());
+#   else
+            luaL_argcheck(m_state, spawnerPtr != nullptr, 1, "faild to alloc mem to store spawners for ctor");
+#   endif
+            *spawnerPtr = spawners;
+
+#if USE_NEW_MODULE_REGISTRY
+            luaL_setfuncs(m_state, constructor, 1);
+            lua_setglobal(m_state, klassName);
+#else
+            luaL_openlib(m_state, klassName, constructor, 1);
+#endif
+
+            return (*this);
+        }
+
+       
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+        template<typename ...ARGS>
+        inline LuaClass<TCLASS>& ctor(const std::string& name)
+        {
+            return ctor<ARGS...>(name.c_str());
+        }
+
+        template<typename ...ARGS>
+        inline LuaClass<TCLASS>& ctor(const std::string& name, TCLASS*(*spawner)(ARGS...)) {
+            return ctor(name.c_str(), spawner);
+        }
+
+        template<typename TRET, typename ...ARGS>
+        inline LuaClass<TCLASS>& ctor(const std::string& name, TCLASS*(*spawner)(ARGS...), TRET(*deleter)(TCLASS*)) {
+            return ctor(name.c_str(), spawner, deleter);
+        }
+
+        template<typename ...ARGS>
+        inline LuaClass<TCLASS>& ctor(const std::string& name, TCLASS*(*spawner)(ARGS...), std::nullptr_t) {
+            return ctor(name.c_str(), spawner, nullptr);
+        }
+
+        template<typename ...F>
+        inline LuaClass<TCLASS>& ctor(const std::string& name, const LuaOverload<F...>& spawners) {
+            return ctor(name.c_str(), spawners);
+        }
+#endif
+
+		// callable convertible to lua_CFunction is bound as lua_CFunction.
+		template<typename F, typename = typename std::enable_if<!std::is_convertible<F, lua_CFunction>::value>::type>
+		inline LuaClass<TCLASS>& fun(const char * name, F f)
+		{
+			luaL_getmetatable(m_state, klassName);
+			lua_pushstring(m_state, name);
+
+			F * funPtr = CalleeStorage<F>::New(m_state, std::move(f));
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+			luaL_argcheck(m_state, funPtr != nullptr, 1, (std::string("faild to alloc mem to store function `") + name + "`").c_str());
+#else
+            luaL_argcheck(m_state, funPtr != nullptr, 1, "faild to alloc mem to store function");
+#endif
+			lua_pushcclosure(m_state, ClassFunctionCaller<TCLASS>::Get(*funPtr), 1 + LuaProfilePush(m_state, klassName, name));
+			lua_settable(m_state, -3);
+			lua_pop(m_state, 1);
+			return (*this);
+		}
+
+		inline LuaClass<TCLASS>& fun(const char * name, lua_CFunction f)
+		{
+			luaL_getmetatable(m_state, klassName);
+			lua_pushstring(m_state, name);
+			lua_pushcclosure(m_state, f, 0);
+			lua_settable(m_state, -3);
+			lua_pop(m_state, 1);
+			return (*this);
+		}
+
+		// apply binding descriptor table, see bindings().
+		template<typename SEQ, typename ...F>
+		inline LuaClass<TCLASS>& fun(const LuaBindingList<SEQ, F...>& functions)
+		{
+			luaL_getmetatable(m_state, klassName);
+			functions.template apply<ClassFunctionCaller<TCLASS>>(m_state, klassName);
+			lua_pop(m_state, 1);
+			return (*this);
+		}
+
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+		template<typename F, typename = typename std::enable_if<!std::is_convertible<F, lua_CFunction>::value>::type>
+		inline LuaClass<TCLASS>& fun(const std::string& name, F f)
+		{
+			return fun(name.c_str(), std::move(f));
+		}
+
+		inline LuaClass<TCLASS>& fun(const std::string& name, lua_CFunction f)
+		{
+			return fun(name.c_str(), f);
+		}
+#endif
+
+		// class function name(objects, args...) calls member function f on each object of array objects,
+		// in one call from lua, e.g. Cat.setAge(cats, ages), see BatchInvoker.
+		template<typename F>
+		inline LuaClass<TCLASS>& batch(const char * name, F f)
+		{
+#if USE_NEW_MODULE_REGISTRY
+            lua_getglobal(m_state, klassName);
+            if (lua_isnil(m_state, -1))
+            {
+                lua_pop(m_state, 1);
+                lua_newtable(m_state);
+            }
+#endif
+			F * funPtr = CalleeStorage<F>::New(m_state, std::move(f));
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+			luaL_argcheck(m_state, funPtr != nullptr, 1, (std::string("faild to alloc mem to store function `") + name + "`").c_str());
+#else
+            luaL_argcheck(m_state, funPtr != nullptr, 1, "faild to alloc mem to store function");
+#endif
+            luaL_Reg batcher[] = { { name, BatchCaller<TCLASS, F>::Call },{ nullptr, nullptr } };
+            const int upvalues = 1 + LuaProfilePush(m_state, klassName, name);
+#if USE_NEW_MODULE_REGISTRY
+            luaL_setfuncs(m_state, batcher, upvalues);
+            lua_setglobal(m_state, klassName);
+#else
+            luaL_openlib(m_state, klassName, batcher, upvalues);
+#endif
+			return (*this);
+		}
+
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+		template<typename F>
+		inline LuaClass<TCLASS>& batch(const std::string& name, F f)
+		{
+			return batch(name.c_str(), f);
+		}
+#endif
+
+		template <typename V>
+		inline LuaClass<TCLASS>& def(const char * name, const V& val)
+		{
+			luaL_getmetatable(m_state, klassName);
+			lua_pushstring(m_state, name);
+			LuaStack<V>::put(m_state, val);
+			lua_settable(m_state, -3);
+			lua_pop(m_state, 1);
+			return (*this);
+		}
+
+		// disable cast from "const char [#]" to "char (*)[#]"
+		inline LuaClass<TCLASS>& def(const char * name, const char * str)
+		{
+			luaL_getmetatable(m_state, klassName);
+			lua_pushstring(m_state, name);
+			LuaStack<decltype(str)>::put(m_state, str);
+			lua_settable(m_state, -3);
+			lua_pop(m_state, 1);
+			return (*this);
+		}
+
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+		template <typename V>
+		inline LuaClass<TCLASS>& def(const std::string& name, const V& val)
+		{
+			return def(name.c_str(), val);
+		}
+#endif
+
+        // instances created by owning ctors and not collected yet, of all states.
+        static LuaInstanceStats instances()
+        {
+            return klassInstances.stats();
+        }
+
+	private:
+		lua_State *	m_state;
+
+	private:
+        static char * klassName;
+        static LuaInstanceCounters klassInstances;
+	};
+
+    template <typename TCLASS> char * LuaClass<TCLASS>::klassName = nullptr;
+    template <typename TCLASS> LuaInstanceCounters LuaClass<TCLASS>::klassInstances;
+
+
+	// -----------------------------------
+	// export module
+	// -----------------------------------
+	struct LuaModule
+	{
+	public:
+
+        LuaModule(lua_State * state, const char * name = "_G")
+            : m_state(state)
+        {
+            size_t strBufLen = strlen(name) + 1;
+            m_moduleName = reinterpret_cast<char *>(lua_newuserdata(state, strBufLen));
+            memcpy(m_moduleName, name, strBufLen);
+        }
+
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+        LuaModule(lua_State * state, const std::string& name)
+            : LuaModule(state, name.empty() ? "_G" : name.c_str())
+        {}
+#endif
+
+	public:
+		// callable convertible to lua_CFunction is bound as lua_CFunction.
+		template<typename F, typename = typename std::enable_if<!std::is_convertible<F, lua_CFunction>::value>::type>
+		inline LuaModule& fun(const char * name, F f)
+		{
+			luaL_Reg regtab[] = { { name, NonMemberFunctionCaller(f) },{ nullptr, nullptr } };
+
+#if USE_NEW_MODULE_REGISTRY
+			lua_getglobal(m_state, m_moduleName);
+			if (lua_isnil(m_state, -1)) 
+			{
+				lua_pop(m_state, 1);
+				lua_newtable(m_state);
+			}
+
+			F * funPtr = CalleeStorage<F>::New(m_state, std::move(f));
+#   ifndef LUAAA_WITHOUT_CPP_STDLIB
+			luaL_argcheck(m_state, funPtr != nullptr, 1, (std::string("faild to alloc mem to store function `") + name + "`").c_str());
+#   else
+            luaL_argcheck(m_state, funPtr != nullptr, 1, "faild to alloc mem to store function of module");
+#   endif
+
+			luaL_setfuncs(m_state, regtab, 1 + LuaProfilePush(m_state, m_moduleName, name));
+			lua_setglobal(m_state, m_moduleName);
+#else
+			F * funPtr = CalleeStorage<F>::New(m_state, std::move(f));
+#   ifndef LUAAA_WITHOUT_CPP_STDLIB
+			luaL_argcheck(m_state, funPtr != nullptr, 1, (std::string("faild to alloc mem to store function `") + name + "`").c_str());
+#   else
+            luaL_argcheck(m_state, funPtr != nullptr, 1, "faild to alloc mem to store function of module");
+#   endif
+
+			luaL_openlib(m_state, m_moduleName, regtab, 1 + LuaProfilePush(m_state, m_moduleName, name));
+#endif
+
+			return (*this);
+		}
+
+		inline LuaModule& fun(const char * name, lua_CFunction f)
+		{
+			luaL_Reg regtab[] = { { name, f },{ nullptr, nullptr } };
+#if USE_NEW_MODULE_REGISTRY
+			lua_getglobal(m_state, m_moduleName);
+			if (lua_isnil(m_state, -1))
+			{
+				lua_pop(m_state, 1);
+				lua_newtable(m_state);
+			}
+			luaL_setfuncs(m_state, regtab, 0);
+			lua_setglobal(m_state, m_moduleName);
+#else
+			luaL_openlib(m_state, m_moduleName, regtab, 0);
+#endif
+			return (*this);
+		}
+
+		// apply binding descriptor table, see bindings(). new module table is presized.
+		template<typename SEQ, typename ...F>
+		inline LuaModule& fun(const LuaBindingList<SEQ, F...>& functions)
+		{
+#if USE_NEW_MODULE_REGISTRY
+			lua_getglobal(m_state, m_moduleName);
+			if (lua_isnil(m_state, -1))
+			{
+				lua_pop(m_state, 1);
+				lua_createtable(m_state, 0, int(LuaBindingList<SEQ, F...>::size));
+			}
+			functions.template apply<ModuleFunctionCaller>(m_state, m_moduleName);
+			lua_setglobal(m_state, m_moduleName);
+#else
+			luaL_Reg regtab = { nullptr, nullptr };
+			luaL_openlib(m_state, m_moduleName, &regtab, 0);
+			functions.template apply<ModuleFunctionCaller>(m_state, m_moduleName);
+			lua_pop(m_state, 1);
+#endif
+			return (*this);
+		}
+
+		template <typename V>
+		inline LuaModule& def(const char * name, const V& val)
+		{
+#if USE_NEW_MODULE_REGISTRY
+			lua_getglobal(m_state, m_moduleName);
+			if (lua_isnil(m_state, -1))
+			{
+				lua_pop(m_state, 1);
+				lua_newtable(m_state);
+			}
+			LuaStack<V>::put(m_state, val);
+			lua_setfield(m_state, -2, name);
+			lua_setglobal(m_state, m_moduleName);
+#else
+			luaL_Reg regtab = { nullptr, nullptr };
+			luaL_openlib(m_state, m_moduleName, &regtab, 0);
+			LuaStack<V>::put(m_state, val);
+			lua_setfield(m_state, -2, name);
+#endif
+			return (*this);
+		}
+
+        template <typename V>
+        inline LuaModule& def(const char * name, const V val[], size_t length)
+        {
+#if USE_NEW_MODULE_REGISTRY
+            lua_getglobal(m_state, m_moduleName);
+            if (lua_isnil(m_state, -1))
+            {
+                lua_pop(m_state, 1);
+                lua_newtable(m_state);
+            }
+            lua_newtable(m_state);
+            for (size_t idx = 0; idx < length; ++idx)
+            {
+                LuaStack<V>::put(m_state, val[idx]);
+                lua_rawseti(m_state, -2, idx + 1);
+            }
+            lua_setfield(m_state, -2, name);
+            lua_setglobal(m_state, m_moduleName);
+#else
+            luaL_Reg regtab = { nullptr, nullptr };
+            luaL_openlib(m_state, m_moduleName, &regtab, 0);
+            lua_newtable(m_state);
+            for (size_t idx = 0; idx < length; ++idx)
+            {
+                LuaStack<V>::put(m_state, val[idx]);
+                lua_rawseti(m_state, -2, idx + 1);
+            }
+            lua_setfield(m_state, -2, name);
+#endif
+            return (*this);
+        }
+
+		// disable the cast from "const char [#]" to "char (*)[#]"
+		inline LuaModule& def(const char * name, const char * str)
+		{
+			
+#if USE_NEW_MODULE_REGISTRY
+			lua_getglobal(m_state, m_moduleName);
+			if (lua_isnil(m_state, -1))
+			{
+				lua_pop(m_state, 1);
+				lua_newtable(m_state);
+			}
+			LuaStack<decltype(str)>::put(m_state, str);
+			lua_setfield(m_state, -2, name);
+			lua_setglobal(m_state, m_moduleName);
+#else
+			luaL_Reg regtab = { nullptr, nullptr };
+			luaL_openlib(m_state, m_moduleName, &regtab, 0);
+			LuaStack<decltype(str)>::put(m_state, str);
+			lua_setfield(m_state, -2, name);
+#endif
+			return (*this);
+		}
+
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+		template <typename V>
+		inline LuaModule& def(const std::string& name, const V& val)
+		{
+			return def(name.c_str(), val);
+		}
+#endif
+
+	private:
+		lua_State *	m_state;
+        char * m_moduleName;
+	};
+
+	// -----------------------------------
+	// lazy binding
+	// -----------------------------------
+    inline void * LuaLazyKey()
+    {
+        static char key = 0;
+        return &key;
+    }
+
+    inline int LuaLazyIndex(lua_State * state);
+
+    // once no binder is left, give globals table back its previous __index, missing globals cost nothing again.
+    inline void LuaLazyUnhook(lua_State * state)
+    {
+        const int top = lua_gettop(state);
+        lua_pushlightuserdata(state, LuaLazyKey());
+        lua_rawget(state, LUA_REGISTRYINDEX);
+        lua_pushnil(state);
+        if (lua_istable(state, -2) && lua_next(state, -2) == 0)
+        {
+            lua_pushlightuserdata(state, LuaLazyKey());
+            lua_pushnil(state);
+            lua_rawset(state, LUA_REGISTRYINDEX);
+
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+            lua_pushglobaltable(state);
+#else
+            lua_pushvalue(state, LUA_GLOBALSINDEX);
+#endif
+            if (lua_getmetatable(state, -1))
+            {
+                lua_getfield(state, -1, "__index");
+                if (lua_tocfunction(state, -1) == LuaLazyIndex)
+                {
+                    lua_getupvalue(state, -1, 1);
+                    lua_setfield(state, -3, "__index");
+                }
+            }
+        }
+        lua_settop(state, top);
+    }
+
+    // run binder of global name at nameIdx if it is still lazy, binder runs at most once.
+    // return true while the binder of name is running, its global is not defined yet.
+    inline bool LuaLazyMaterialize(lua_State * state, int nameIdx)
+    {
+        bool binding = false;
+        lua_pushlightuserdata(state, LuaLazyKey());
+        lua_rawget(state, LUA_REGISTRYINDEX);
+        if (lua_istable(state, -1))
+        {
+            lua_pushvalue(state, nameIdx);
+            lua_rawget(state, -2);
+            if (lua_isfunction(state, -1))
+            {
+                lua_pushvalue(state, nameIdx);
+                lua_pushboolean(state, 1);
+                lua_rawset(state, -4);
+                int status = lua_pcall(state, 0, 0, 0);
+                lua_pushvalue(state, nameIdx);
+                lua_pushnil(state);
+                lua_rawset(state, status ? -4 : -3);
+                if (status)
+                {
+                    lua_error(state);
+                }
+                LuaLazyUnhook(state);
+            }
+            else
+            {
+                binding = lua_isboolean(state, -1) != 0;
+                lua_pop(state, 1);
+            }
+        }
+        lua_pop(state, 1);
+        return binding;
+    }
+
+    // __index of globals table until all binders ran, upvalue 1 is the previous __index.
+    inline int LuaLazyIndex(lua_State * state)
+    {
+        lua_settop(state, 2);
+        if (LuaLazyMaterialize(state, 2))
+        {
+            // binder looks up the global it defines, e.g. LuaModule.
+            lua_pushnil(state);
+            return 1;
+        }
+        lua_pushvalue(state, 2);
+        lua_rawget(state, 1);
+        if (!lua_isnil(state, -1))
+        {
+            return 1;
+        }
+        lua_pop(state, 1);
+
+        if (lua_isfunction(state, lua_upvalueindex(1)))
+        {
+            lua_pushvalue(state, lua_upvalueindex(1));
+            lua_pushvalue(state, 1);
+            lua_pushvalue(state, 2);
+            lua_call(state, 2, 1);
+            return 1;
+        }
+        if (lua_istable(state, lua_upvalueindex(1)))
+        {
+            lua_pushvalue(state, 2);
+            lua_gettable(state, lua_upvalueindex(1));
+            return 1;
+        }
+        lua_pushnil(state);
+        return 1;
+    }
+
+    // package.preload loader, require(name) returns the global.
+    inline int LuaLazyPreload(lua_State * state)
+    {
+        LuaLazyMaterialize(state, 1);
+        lua_getglobal(state, lua_tostring(state, 1));
+        return 1;
+    }
+
+    // register binder which defines global name, e.g. LuaClass or LuaModule bindings.
+    // binder runs on first access of the global, or on require(name), e.g.
+    //     lazy(L, "Cat", [](lua_State * L) { LuaClass<Cat>(L, "Cat").ctor().fun("eat", &Cat::eat); });
+    template<typename F>
+    inline void lazy(lua_State * state, const char * name, F binder)
+    {
+        lua_pushlightuserdata(state, LuaLazyKey());
+        lua_rawget(state, LUA_REGISTRYINDEX);
+        if (lua_isnil(state, -1))
+        {
+            lua_pop(state, 1);
+            lua_newtable(state);
+            lua_pushlightuserdata(state, LuaLazyKey());
+            lua_pushvalue(state, -2);
+            lua_rawset(state, LUA_REGISTRYINDEX);
+
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+            lua_pushglobaltable(state);
+#else
+            lua_pushvalue(state, LUA_GLOBALSINDEX);
+#endif
+            if (!lua_getmetatable(state, -1))
+            {
+                lua_newtable(state);
+            }
+            lua_getfield(state, -1, "__index");
+            lua_pushcclosure(state, LuaLazyIndex, 1);
+            lua_setfield(state, -2, "__index");
+            lua_setmetatable(state, -2);
+            lua_pop(state, 1);
+        }
+
+        F * funPtr = CalleeStorage<F>::New(state, std::move(binder));
+        luaL_argcheck(state, funPtr != nullptr, 1, "faild to alloc mem to store lazy binder");
+        lua_pushcclosure(state, NonMemberFunctionCaller(*funPtr), 1);
+        lua_setfield(state, -2, name);
+        lua_pop(state, 1);
+
+        lua_getglobal(state, "package");
+        if (lua_istable(state, -1))
+        {
+            lua_getfield(state, -1, "preload");
+            if (lua_istable(state, -1))
+            {
+                lua_pushcfunction(state, LuaLazyPreload);
+                lua_setfield(state, -2, name);
+            }
+            lua_pop(state, 1);
+        }
+        lua_pop(state, 1);
+    }
+
+
+	// -----------------------------------
+	// state allocators
+	// -----------------------------------
+	struct LuaAllocStats
+	{
+		size_t used;			// bytes in use, as requested by lua
+		size_t peak;
+		size_t limit;			// 0 means no limit
+		size_t allocations;		// successful allocations and reallocations
+		size_t allocated;		// total bytes handed out, growth of reallocations included
+		size_t failures;		// refused by limit or out of memory
+	};
+
+	// lua_Alloc with a hard budget and statistics, subclasses provide the memory.
+	// one allocator serves one state, it must outlive the state.
+	class StateAllocator
+	{
+	public:
+		StateAllocator() : m_stats() {}
+		virtual ~StateAllocator() {}
+
+		// like luaL_newstate, but allocates from this.
+		lua_State * newState()
+		{
+			lua_State * state = lua_newstate(Alloc, this);
+			if (state)
+			{
+				lua_atpanic(state, Panic);
+			}
+			return state;
+		}
+
+		// allocations over budget fail, lua raises a memory error.
+		void setLimit(size_t bytes)
+		{
+			m_stats.limit = bytes;
+		}
+
+		const LuaAllocStats& stats() const
+		{
+			return m_stats;
+		}
+
+		static void * Alloc(void * ud, void * ptr, size_t osize, size_t nsize)
+		{
+			StateAllocator * self = static_cast<StateAllocator*>(ud);
+			LuaAllocStats& stats = self->m_stats;
+			if (ptr == nullptr)
+			{
+				// since lua 5.2 osize is the object type for new blocks.
+				osize = 0;
+			}
+			if (nsize == 0)
+			{
+				if (ptr)
+				{
+					self->deallocate(ptr, osize);
+					stats.used -= osize;
+				}
+				return nullptr;
+			}
+			if (nsize > osize && stats.limit && stats.used - osize + nsize > stats.limit)
+			{
+				++stats.failures;
+				return nullptr;
+			}
+
+			void * block = ptr ? self->reallocate(ptr, osize, nsize) : self->allocate(nsize);
+			if (block == nullptr)
+			{
+				++stats.failures;
+				// lua assumes shrinking never fails.
+				return nsize <= osize ? ptr : nullptr;
+			}
+			if (nsize > osize)
+			{
+				stats.allocated += nsize - osize;
+			}
+			stats.used = stats.used - osize + nsize;
+			if (stats.used > stats.peak)
+			{
+				stats.peak = stats.used;
+			}
+			++stats.allocations;
+			return block;
+		}
+
+	protected:
+		virtual void * allocate(size_t size) = 0;
+		virtual void deallocate(void * ptr, size_t size) = 0;
+
+		// grow or shrink keeping content, by default moves to a new block.
+		virtual void * reallocate(void * ptr, size_t osize, size_t nsize)
+		{
+			void * block = allocate(nsize);
+			if (block)
+			{
+				memcpy(block, ptr, osize < nsize ? osize : nsize);
+				deallocate(ptr, osize);
+			}
+			return block;
+		}
+
+	private:
+		static int Panic(lua_State * state)
+		{
+			fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(state, -1));
+			return 0;
+		}
+
+	private:
+		LuaAllocStats m_stats;
+	};
+
+#if LUAAA_WITH_PROFILER
+    inline void LuaAllocCounters(lua_State * state, unsigned long long& allocations, unsigned long long& bytes)
+    {
+        void * ud = nullptr;
+        if (lua_getallocf(state, &ud) == StateAllocator::Alloc)
+        {
+            const LuaAllocStats& stats = static_cast<StateAllocator*>(ud)->stats();
+            allocations = stats.allocations;
+            bytes = stats.allocated;
+        }
+        else
+        {
+            allocations = 0;
+            bytes = (unsigned long long)lua_gc(state, LUA_GCCOUNT, 0) * 1024 + (unsigned long long)lua_gc(state, LUA_GCCOUNTB, 0);
+        }
+    }
+#endif
+
+	// malloc with budget and statistics.
+	class HeapAllocator : public StateAllocator
+	{
+	protected:
+		void * allocate(size_t size) override
+		{
+			return malloc(size);
+		}
+
+		void deallocate(void * ptr, size_t) override
+		{
+			free(ptr);
+		}
+
+		void * reallocate(void * ptr, size_t, size_t nsize) override
+		{
+			return realloc(ptr, nsize);
+		}
+	};
+
+	// small blocks come from per size class free lists carved out of 64K chunks, larger ones from malloc.
+	// chunks are kept until the allocator is destroyed, freed blocks are reused by the same size class.
+	class PoolAllocator : public StateAllocator
+	{
+	public:
+		enum { Granularity = 16, MaxPooled = 512, ClassCount = MaxPooled / Granularity, ChunkSize = 64 * 1024 };
+
+		PoolAllocator() : m_chunks(nullptr), m_cursor(nullptr), m_end(nullptr), m_reserved(0)
+		{
+			for (int i = 0; i < ClassCount; ++i)
+			{
+				m_free[i] = nullptr;
+			}
+		}
+
+		~PoolAllocator()
+		{
+			while (m_chunks)
+			{
+				FreeBlock * next = m_chunks->next;
+				free(m_chunks);
+				m_chunks = next;
+			}
+		}
+
+		// bytes held in chunks.
+		size_t reserved() const
+		{
+			return m_reserved;
+		}
+
+	protected:
+		void * allocate(size_t size) override
+		{
+			if (size > MaxPooled)
+			{
+				return malloc(size);
+			}
+			int index = ClassOf(size);
+			FreeBlock * block = m_free[index];
+			if (block)
+			{
+				m_free[index] = block->next;
+				return block;
+			}
+
+			size_t bytes = size_t(index + 1) * Granularity;
+			if (size_t(m_end - m_cursor) < bytes && !grow())
+			{
+				return nullptr;
+			}
+			void * carved = m_cursor;
+			m_cursor += bytes;
+			return carved;
+		}
+
+		void deallocate(void * ptr, size_t size) override
+		{
+			if (size > MaxPooled)
+			{
+				free(ptr);
+				return;
+			}
+			release(ptr, ClassOf(size));
+		}
+
+		void * reallocate(void * ptr, size_t osize, size_t nsize) override
+		{
+			if (osize > MaxPooled && nsize > MaxPooled)
+			{
+				return realloc(ptr, nsize);
+			}
+			if (osize <= MaxPooled && nsize <= MaxPooled && ClassOf(osize) == ClassOf(nsize))
+			{
+				return ptr;
+			}
+			return StateAllocator::reallocate(ptr, osize, nsize);
+		}
+
+	private:
+		struct FreeBlock
+		{
+			FreeBlock * next;
+		};
+
+		static int ClassOf(size_t size)
+		{
+			return int((size - 1) / Granularity);
+		}
+
+		void release(void * ptr, int index)
+		{
+			FreeBlock * block = static_cast<FreeBlock*>(ptr);
+			block->next = m_free[index];
+			m_free[index] = block;
+		}
+
+		// new chunk, first granule links chunks, the rest of current chunk goes to a free list.
+		bool grow()
+		{
+			char * chunk = static_cast<char*>(malloc(ChunkSize));
+			if (chunk == nullptr)
+			{
+				return false;
+			}
+			size_t rest = size_t(m_end - m_cursor);
+			if (rest >= Granularity)
+			{
+				release(m_cursor, int(rest / Granularity) - 1);
+			}
+			reinterpret_cast<FreeBlock*>(chunk)->next = m_chunks;
+			m_chunks = reinterpret_cast<FreeBlock*>(chunk);
+			m_cursor = chunk + Granularity;
+			m_end = chunk + ChunkSize;
+			m_reserved += ChunkSize;
+			return true;
+		}
+
+	private:
+		FreeBlock * m_free[ClassCount];
+		FreeBlock * m_chunks;
+		char * m_cursor;
+		char * m_end;
+		size_t m_reserved;
+	};
+
+	// two-level segregated fit allocator on a fixed buffer, O(1) allocate and free with immediate coalescing.
+	// needs no heap, for LUAAA_WITHOUT_CPP_STDLIB builds. blocks are limited to 1G.
+	class TlsfAllocator : public StateAllocator
+	{
+	public:
+		TlsfAllocator(void * buffer, size_t size) : m_flMap(0), m_capacity(0)
+		{
+			for (int i = 0; i < FlCount; ++i)
+			{
+				m_slMap[i] = 0;
+				for (int j = 0; j < SlCount; ++j)
+				{
+					m_heads[i][j] = nullptr;
+				}
+			}
+
+			char * begin = reinterpret_cast<char*>(AlignUp(reinterpret_cast<size_t>(buffer)));
+			char * end = static_cast<char*>(buffer) + size;
+			if (end <= begin || size_t(end - begin) < 2 * Header + MinPayload)
+			{
+				return;
+			}
+			size_t payload = (size_t(end - begin) - 2 * Header) & ~size_t(Align - 1);
+			if (payload >= MaxBlock)
+			{
+				payload = MaxBlock - Align;
+			}
+
+			Block * block = reinterpret_cast<Block*>(begin);
+			block->prevPhys = nullptr;
+			block->size = payload | FreeBit;
+			Block * sentinel = Next(block);
+			sentinel->prevPhys = block;
+			sentinel->size = PrevFreeBit;
+			insert(block);
+			m_capacity = payload;
+		}
+
+		// usable bytes of the buffer.
+		size_t capacity() const
+		{
+			return m_capacity;
+		}
+
+	protected:
+		void * allocate(size_t size) override
+		{
+			size_t bytes = AlignUp(size < MinPayload ? size_t(MinPayload) : size);
+			if (bytes >= MaxBlock)
+			{
+				return nullptr;
+			}
+			// round up to the next list, every block there fits.
+			size_t search = bytes;
+			if (search >= SmallBlock)
+			{
+				search += (size_t(1) << (Fls(search) - SlLog2)) - 1;
+			}
+			int fl, sl;
+			Mapping(search, fl, sl);
+			Block * block = fl < FlCount ? find(fl, sl) : nullptr;
+			if (block == nullptr)
+			{
+				// nearly full buffer, head of the exact list may still fit.
+				Mapping(bytes, fl, sl);
+				block = m_heads[fl][sl];
+				if (block == nullptr || SizeOf(block) < bytes)
+				{
+					return nullptr;
+				}
+			}
+			remove(block, fl, sl);
+			use(block, bytes);
+			return Payload(block);
+		}
+
+		void deallocate(void * ptr, size_t) override
+		{
+			Block * block = FromPayload(ptr);
+			block->size |= FreeBit;
+			if (block->size & PrevFreeBit)
+			{
+				Block * prev = block->prevPhys;
+				remove(prev);
+				prev->size += Header + SizeOf(block);
+				block = prev;
+			}
+			Block * next = Next(block);
+			if (next->size & FreeBit)
+			{
+				remove(next);
+				block->size += Header + SizeOf(next);
+				next = Next(block);
+			}
+			next->prevPhys = block;
+			next->size |= PrevFreeBit;
+			insert(block);
+		}
+
+		void * reallocate(void * ptr, size_t osize, size_t nsize) override
+		{
+			Block * block = FromPayload(ptr);
+			size_t bytes = AlignUp(nsize < MinPayload ? size_t(MinPayload) : nsize);
+			if (bytes <= SizeOf(block))
+			{
+				return ptr;
+			}
+			// grow into free neighbour.
+			Block * next = Next(block);
+			if ((next->size & FreeBit) && SizeOf(block) + Header + SizeOf(next) >= bytes)
+			{
+				remove(next);
+				block->size += Header + SizeOf(next);
+				Next(block)->prevPhys = block;
+				use(block, bytes);
+				return ptr;
+			}
+			return StateAllocator::reallocate(ptr, osize, nsize);
+		}
+
+	private:
+		struct Block
+		{
+			Block * prevPhys;	// physically previous block
+			size_t size;		// payload bytes, low bits are flags
+			Block * nextFree;	// free list links, overlap payload
+			Block * prevFree;
+		};
+
+		enum
+		{
+			Align = 2 * sizeof(void*),
+			Header = sizeof(Block*) + sizeof(size_t),
+			MinPayload = 2 * sizeof(Block*),
+			FreeBit = 1,
+			PrevFreeBit = 2,
+			SlLog2 = 4,
+			SlCount = 1 << SlLog2,
+			FlShift = SlLog2 + (sizeof(void*) == 8 ? 4 : 3),
+			SmallBlock = 1 << FlShift,
+			FlMax = 30,
+			FlCount = FlMax - FlShift + 1,
+		};
+		static_assert(int(Header) == int(Align), "tlsf block header must keep payload aligned");
+
+		static const size_t MaxBlock = size_t(1) << FlMax;
+
+		static size_t AlignUp(size_t size)
+		{
+			return (size + Align - 1) & ~size_t(Align - 1);
+		}
+
+		static size_t SizeOf(const Block * block)
+		{
+			return block->size & ~size_t(FreeBit | PrevFreeBit);
+		}
+
+		static Block * Next(Block * block)
+		{
+			return reinterpret_cast<Block*>(reinterpret_cast<char*>(block) + Header + SizeOf(block));
+		}
+
+		static void * Payload(Block * block)
+		{
+			return reinterpret_cast<char*>(block) + Header;
+		}
+
+		static Block * FromPayload(void * ptr)
+		{
+			return reinterpret_cast<Block*>(static_cast<char*>(ptr) - Header);
+		}
+
+		static int Ffs(unsigned int bits)
+		{
+#if defined(__GNUC__) || defined(__clang__)
+			return __builtin_ctz(bits);
+#else
+			int index = 0;
+			while (!(bits & 1u))
+			{
+				bits >>= 1;
+				++index;
+			}
+			return index;
+#endif
+		}
+
+		static int Fls(size_t size)
+		{
+#if defined(__GNUC__) || defined(__clang__)
+			return int(sizeof(unsigned long long) * 8 - 1) - __builtin_clzll(size);
+#else
+			int index = -1;
+			while (size)
+			{
+				size >>= 1;
+				++index;
+			}
+			return index;
+#endif
+		}
+
+		static void Mapping(size_t size, int& fl, int& sl)
+		{
+			if (size < SmallBlock)
+			{
+				fl = 0;
+				sl = int(size / (SmallBlock / SlCount));
+			}
+			else
+			{
+				int bit = Fls(size);
+				sl = int(size >> (bit - SlLog2)) ^ SlCount;
+				fl = bit - FlShift + 1;
+			}
+		}
+
+		Block * find(int& fl, int& sl) const
+		{
+			unsigned int slMap = m_slMap[fl] & (~0u << sl);
+			if (slMap == 0)
+			{
+				unsigned int flMap = m_flMap & (~0u << (fl + 1));
+				if (flMap == 0)
+				{
+					return nullptr;
+				}
+				fl = Ffs(flMap);
+				slMap = m_slMap[fl];
+			}
+			sl = Ffs(slMap);
+			return m_heads[fl][sl];
+		}
+
+		void insert(Block * block)
+		{
+			int fl, sl;
+			Mapping(SizeOf(block), fl, sl);
+			Block * head = m_heads[fl][sl];
+			block->prevFree = nullptr;
+			block->nextFree = head;
+			if (head)
+			{
+				head->prevFree = block;
+			}
+			m_heads[fl][sl] = block;
+			m_slMap[fl] |= 1u << sl;
+			m_flMap |= 1u << fl;
+		}
+
+		void remove(Block * block)
+		{
+			int fl, sl;
+			Mapping(SizeOf(block), fl, sl);
+			remove(block, fl, sl);
+		}
+
+		void remove(Block * block, int fl, int sl)
+		{
+			if (block->nextFree)
+			{
+				block->nextFree->prevFree = block->prevFree;
+			}
+			if (block->prevFree)
+			{
+				block->prevFree->nextFree = block->nextFree;
+			}
+			else
+			{
+				m_heads[fl][sl] = block->nextFree;
+				if (m_heads[fl][sl] == nullptr)
+				{
+					m_slMap[fl] &= ~(1u << sl);
+					if (m_slMap[fl] == 0)
+					{
+						m_flMap &= ~(1u << fl);
+					}
+				}
+			}
+		}
+
+		// mark block used, split the tail off as a free block if big enough.
+		void use(Block * block, size_t bytes)
+		{
+			size_t size = SizeOf(block);
+			if (size >= bytes + Header + MinPayload)
+			{
+				Block * rest = reinterpret_cast<Block*>(reinterpret_cast<char*>(block) + Header + bytes);
+				rest->prevPhys = block;
+				rest->size = (size - bytes - Header) | FreeBit;
+				block->size = bytes | (block->size & PrevFreeBit);
+				Block * next = Next(rest);
+				next->prevPhys = rest;
+				next->size |= PrevFreeBit;
+				insert(rest);
+			}
+			else
+			{
+				block->size &= ~size_t(FreeBit);
+				Next(block)->size &= ~size_t(PrevFreeBit);
+			}
+		}
+
+	private:
+		unsigned int m_flMap;
+		unsigned int m_slMap[FlCount];
+		Block * m_heads[FlCount][SlCount];
+		size_t m_capacity;
+	};
+
+
+	// -----------------------------------
+	// coroutine scheduler
+	// -----------------------------------
+	// runs script tasks as coroutines, exports to lua module:
+	//   sleep(ms)        suspend current task for ms milliseconds.
+	//   wait(event)      suspend current task until event is signaled.
+	//   signal(event)    wake all tasks waiting for event, return count of tasks woken.
+	//   yield()          suspend current task until next tick.
+	//   spawn(f, ...)    run f(...) as a new task from next tick.
+	// host drives it by tick(nowMs), timers are kept in a hierarchical timer wheel,
+	// insertion is O(1) and nothing is allocated while ticking.
+	// scheduler must outlive any call of its lua module.
+	class Scheduler
+	{
+	public:
+		typedef void(*ErrorHandler)(lua_State * thread, const char * message);
+
+		Scheduler(lua_State * state, const char * moduleName = "task")
+			: m_state(state), m_now(0), m_timers(0), m_tasks(0), m_onError(nullptr)
+		{
+			for (int level = 0; level < WHEEL_LEVELS; ++level)
+			{
+				for (int slot = 0; slot < WHEEL_SLOTS; ++slot)
+				{
+					m_wheel[level][slot].reset();
+				}
+			}
+			for (int bucket = 0; bucket < EVENT_BUCKETS; ++bucket)
+			{
+				m_events[bucket].reset();
+			}
+			m_ready.reset();
+
+			// thread => task, also keeps threads of tasks alive.
+			lua_newtable(state);
+			m_tasksRef = luaL_ref(state, LUA_REGISTRYINDEX);
+
+			LuaModule(state, moduleName)
+				.fun("signal", [this](int event) { return signal(event); })
+				.fun("spawn", [this](lua_State * L) { return spawn(L, lua_gettop(L) - 1); });
+
+			// suspending functions yield by themselves, the scheduler is their upvalue.
+			const luaL_Reg suspends[] = { { "sleep", Sleep }, { "wait", Wait }, { "yield", Yield } };
+			lua_getglobal(state, moduleName);
+			for (size_t i = 0; i < sizeof(suspends) / sizeof(suspends[0]); ++i)
+			{
+				lua_pushlightuserdata(state, this);
+				lua_pushcclosure(state, suspends[i].func, 1);
+				lua_setfield(state, -2, suspends[i].name);
+			}
+			lua_pop(state, 1);
+		}
+
+		~Scheduler()
+		{
+			lua_rawgeti(m_state, LUA_REGISTRYINDEX, m_tasksRef);
+			lua_pushnil(m_state);
+			while (lua_next(m_state, -2))
+			{
+				delete (Task*)lua_touserdata(m_state, -1);
+				lua_pop(m_state, 1);
+			}
+			lua_pop(m_state, 1);
+			luaL_unref(m_state, LUA_REGISTRYINDEX, m_tasksRef);
+		}
+
+		// function and nargs arguments on top of state stack are popped and run as a new task from next tick.
+		bool spawn(int nargs = 0)
+		{
+			return spawn(m_state, nargs);
+		}
+
+		// advance time to nowMs, then resume due tasks and tasks woken since last tick.
+		void tick(unsigned int nowMs)
+		{
+			TaskLink due;
+			due.reset();
+			due.splice(m_ready);
+
+			if (m_timers == 0)
+			{
+				m_now = nowMs;
+			}
+			while (int(nowMs - m_now) > 0)
+			{
+				++m_now;
+				int level = 0;
+				while (level + 1 < WHEEL_LEVELS && (m_now & ((1u << (WHEEL_BITS * (level + 1))) - 1)) == 0)
+				{
+					++level;
+				}
+				for (; level > 0; --level)
+				{
+					cascade(m_wheel[level][(m_now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+				}
+				TaskLink & slot = m_wheel[0][m_now & (WHEEL_SLOTS - 1)];
+				for (TaskLink * link = slot.next; link != &slot; link = link->next)
+				{
+					static_cast<Task*>(link)->timed = false;
+					--m_timers;
+				}
+				due.splice(slot);
+			}
+			// timers cascaded to current time.
+			due.splice(m_ready);
+
+			while (due.next != &due)
+			{
+				Task * task = static_cast<Task*>(due.next);
+				task->unlink();
+				run(task);
+			}
+		}
+
+		// resume a task suspended by pending call of other bindings, nargs values on top of thread stack are passed to it.
+		// thread which is not a task is resumed as is. return status of lua_resume.
+		int resume(lua_State * thread, int nargs)
+		{
+			lua_rawgeti(m_state, LUA_REGISTRYINDEX, m_tasksRef);
+			lua_pushthread(thread);
+			lua_xmove(thread, m_state, 1);
+			lua_rawget(m_state, -2);
+			Task * task = (Task*)lua_touserdata(m_state, -1);
+			lua_pop(m_state, 2);
+
+			int status = LuaResume(thread, m_state, nargs);
+			if (task)
+			{
+				settle(task, status);
+			}
+			return status;
+		}
+
+		void setErrorHandler(ErrorHandler handler)
+		{
+			m_onError = handler;
+		}
+
+		// current time of scheduler, in milliseconds.
+		unsigned int now() const
+		{
+			return m_now;
+		}
+
+		// count of live tasks.
+		int size() const
+		{
+			return m_tasks;
+		}
+
+		// wake all tasks waiting for event, they are resumed at next tick.
+		int signal(int event)
+		{
+			int count = 0;
+			TaskLink & bucket = m_events[(unsigned int)event & (EVENT_BUCKETS - 1)];
+			for (TaskLink * link = bucket.next; link != &bucket;)
+			{
+				Task * task = static_cast<Task*>(link);
+				link = link->next;
+				if (task->event == event)
+				{
+					task->unlink();
+					m_ready.append(task);
+					++count;
+				}
+			}
+			return count;
+		}
+
+	private:
+		enum
+		{
+			WHEEL_BITS = 6,
+			WHEEL_SLOTS = 1 << WHEEL_BITS,
+			WHEEL_LEVELS = 4,
+			EVENT_BUCKETS = 32,
+		};
+
+		// suspension requested by a task, applied only after it really yielded to the scheduler.
+		enum Request
+		{
+			REQUEST_NONE,
+			REQUEST_SLEEP,
+			REQUEST_WAIT,
+			REQUEST_YIELD,
+		};
+
+		struct TaskLink
+		{
+			TaskLink * prev;
+			TaskLink * next;
+
+			inline void reset()
+			{
+				prev = next = this;
+			}
+
+			inline void unlink()
+			{
+				prev->next = next;
+				next->prev = prev;
+				reset();
+			}
+
+			inline void append(TaskLink * link)
+			{
+				link->prev = prev;
+				link->next = this;
+				prev->next = link;
+				prev = link;
+			}
+
+			// move all links of other to the end of this list.
+			inline void splice(TaskLink & other)
+			{
+				if (other.next != &other)
+				{
+					other.next->prev = prev;
+					other.prev->next = this;
+					prev->next = other.next;
+					prev = other.prev;
+					other.reset();
+				}
+			}
+		};
+
+		struct Task : public TaskLink
+		{
+			lua_State * thread;
+			unsigned int expire;
+			int event;
+			int nargs;
+			int request;
+			bool started;
+			bool timed;
+		};
+
+		Task * current(lua_State * L)
+		{
+			lua_rawgeti(L, LUA_REGISTRYINDEX, m_tasksRef);
+			lua_pushthread(L);
+			lua_rawget(L, -2);
+			Task * task = (Task*)lua_touserdata(L, -1);
+			lua_pop(L, 2);
+			if (task == nullptr)
+			{
+				luaL_error(L, "not called from a task of scheduler.");
+			}
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 503
+			if (!lua_isyieldable(L))
+			{
+				luaL_error(L, "task cannot be suspended here.");
+			}
+#endif
+			return task;
+		}
+
+		// lua 5.1 and 5.2 cannot tell whether the yield would fail, e.g. under pcall or a metamethod.
+		// the request is only recorded, settle links the task once it yielded with the scheduler as tag.
+		static int Sleep(lua_State * L)
+		{
+			Scheduler * self = (Scheduler*)lua_touserdata(L, lua_upvalueindex(1));
+			const lua_Integer ms = luaL_checkinteger(L, 1);
+			Task * task = self->current(L);
+			task->expire = self->m_now + (unsigned int)(ms > 0 ? ms : 0);
+			task->request = REQUEST_SLEEP;
+			return LuaYieldPending(L, self);
+		}
+
+		static int Wait(lua_State * L)
+		{
+			Scheduler * self = (Scheduler*)lua_touserdata(L, lua_upvalueindex(1));
+			const int event = (int)luaL_checkinteger(L, 1);
+			Task * task = self->current(L);
+			task->event = event;
+			task->request = REQUEST_WAIT;
+			return LuaYieldPending(L, self);
+		}
+
+		static int Yield(lua_State * L)
+		{
+			Scheduler * self = (Scheduler*)lua_touserdata(L, lua_upvalueindex(1));
+			self->current(L)->request = REQUEST_YIELD;
+			return LuaYieldPending(L, self);
+		}
+
+		bool spawn(lua_State * L, int nargs)
+		{
+			if (nargs < 0 || lua_type(L, -(nargs + 1)) != LUA_TFUNCTION)
+			{
+				luaL_error(L, "function expected to spawn task.");
+				return false;
+			}
+
+			Task * task = new Task();
+			task->reset();
+			task->expire = 0;
+			task->event = 0;
+			task->nargs = nargs;
+			task->request = REQUEST_NONE;
+			task->started = false;
+			task->timed = false;
+
+			task->thread = lua_newthread(L);
+			lua_insert(L, -(nargs + 2));
+			lua_xmove(L, task->thread, nargs + 1);
+
+			lua_rawgeti(L, LUA_REGISTRYINDEX, m_tasksRef);
+			lua_pushvalue(L, -2);
+			lua_pushlightuserdata(L, task);
+			lua_rawset(L, -3);
+			lua_pop(L, 2);
+
+			++m_tasks;
+			m_ready.append(task);
+			return true;
+		}
+
+		void schedule(Task * task)
+		{
+			unsigned int delta = task->expire - m_now;
+			if (int(delta) <= 0)
+			{
+				m_ready.append(task);
+				return;
+			}
+
+			unsigned int expire = task->expire;
+			int level = 0;
+			while (level + 1 < WHEEL_LEVELS && delta >= (1u << (WHEEL_BITS * (level + 1))))
+			{
+				++level;
+			}
+			if (delta >= (1u << (WHEEL_BITS * WHEEL_LEVELS)))
+			{
+				// out of range of the wheel, rescheduled when its slot is cascaded.
+				expire = m_now + (1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+			}
+			m_wheel[level][(expire >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)].append(task);
+			task->timed = true;
+			++m_timers;
+		}
+
+		// unlink task from wheel, event or ready list.
+		void detach(Task * task)
+		{
+			if (task->timed)
+			{
+				task->timed = false;
+				--m_timers;
+			}
+			task->unlink();
+		}
+
+		void cascade(TaskLink & slot)
+		{
+			TaskLink pending;
+			pending.reset();
+			pending.splice(slot);
+			while (pending.next != &pending)
+			{
+				Task * task = static_cast<Task*>(pending.next);
+				detach(task);
+				schedule(task);
+			}
+		}
+
+		void run(Task * task)
+		{
+			int status;
+			if (task->started)
+			{
+				status = resumePending(task->thread);
+			}
+			else
+			{
+				task->started = true;
+				status = LuaResume(task->thread, m_state, task->nargs);
+			}
+			settle(task, status);
+		}
+
+		void settle(Task * task, int status)
+		{
+			lua_State * thread = task->thread;
+			// request left by a yield which failed is dropped here too.
+			const int request = isPending(thread, this) ? task->request : REQUEST_NONE;
+			task->request = REQUEST_NONE;
+			if (status == LUA_YIELD)
+			{
+				detach(task);
+				if (!isPending(thread))
+				{
+					// yielded by coroutine.yield, treated as yield of scheduler.
+					m_ready.append(task);
+				}
+				else if (request == REQUEST_SLEEP)
+				{
+					schedule(task);
+				}
+				else if (request == REQUEST_WAIT)
+				{
+					m_events[(unsigned int)task->event & (EVENT_BUCKETS - 1)].append(task);
+				}
+				else if (request == REQUEST_YIELD)
+				{
+					m_ready.append(task);
+				}
+				return;
+			}
+
+			if (status != 0 && m_onError)
+			{
+				m_onError(thread, lua_tostring(thread, -1));
+			}
+
+			lua_rawgeti(m_state, LUA_REGISTRYINDEX, m_tasksRef);
+			lua_pushthread(thread);
+			lua_xmove(thread, m_state, 1);
+			lua_pushnil(m_state);
+			lua_rawset(m_state, -3);
+			lua_pop(m_state, 1);
+
+			--m_tasks;
+			detach(task);
+			delete task;
+		}
+
+	private:
+		lua_State * m_state;
+		int m_tasksRef;
+		unsigned int m_now;
+		int m_timers;
+		int m_tasks;
+		ErrorHandler m_onError;
+		TaskLink m_ready;
+		TaskLink m_wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+		TaskLink m_events[EVENT_BUCKETS];
+	};
+
+}
+
+
+
+#ifndef LUAAA_WITHOUT_CPP_STDLIB
+
+#include <array>
+#include <vector>
+#include <deque>
+#include <list>
+#include <forward_list>
+#include <set>
+#include <map>
+#include <unordered_set>
+#include <unordered_map>
+#include <tuple>
+#include <cstddef>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <exception>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdio>
+#include <chrono>
+
+#if (__cplusplus >= 201703L) || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#   define LUAAA_WITH_STD_OPTIONAL 1
+#   include <optional>
+#endif
+
+/// set LUAAA_WITHOUT_MMAP to read cached bytecode files instead of mapping them.
+#if !defined(LUAAA_WITHOUT_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#   define LUAAA_WITH_MMAP 1
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#else
+#   define LUAAA_WITH_MMAP 0
+#endif
+
+namespace LUAAA_NS
+{
+    // array
+    template<typename K, size_t N>
+    struct LuaStack<std::array<K, N>>
+    {
+        typedef std::array<K, N> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                int index = 0;
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx) && index < N)
+                {
+                    result[index++] = LuaStack<typename Container::value_type>::get(L, lua_gettop(L));
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            int index = 1;
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::value_type>::put(L, *it);
+                lua_rawseti(L, -2, index++);
+            }
+        }
+    };
+
+    // vector
+    template<typename K, typename ...ARGS>
+    struct LuaStack<std::vector<K, ARGS...>>
+    {
+        typedef std::vector<K, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    result.push_back(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            int index = 1;
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::value_type>::put(L, *it);
+                lua_rawseti(L, -2, index++);
+            }
+        }
+    };
+
+    // deque
+    template<typename K, typename ...ARGS>
+    struct LuaStack<std::deque<K, ARGS...>>
+    {
+        typedef std::deque<K, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    result.push_back(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            int index = 1;
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::value_type>::put(L, *it);
+                lua_rawseti(L, -2, index++);
+            }
+        }
+    };
+
+    // list
+    template<typename K, typename ...ARGS>
+    struct LuaStack<std::list<K, ARGS...>>
+    {
+        typedef std::list<K, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    result.push_back(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            int index = 1;
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::value_type>::put(L, *it);
+                lua_rawseti(L, -2, index++);
+            }
+        }
+    };
+
+    // forward_list
+    template<typename K, typename ...ARGS>
+    struct LuaStack<std::forward_list<K, ARGS...>>
+    {
+        typedef std::forward_list<K, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    result.push_back(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            int index = 1;
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::value_type>::put(L, *it);
+                lua_rawseti(L, -2, index++);
+            }
+        }
+    };
+
+    // set
+    template<typename K, typename ...ARGS>
+    struct LuaStack<std::set<K, ARGS...>>
+    {
+        typedef std::set<K, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    result.insert(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            int index = 1;
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::value_type>::put(L, *it);
+                lua_rawseti(L, -2, index++);
+            }
+        }
+    };
+
+    // multiset
+    template<typename K, typename ...ARGS>
+    struct LuaStack<std::multiset<K, ARGS...>>
+    {
+        typedef std::multiset<K, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    result.insert(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            int index = 1;
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::value_type>::put(L, *it);
+                lua_rawseti(L, -2, index++);
+            }
+        }
+    };
+
+    // unordered_set
+    template<typename K, typename ...ARGS>
+    struct LuaStack<std::unordered_set<K, ARGS...>>
+    {
+        typedef std::unordered_set<K, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    result.insert(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            int index = 1;
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::value_type>::put(L, *it);
+                lua_rawseti(L, -2, index++);
+            }
+        }
+    };
+
+    // unordered_multiset
+    template<typename K, typename ...ARGS>
+    struct LuaStack<std::unordered_multiset<K, ARGS...>>
+    {
+        typedef std::unordered_multiset<K, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    result.insert(LuaStack<typename Container::value_type>::get(L, lua_gettop(L)));
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            int index = 1;
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::value_type>::put(L, *it);
+                lua_rawseti(L, -2, index++);
+            }
+        }
+    };
+
+    // map
+    template<typename K, typename V, typename ...ARGS>
+    struct LuaStack<std::map<K, V, ARGS...>>
+    {
+        typedef std::map<K, V, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    const int top = lua_gettop(L);
+                    result[LuaStack<typename Container::key_type>::get(L, top - 1)] = LuaStack<typename Container::mapped_type>::get(L, top);
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::key_type>::put(L, it->first);
+                LuaStack<typename Container::mapped_type>::put(L, it->second);
+                lua_rawset(L, -3);
+            }
+        }
+    };
+
+    // multimap
+    template<typename K, typename V, typename ...ARGS>
+    struct LuaStack<std::multimap<K, V, ARGS...>>
+    {
+        typedef std::multimap<K, V, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    const int top = lua_gettop(L);
+                    result[LuaStack<typename Container::key_type>::get(L, top - 1)] = LuaStack<typename Container::mapped_type>::get(L, top);
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::key_type>::put(L, it->first);
+                LuaStack<typename Container::mapped_type>::put(L, it->second);
+                lua_rawset(L, -3);
+            }
+        }
+    };
+
+    // unordered_map
+    template<typename K, typename V, typename ...ARGS>
+    struct LuaStack<std::unordered_map<K, V, ARGS...>>
+    {
+        typedef std::unordered_map<K, V, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    const int top = lua_gettop(L);
+                    result[LuaStack<typename Container::key_type>::get(L, top - 1)] = LuaStack<typename Container::mapped_type>::get(L, top);
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::key_type>::put(L, it->first);
+                LuaStack<typename Container::mapped_type>::put(L, it->second);
+                lua_rawset(L, -3);
+            }
+        }
+    };
+
+    // unordered_multimap
+    template<typename K, typename V, typename ...ARGS>
+    struct LuaStack<std::unordered_multimap<K, V, ARGS...>>
+    {
+        typedef std::unordered_multimap<K, V, ARGS...> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                lua_pushnil(L);
+                while (0 != lua_next(L, idx))
+                {
+                    const int top = lua_gettop(L);
+                    result[LuaStack<typename Container::key_type>::get(L, top - 1)] = LuaStack<typename Container::mapped_type>::get(L, top);
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 0);
+            }
+            return result;
+        }
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            for (auto it = s.begin(); it != s.end(); ++it)
+            {
+                LuaStack<typename Container::key_type>::put(L, it->first);
+                LuaStack<typename Container::mapped_type>::put(L, it->second);
+                lua_rawset(L, -3);
+            }
+        }
+    };
+
+
+    // std::pair
+    template<typename U, typename V>
+    struct LuaStack<std::pair<U, V>>
+    {
+        typedef std::pair<U, V> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            Container result;
+            luaL_argcheck(L, lua_istable(L, idx), 1, "required table not found on stack.");
+            if (lua_istable(L, idx))
+            {
+                result.first = LuaStack<typename Container::first_type>::get(L, idx + 1);
+                result.second = LuaStack<typename Container::second_type>::get(L, idx + 2);
+            }
+            return result;
+        }
+
+        inline static void put(lua_State * L, const Container& s)
+        {
+            lua_newtable(L);
+            LuaStack<typename Container::first_type>::put(L, s.first);
+            lua_rawseti(L, -2, 1);
+            LuaStack<typename Container::second_type>::put(L, s.second);
+            lua_rawseti(L, -2, 2);
+        }
+    };
+
+    // std::pair as return value, pushed as two results.
+    template<typename U, typename V>
+    struct LuaStackReturnValue<std::pair<U, V>>
+    {
+        inline static int put(lua_State * L, const std::pair<U, V>& s)
+        {
+            lua_settop(L, 0);
+            LuaStack<U>::put(L, s.first);
+            LuaStack<V>::put(L, s.second);
+            return 2;
+        }
+    };
+
+    // std::tuple as return value, each element pushed as one result.
+    template<typename ...T>
+    struct LuaStackReturnValue<std::tuple<T...>>
+    {
+        inline static int put(lua_State * L, const std::tuple<T...>& s)
+        {
+            lua_settop(L, 0);
+            luaL_checkstack(L, int(sizeof...(T)), "too many results");
+            putAt(L, s, typename MakeIndexSequence<sizeof...(T)>::type());
+            return int(sizeof...(T));
+        }
+
+    private:
+        template<size_t ...I>
+        inline static void putAt(lua_State * L, const std::tuple<T...>& s, IndexSequence<I...>)
+        {
+            (void)(L); (void)(s);
+            int results[] = { 0, (LuaStack<T>::put(L, std::get<I>(s)), 0)... };
+            (void)(results);
+        }
+    };
+
+#if LUAAA_WITH_STD_OPTIONAL
+    // std::optional, absent or nil lua value is std::nullopt.
+    template<typename T>
+    struct LuaStack<std::optional<T>>
+    {
+        typedef std::optional<T> Container;
+        inline static Container get(lua_State * L, int idx)
+        {
+            if (lua_isnoneornil(L, idx))
+            {
+                return std::nullopt;
+            }
+            return Container(LuaStack<T>::get(L, idx));
+        }
+
+        inline static void put(lua_State * L, const Container& s)
+        {
+            if (s)
+            {
+                LuaStack<T>::put(L, *s);
+            }
+            else
+            {
+                lua_pushnil(L);
+            }
+        }
+    };
+
+    template<typename T>
+    struct LuaStackMatcher<std::optional<T>>
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            return lua_isnoneornil(L, idx) || LuaStackMatcher<typename std::decay<T>::type>::match(L, idx);
+        }
+    };
+
+    template<typename T>
+    struct LuaOptionalArgument<std::optional<T>>
+    {
+        enum { value = true };
+    };
+#endif
+
+    // containers are passed as lua table
+    template<typename T>
+    struct LuaStackMatcher<T, typename VoidType<typename T::const_iterator>::type>
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            return lua_istable(L, idx);
+        }
+    };
+
+    template<typename U, typename V>
+    struct LuaStackMatcher<std::pair<U, V>>
+    {
+        inline static bool match(lua_State * L, int idx)
+        {
+            return lua_istable(L, idx);
+        }
+    };
+
+	// argument kept by a binding which runs the call later (async, deferred):
+	//   values are copied, C strings are copied to std::string,
+	//   pointers and references to lua owned objects are kept, their lua values must be pinned until the call runs.
+	template<typename T>
+	struct LuaStoredKind
+	{
+		typedef typename std::decay<T>::type D;
+
+		enum
+		{
+			value = (std::is_same<D, const char *>::value || std::is_same<D, char *>::value) ? 1
+				: std::is_pointer<D>::value ? 2
+				: (std::is_lvalue_reference<T>::value && std::is_lvalue_reference<decltype(LuaStack<D>::get(nullptr, 0))>::value) ? 3
+				: 0
+		};
+	};
+
+	template<typename T, int = LuaStoredKind<T>::value>
+	struct LuaStoredArgument
+	{
+		static_assert(!LuaOutputArgument<T>::value, "output arguments are not supported by calls run later.");
+
+		typedef typename std::decay<T>::type type;
+
+		enum { pinned = false };
+
+		inline static type & load(type & value)
+		{
+			return value;
+		}
+	};
+
+	template<typename T>
+	struct LuaStoredArgument<T, 1>
+	{
+		typedef std::string type;
+
+		enum { pinned = false };
+
+		inline static typename std::decay<T>::type load(std::string & value)
+		{
+			return &value[0];
+		}
+	};
+
+	template<typename T>
+	struct LuaStoredArgument<T, 2>
+	{
+		static_assert(!std::is_same<typename std::decay<T>::type, lua_State *>::value, "lua_State * is not supported by calls run later.");
+
+		typedef typename std::decay<T>::type type;
+
+		enum { pinned = true };
+
+		inline static type load(type value)
+		{
+			return value;
+		}
+	};
+
+	template<typename T>
+	struct LuaStoredArgument<T, 3>
+	{
+		typedef typename std::remove_reference<T>::type * type;
+
+		enum { pinned = true };
+
+		inline static T load(type value)
+		{
+			return *value;
+		}
+	};
+
+	template<typename ...ARGS>
+	struct LuaStoredPinned
+	{
+		enum { value = false };
+	};
+
+	template<typename FIRST, typename ...REST>
+	struct LuaStoredPinned<FIRST, REST...>
+	{
+		enum { value = LuaStoredArgument<FIRST>::pinned || LuaStoredPinned<REST...>::value };
+	};
+
+	template<typename ...ARGS>
+	struct LuaStoredArguments
+	{
+		typedef std::tuple<typename LuaStoredArgument<ARGS>::type...> type;
+		typedef typename MakeIndexSequence<sizeof...(ARGS)>::type Indices;
+
+		enum { pinned = LuaStoredPinned<ARGS...>::value };
+
+		template<typename ...V>
+		inline static type store(V&&... values)
+		{
+			return type(Store<ARGS>(std::forward<V>(values))...);
+		}
+
+		// pin(idx) is called with stack index of each argument whose lua value must be pinned, arguments are from skip + 1 on.
+		template<typename PIN>
+		inline static void pin(int skip, PIN & pin)
+		{
+			Pin(skip, pin, Indices());
+		}
+
+		template<typename R, typename F>
+		inline static R call(F & func, type & args)
+		{
+			return Call<R>(func, args, Indices());
+		}
+
+		template<typename R, typename TCLASS, typename F>
+		inline static R call(TCLASS * obj, F func, type & args)
+		{
+			return Call<R>(obj, func, args, Indices());
+		}
+
+	private:
+		template<typename T, typename V>
+		inline static typename LuaStoredArgument<T>::type Store(V && value, typename std::enable_if<LuaStoredKind<T>::value == 3>::type * = nullptr)
+		{
+			return &value;
+		}
+
+		template<typename T, typename V>
+		inline static typename LuaStoredArgument<T>::type Store(V && value, typename std::enable_if<LuaStoredKind<T>::value != 3>::type * = nullptr)
+		{
+			return typename LuaStoredArgument<T>::type(std::forward<V>(value));
+		}
+
+		template<typename PIN, size_t ...I>
+		inline static void Pin(int skip, PIN & pin, IndexSequence<I...>)
+		{
+			(void)(skip); (void)(pin);
+			int pinned[] = { 0, (LuaStoredArgument<ARGS>::pinned ? (pin(skip + 1 + LuaArgumentOffset<I, ARGS...>::value), 0) : 0)... };
+			(void)(pinned);
+		}
+
+		template<typename R, typename F, size_t ...I>
+		inline static R Call(F & func, type & args, IndexSequence<I...>)
+		{
+			(void)(args);
+			return func(LuaStoredArgument<ARGS>::load(std::get<I>(args))...);
+		}
+
+		template<typename R, typename TCLASS, typename F, size_t ...I>
+		inline static R Call(TCLASS * obj, F func, type & args, IndexSequence<I...>)
+		{
+			(void)(args);
+			return (obj->*func)(LuaStoredArgument<ARGS>::load(std::get<I>(args))...);
+		}
+	};
+
+	// -----------------------------------
+	// completion queue
+	// -----------------------------------
+	template<typename F> struct LuaAsync;
+
+	// bridge from C++ worker threads back to lua coroutines:
+	// function bound with async() reads its arguments on lua thread, submits the work to executor and yields,
+	// result of the work is pushed to a lock-free MPSC queue from the worker thread,
+	// drain() on the thread which owns lua state resumes waiting coroutines with results.
+	class CompletionQueue
+	{
+	public:
+		typedef std::function<void(std::function<void()>)> Executor;
+		typedef std::function<int(lua_State * thread, int nargs)> Resumer;
+
+		// executor runs submitted work on other threads, e.g. a thread pool.
+		explicit CompletionQueue(Executor executor)
+			: m_channel(std::make_shared<Channel>()), m_executor(std::move(executor)), m_pending(0),
+			m_resumer([](lua_State * thread, int nargs) { return LuaResume(thread, nullptr, nargs); })
+		{
+		}
+
+		CompletionQueue(const CompletionQueue&) = delete;
+		CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+		// resumer resumes coroutine with nargs values on its stack, e.g. Scheduler::resume for tasks of scheduler.
+		void setResumer(Resumer resumer)
+		{
+			m_resumer = std::move(resumer);
+		}
+
+		// bind function or callable to run on executor, e.g.
+		//     fun("compress", queue.async(compress));
+		// it must be called from a coroutine, which is resumed with the result by drain().
+		template<typename F>
+		LuaAsync<F> async(F func)
+		{
+			return LuaAsync<F>(this, std::move(func));
+		}
+
+		// resume coroutines of completed work, at most maxCount of them, return count resumed.
+		int drain(int maxCount = INT_MAX)
+		{
+			int count = 0;
+			while (count < maxCount)
+			{
+				Completion * completion = m_channel->pop();
+				if (completion == nullptr)
+				{
+					break;
+				}
+				++count;
+				--m_pending;
+
+				lua_State * thread = completion->thread;
+				lua_settop(thread, 0);
+				int nargs = completion->push(thread);
+				m_resumer(thread, nargs);
+				luaL_unref(thread, LUA_REGISTRYINDEX, completion->pins);
+				luaL_unref(thread, LUA_REGISTRYINDEX, completion->ref);
+				delete completion;
+			}
+			return count;
+		}
+
+		// count of submitted work not drained yet.
+		int pending() const
+		{
+			return m_pending;
+		}
+
+	private:
+		template<typename, typename> friend struct AsyncFunctionCaller;
+
+		struct Completion
+		{
+			std::atomic<Completion *> next;
+			lua_State * thread;
+			int ref;
+			int pins;
+
+			Completion() : next(nullptr), thread(nullptr), ref(LUA_NOREF), pins(LUA_NOREF) {}
+			virtual ~Completion() {}
+
+			// push results to thread, return count of them.
+			virtual int push(lua_State * thread) = 0;
+		};
+
+		template<typename R>
+		struct CompletionValue : public Completion
+		{
+			R value;
+
+			template<typename V>
+			explicit CompletionValue(V && v) : value(std::forward<V>(v)) {}
+
+			int push(lua_State * thread) override
+			{
+				return LuaStackReturn<const R&>(thread, value);
+			}
+		};
+
+		struct CompletionVoid : public Completion
+		{
+			int push(lua_State *) override
+			{
+				return 0;
+			}
+		};
+
+		struct CompletionError : public Completion
+		{
+			std::string message;
+
+			explicit CompletionError(const char * msg) : message(msg) {}
+
+			int push(lua_State * thread) override
+			{
+				return LuaPendingError(thread, message.c_str());
+			}
+		};
+
+		// intrusive MPSC queue (Vyukov), producers never block, only owner thread pops.
+		struct Channel
+		{
+			std::atomic<Completion *> head;
+			Completion * tail;
+			CompletionVoid stub;
+
+			Channel() : head(&stub), tail(&stub) {}
+
+			~Channel()
+			{
+				while (Completion * completion = pop())
+				{
+					delete completion;
+				}
+			}
+
+			void push(Completion * completion)
+			{
+				completion->next.store(nullptr, std::memory_order_relaxed);
+				Completion * prev = head.exchange(completion, std::memory_order_acq_rel);
+				prev->next.store(completion, std::memory_order_release);
+			}
+
+			Completion * pop()
+			{
+				Completion * first = tail;
+				Completion * next = first->next.load(std::memory_order_acquire);
+				if (first == &stub)
+				{
+					if (next == nullptr)
+					{
+						return nullptr;
+					}
+					tail = next;
+					first = next;
+					next = next->next.load(std::memory_order_acquire);
+				}
+				if (next)
+				{
+					tail = next;
+					return first;
+				}
+				if (first != head.load(std::memory_order_acquire))
+				{
+					// a producer is linking its node.
+					return nullptr;
+				}
+				push(&stub);
+				next = first->next.load(std::memory_order_acquire);
+				if (next)
+				{
+					tail = next;
+					return first;
+				}
+				return nullptr;
+			}
+		};
+
+		template<typename R, typename STORED, typename F>
+		static Completion * Complete(F & func, typename STORED::type & args, std::false_type)
+		{
+			return new CompletionValue<typename std::decay<R>::type>(STORED::template call<R>(func, args));
+		}
+
+		template<typename R, typename STORED, typename F>
+		static Completion * Complete(F & func, typename STORED::type & args, std::true_type)
+		{
+			STORED::template call<void>(func, args);
+			return new CompletionVoid();
+		}
+
+		// anchor calling coroutine and run func with args on executor,
+		// pins is registry ref of lua values of the arguments, released when completion is drained.
+		template<typename R, typename STORED, typename F>
+		void submit(lua_State * thread, int pins, const F & func, typename STORED::type && args)
+		{
+			lua_pushthread(thread);
+			int ref = luaL_ref(thread, LUA_REGISTRYINDEX);
+
+			struct Job
+			{
+				std::shared_ptr<Channel> channel;
+				F func;
+				typename STORED::type args;
+				lua_State * thread;
+				int ref;
+				int pins;
+
+				void operator()()
+				{
+					Completion * completion = nullptr;
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+					try
+					{
+						completion = Complete<R, STORED>(func, args, std::is_void<R>());
+					}
+					catch (const std::exception & e)
+					{
+						completion = new CompletionError(e.what());
+					}
+					catch (...)
+					{
+						completion = new CompletionError("unknown exception in async function.");
+					}
+#else
+					completion = Complete<R, STORED>(func, args, std::is_void<R>());
+#endif
+					completion->thread = thread;
+					completion->ref = ref;
+					completion->pins = pins;
+					channel->push(completion);
+				}
+			};
+
+			++m_pending;
+			m_executor(Job{ m_channel, func, std::move(args), thread, ref, pins });
+		}
+
+	private:
+		std::shared_ptr<Channel> m_channel;
+		Executor m_executor;
+		int m_pending;
+		Resumer m_resumer;
+	};
+
+	template<typename F>
+	struct LuaAsync
+	{
+		LuaAsync(CompletionQueue * q, F f) : queue(q), func(std::move(f)) {}
+
+		CompletionQueue * queue;
+		F func;
+	};
+
+	// signature of function pointer or callable object.
+	template<typename F, bool = std::is_class<F>::value>
+	struct LuaCallSignature
+	{
+		typedef F type;
+	};
+
+	template<typename F>
+	struct LuaCallSignature<F, true>
+	{
+		typedef decltype(&F::operator()) type;
+	};
+
+	template<typename F, typename SIGNATURE> struct AsyncFunctionCaller;
+
+	template<typename F, typename TRET, typename ...ARGS>
+	struct AsyncFunctionCaller<F, TRET(*)(ARGS...)>
+	{
+		enum { arity = LuaSignature<LuaPending, ARGS...>::arity, minArity = LuaSignature<LuaPending, ARGS...>::minArity };
+
+		typedef LuaStoredArguments<ARGS...> Arguments;
+
+		// stack of coroutine is cleared when it yields, lua values of pointer and reference arguments are kept in a table.
+		struct Pins
+		{
+			lua_State * thread;
+			int table;
+
+			inline void operator()(int idx)
+			{
+				lua_pushvalue(thread, idx);
+				lua_rawseti(thread, table, idx);
+			}
+		};
+
+		struct Callee
+		{
+			LuaAsync<F> & async;
+			lua_State * thread;
+			int skip;
+
+			inline LuaPending operator()(ARGS... args) const
+			{
+				int pins = LUA_NOREF;
+				if (Arguments::pinned)
+				{
+					lua_newtable(thread);
+					Pins pin = { thread, lua_gettop(thread) };
+					Arguments::pin(skip, pin);
+					pins = luaL_ref(thread, LUA_REGISTRYINDEX);
+				}
+				async.queue->template submit<TRET, Arguments>(thread, pins, async.func, Arguments::store(std::forward<ARGS>(args)...));
+				return LuaPending();
+			}
+		};
+
+		template<int K = 0>
+		inline static bool Match(lua_State * state, int skip)
+		{
+			return LuaSignature<LuaPending, ARGS...>::template match<K>(state, skip);
+		}
+
+		inline static int Invoke(lua_State * state, int skip, LuaAsync<F> & async)
+		{
+			if (lua_pushthread(state))
+			{
+				luaL_error(state, "async function must be called from a coroutine.");
+			}
+			lua_pop(state, 1);
+			// nothing is pinned or submitted for a call whose yield would fail.
+			if (!LuaCanSuspend(state))
+			{
+				luaL_error(state, "async function cannot suspend coroutine here.");
+			}
+			Callee callee = { async, state, skip };
+			return LuaSignature<LuaPending, ARGS...>::invoke(state, skip, callee, LuaValues<>());
+		}
+	};
+
+	template<typename F, typename TCALLABLE, typename TRET, typename ...ARGS>
+	struct AsyncFunctionCaller<F, TRET(TCALLABLE::*)(ARGS...)> : public AsyncFunctionCaller<F, TRET(*)(ARGS...)>
+	{
+	};
+
+	template<typename F, typename TCALLABLE, typename TRET, typename ...ARGS>
+	struct AsyncFunctionCaller<F, TRET(TCALLABLE::*)(ARGS...)const> : public AsyncFunctionCaller<F, TRET(*)(ARGS...)>
+	{
+	};
+
+	template<typename F>
+	struct FunctionCaller<LuaAsync<F>> : public AsyncFunctionCaller<F, typename LuaCallSignature<F>::type>
+	{
+	};
+
+	// -----------------------------------
+	// deferred commands
+	// -----------------------------------
+	template<typename F> struct LuaDeferred;
+
+	// commands recorded by deferred bindings of one state, run later by the host in one go.
+	// e.g. setters of objects shared with other threads take no lock when called by scripts:
+	//     CommandBuffer commands(L);
+	//     LuaClass<Cat>(L, "Cat").fun("setAge", commands.defer(&Cat::setAge));
+	//     ...
+	//     { std::lock_guard<std::mutex> lock(catsMutex); commands.apply(); }
+	// commands are kept in reused blocks: function, object and arguments converted by LuaStack.
+	// objects and lua objects of pointer or reference arguments of recorded commands are kept alive until applied,
+	// C strings are copied.
+	// use it on the thread running the state, and destroy it before lua_close.
+	class CommandBuffer
+	{
+	public:
+		explicit CommandBuffer(lua_State * state, size_t blockSize = 64 * 1024)
+			: m_state(state), m_blockSize(blockSize), m_block(0), m_count(0), m_pins(0), m_pinned(nullptr)
+		{
+		}
+
+		~CommandBuffer()
+		{
+			clear();
+			for (auto it = m_blocks.begin(); it != m_blocks.end(); ++it)
+			{
+				free(it->data);
+			}
+		}
+
+		CommandBuffer(const CommandBuffer&) = delete;
+		CommandBuffer& operator=(const CommandBuffer&) = delete;
+
+		// binding for LuaClass::fun (member function) or LuaModule::fun, it records a command instead of calling f.
+		template<typename F>
+		LuaDeferred<F> defer(F f)
+		{
+			return LuaDeferred<F>(this, std::move(f));
+		}
+
+		// run commands in order of recording and drop them, return count of commands run.
+		size_t apply()
+		{
+			return consume(true);
+		}
+
+		// drop commands without running them.
+		void clear()
+		{
+			consume(false);
+		}
+
+		size_t size() const
+		{
+			return m_count;
+		}
+
+		// construct command in buffer, object at stack index self of state (0 for none) is kept alive.
+		template<typename COMMAND, typename ...P>
+		void record(lua_State * state, int self, P&&... params)
+		{
+			Header * header = static_cast<Header*>(allocate(HeaderSize + sizeof(COMMAND)));
+			if (header == nullptr)
+			{
+				luaL_error(state, "not enough memory for deferred command.");
+			}
+			header->run = Run<COMMAND>;
+			header->size = Aligned(HeaderSize + sizeof(COMMAND));
+			new (reinterpret_cast<char*>(header) + HeaderSize) COMMAND{ std::forward<P>(params)... };
+			++m_count;
+			if (self != 0)
+			{
+				pin(state, self);
+			}
+		}
+
+		// keep lua object at stack index idx alive until commands are applied or cleared,
+		// the same object is pinned once for consecutive commands.
+		void pin(lua_State * state, int idx)
+		{
+			void * object = lua_touserdata(state, idx);
+			if (object == nullptr || object == m_pinned)
+			{
+				return;
+			}
+			lua_pushlightuserdata(state, this);
+			lua_rawget(state, LUA_REGISTRYINDEX);
+			if (!lua_istable(state, -1))
+			{
+				lua_pop(state, 1);
+				lua_newtable(state);
+				lua_pushlightuserdata(state, this);
+				lua_pushvalue(state, -2);
+				lua_rawset(state, LUA_REGISTRYINDEX);
+			}
+			lua_pushvalue(state, idx);
+			lua_rawseti(state, -2, ++m_pins);
+			lua_pop(state, 1);
+			m_pinned = object;
+		}
+
+	private:
+		enum { Alignment = alignof(std::max_align_t) };
+
+		struct Header
+		{
+			void(*run)(void * command, bool apply);
+			size_t size;
+		};
+
+		enum { HeaderSize = (sizeof(Header) + Alignment - 1) / Alignment * Alignment };
+
+		struct Block
+		{
+			char * data;
+			size_t used;
+			size_t capacity;
+		};
+
+		template<typename COMMAND>
+		static void Run(void * command, bool apply)
+		{
+			COMMAND * cmd = static_cast<COMMAND*>(command);
+			if (apply)
+			{
+				(*cmd)();
+			}
+			cmd->~COMMAND();
+		}
+
+		static size_t Aligned(size_t size)
+		{
+			return (size + Alignment - 1) / Alignment * Alignment;
+		}
+
+		// blocks after the current one are empty, a command never spans blocks.
+		void * allocate(size_t size)
+		{
+			size = Aligned(size);
+			while (m_block < m_blocks.size() && m_blocks[m_block].capacity - m_blocks[m_block].used < size)
+			{
+				++m_block;
+			}
+			if (m_block == m_blocks.size())
+			{
+				Block block;
+				block.capacity = size > m_blockSize ? size : m_blockSize;
+				block.data = static_cast<char*>(malloc(block.capacity));
+				block.used = 0;
+				if (block.data == nullptr)
+				{
+					return nullptr;
+				}
+				m_blocks.push_back(block);
+			}
+			Block& block = m_blocks[m_block];
+			void * ptr = block.data + block.used;
+			block.used += size;
+			return ptr;
+		}
+
+		size_t consume(bool apply)
+		{
+			size_t count = m_count;
+			// blocks skipped by allocate may be empty, commands are in any block up to the current one.
+			for (size_t i = 0; i < m_blocks.size() && i <= m_block; ++i)
+			{
+				Block& block = m_blocks[i];
+				for (size_t offset = 0; offset < block.used; )
+				{
+					Header * header = reinterpret_cast<Header*>(block.data + offset);
+					offset += header->size;
+					header->run(reinterpret_cast<char*>(header) + HeaderSize, apply);
+				}
+				block.used = 0;
+			}
+			m_block = 0;
+			m_count = 0;
+			if (m_pins > 0)
+			{
+				lua_pushlightuserdata(m_state, this);
+				lua_pushnil(m_state);
+				lua_rawset(m_state, LUA_REGISTRYINDEX);
+				m_pins = 0;
+				m_pinned = nullptr;
+			}
+			return apply ? count : 0;
+		}
+
+	private:
+		lua_State * m_state;
+		size_t m_blockSize;
+		size_t m_block;
+		size_t m_count;
+		int m_pins;
+		void * m_pinned;
+		std::vector<Block> m_blocks;
+	};
+
+	template<typename F>
+	struct LuaDeferred
+	{
+		LuaDeferred(CommandBuffer * b, F f) : buffer(b), func(std::move(f)) {}
+
+		CommandBuffer * buffer;
+		F func;
+	};
+
+	template<typename F, typename SIGNATURE, bool = std::is_member_function_pointer<F>::value> struct DeferredFunctionCaller;
+
+	// lua values of pointer and reference arguments are pinned by command buffer.
+	struct DeferredPins
+	{
+		CommandBuffer * buffer;
+		lua_State * state;
+
+		inline void operator()(int idx)
+		{
+			buffer->pin(state, idx);
+		}
+	};
+
+	// function or callable, records a copy of it with the arguments.
+	template<typename F, typename TRET, typename ...ARGS>
+	struct DeferredFunctionCaller<F, TRET(*)(ARGS...), false>
+	{
+		typedef LuaStoredArguments<ARGS...> Arguments;
+
+		enum { arity = LuaSignature<void, ARGS...>::arity, minArity = LuaSignature<void, ARGS...>::minArity };
+
+		struct Command
+		{
+			F func;
+			typename Arguments::type args;
+
+			inline void operator()()
+			{
+				Arguments::template call<void>(func, args);
+			}
+		};
+
+		struct Callee
+		{
+			LuaDeferred<F> & deferred;
+			lua_State * state;
+			int skip;
+
+			inline void operator()(ARGS... args) const
+			{
+				deferred.buffer->template record<Command>(state, 0, deferred.func, Arguments::store(std::forward<ARGS>(args)...));
+				if (Arguments::pinned)
+				{
+					DeferredPins pin = { deferred.buffer, state };
+					Arguments::pin(skip, pin);
+				}
+			}
+		};
+
+		template<int K = 0>
+		inline static bool Match(lua_State * state, int skip)
+		{
+			return LuaSignature<void, ARGS...>::template match<K>(state, skip);
+		}
+
+		inline static int Invoke(lua_State * state, int skip, LuaDeferred<F> & deferred)
+		{
+			Callee callee = { deferred, state, skip };
+			return LuaSignature<void, ARGS...>::invoke(state, skip, callee, LuaValues<>());
+		}
+	};
+
+	template<typename F, typename TCALLABLE, typename TRET, typename ...ARGS>
+	struct DeferredFunctionCaller<F, TRET(TCALLABLE::*)(ARGS...), false> : public DeferredFunctionCaller<F, TRET(*)(ARGS...)>
+	{
+	};
+
+	template<typename F, typename TCALLABLE, typename TRET, typename ...ARGS>
+	struct DeferredFunctionCaller<F, TRET(TCALLABLE::*)(ARGS...)const, false> : public DeferredFunctionCaller<F, TRET(*)(ARGS...)>
+	{
+	};
+
+	// member function, records object with the arguments, object is self at stack index skip.
+	template<typename TCLASS, typename FTYPE, typename ...ARGS>
+	struct DeferredMemberFunctionCaller
+	{
+		typedef LuaStoredArguments<ARGS...> Arguments;
+
+		enum { arity = LuaSignature<void, ARGS...>::arity, minArity = LuaSignature<void, ARGS...>::minArity };
+
+		struct Command
+		{
+			FTYPE func;
+			TCLASS * obj;
+			typename Arguments::type args;
+
+			inline void operator()()
+			{
+				Arguments::template call<void>(obj, func, args);
+			}
+		};
+
+		struct Callee
+		{
+			LuaDeferred<FTYPE> & deferred;
+			TCLASS * obj;
+			lua_State * state;
+			int self;
+
+			inline void operator()(ARGS... args) const
+			{
+				deferred.buffer->template record<Command>(state, self, deferred.func, obj, Arguments::store(std::forward<ARGS>(args)...));
+				if (Arguments::pinned)
+				{
+					DeferredPins pin = { deferred.buffer, state };
+					Arguments::pin(self, pin);
+				}
+			}
+		};
+
+		template<int K = 0>
+		inline static bool Match(lua_State * state, int skip)
+		{
+			return LuaSignature<void, ARGS...>::template match<K>(state, skip);
+		}
+
+		inline static int Invoke(lua_State * state, int skip, LuaDeferred<FTYPE> & deferred)
+		{
+			Callee callee = { deferred, &LuaStack<TCLASS>::get(state, skip), state, skip };
+			return LuaSignature<void, ARGS...>::invoke(state, skip, callee, LuaValues<>());
+		}
+	};
+
+	template<typename F, typename TCLASS, typename TRET, typename ...ARGS>
+	struct DeferredFunctionCaller<F, TRET(TCLASS::*)(ARGS...), true> : public DeferredMemberFunctionCaller<TCLASS, F, ARGS...>
+	{
+	};
+
+	template<typename F, typename TCLASS, typename TRET, typename ...ARGS>
+	struct DeferredFunctionCaller<F, TRET(TCLASS::*)(ARGS...)const, true> : public DeferredMemberFunctionCaller<TCLASS, F, ARGS...>
+	{
+	};
+
+	// deferred binding returns nothing to lua.
+	template<typename F>
+	struct FunctionCaller<LuaDeferred<F>> : public DeferredFunctionCaller<F, typename LuaCallSignature<F>::type>
+	{
+	};
+
+	// -----------------------------------
+	// snapshots
+	// -----------------------------------
+	// read-only lua view of a Snapshot, fields are read from the frame the reader acquired last.
+	// it holds no lua reference, add fields while the state is open.
+	template<typename T>
+	class LuaSnapshotView
+	{
+	public:
+		LuaSnapshotView(lua_State * state, const char * name) : m_state(state), m_name(name) {}
+
+		// view.name reads member of frame, converted by LuaStack.
+		template<typename M>
+		LuaSnapshotView& field(const char * name, M T::* member)
+		{
+			// fields table is the first upvalue of __index.
+			lua_getglobal(m_state, m_name.c_str());
+			luaL_argcheck(m_state, lua_getmetatable(m_state, -1), 1, "snapshot view not found.");
+			lua_getfield(m_state, -1, "__index");
+			lua_getupvalue(m_state, -1, 1);
+			Field<M> * field = static_cast<Field<M>*>(lua_newuserdata(m_state, sizeof(Field<M>)));
+			field->push = Field<M>::Push;
+			field->member = member;
+			lua_setfield(m_state, -2, name);
+			lua_pop(m_state, 4);
+			return *this;
+		}
+
+	public:
+		struct FieldBase
+		{
+			void(*push)(lua_State * state, const T & frame, const FieldBase * field);
+		};
+
+		static int NewIndex(lua_State * state)
+		{
+			return luaL_error(state, "snapshot is read-only.");
+		}
+
+	private:
+		template<typename M>
+		struct Field : public FieldBase
+		{
+			M T::* member;
+
+			static void Push(lua_State * state, const T & frame, const FieldBase * field)
+			{
+				LuaStack<M>::put(state, frame.*(static_cast<const Field*>(field)->member));
+			}
+		};
+
+	private:
+		lua_State * m_state;
+		std::string m_name;
+	};
+
+	// triple buffer of frames from one producer thread to one reader thread, neither blocks nor waits.
+	// producer fills back() and publish()es it, reader acquire()s the latest published frame once per tick
+	// and reads it until the next acquire, lua view reads the acquired frame in place.
+	//     Snapshot<Sensors> sensors;
+	//     sensors.bind(L, "sensors").field("temperature", &Sensors::temperature);
+	//     // producer thread:
+	//     sensors.publish(sample());
+	//     // lua thread, each tick:
+	//     sensors.acquire();
+	//     run(L);  // sensors.temperature
+	// the snapshot must outlive lua states bound to it.
+	template<typename T>
+	class Snapshot
+	{
+	public:
+		Snapshot() : m_slots(), m_front(0), m_state(1), m_back(2), m_published(0)
+		{
+		}
+
+		Snapshot(const Snapshot&) = delete;
+		Snapshot& operator=(const Snapshot&) = delete;
+
+		// producer: frame to fill, it holds an older frame, all fields must be written.
+		T& back()
+		{
+			return m_slots[m_back];
+		}
+
+		// producer: make back() the latest frame.
+		void publish()
+		{
+			m_back = m_state.exchange(m_back | Fresh, std::memory_order_acq_rel) & Index;
+			m_published.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void publish(const T& frame)
+		{
+			m_slots[m_back] = frame;
+			publish();
+		}
+
+		// reader: take the latest published frame, return false if there is no newer one.
+		bool acquire()
+		{
+			if ((m_state.load(std::memory_order_relaxed) & Fresh) == 0)
+			{
+				return false;
+			}
+			m_front = m_state.exchange(m_front, std::memory_order_acq_rel) & Index;
+			return true;
+		}
+
+		// reader: acquired frame, value initialized T before the first one.
+		const T& get() const
+		{
+			return m_slots[m_front];
+		}
+
+		// count of frames published so far.
+		unsigned long long published() const
+		{
+			return m_published.load(std::memory_order_relaxed);
+		}
+
+		// set global name of state to a view of get(), add its fields by field().
+		LuaSnapshotView<T> bind(lua_State * state, const char * name)
+		{
+			lua_newuserdata(state, 1);
+			lua_createtable(state, 0, 3);
+			lua_newtable(state);
+			// acquire() moves the frame, __index reads it through the snapshot.
+			lua_pushlightuserdata(state, this);
+			lua_pushcclosure(state, View, 2);
+			lua_setfield(state, -2, "__index");
+			lua_pushcfunction(state, LuaSnapshotView<T>::NewIndex);
+			lua_setfield(state, -2, "__newindex");
+			lua_setmetatable(state, -2);
+			lua_setglobal(state, name);
+			return LuaSnapshotView<T>(state, name);
+		}
+
+	private:
+		enum { Index = 3, Fresh = 4 };
+
+		// __index, upvalues: fields, snapshot.
+		static int View(lua_State * state)
+		{
+			lua_pushvalue(state, 2);
+			lua_rawget(state, lua_upvalueindex(1));
+			typedef typename LuaSnapshotView<T>::FieldBase FieldBase;
+			const FieldBase * field = static_cast<const FieldBase*>(lua_touserdata(state, -1));
+			if (field == nullptr)
+			{
+				lua_pushnil(state);
+				return 1;
+			}
+			const Snapshot * self = static_cast<const Snapshot*>(lua_touserdata(state, lua_upvalueindex(2)));
+			field->push(state, self->get(), field);
+			return 1;
+		}
+
+	private:
+		T m_slots[3];
+		// reader side
+		int m_front;
+		char m_readerPad[64];
+		// front, middle and back are a permutation of slots, middle index and fresh flag are swapped atomically.
+		std::atomic<int> m_state;
+		char m_statePad[64];
+		// producer side
+		int m_back;
+		std::atomic<unsigned long long> m_published;
+	};
+
+	// -----------------------------------
+	// lua state pool
+	// -----------------------------------
+	// N lua states with the same bindings, each owned by one worker thread.
+	// jobs are spread to per-worker deques, owner pops from back, idle workers steal from front of others.
+	// a job runs on the state of the worker which takes it, so each state is used by one thread at a time.
+	class LuaStatePool
+	{
+	public:
+		typedef std::function<void(lua_State *)> Binding;
+		typedef std::function<void(lua_State *)> Job;
+		typedef std::function<lua_State *()> StateFactory;
+		typedef void(*ErrorHandler)(lua_State * state, const char * message);
+
+		// factory creates a new lua state, luaL_newstate with standard libs by default.
+		explicit LuaStatePool(int size, StateFactory factory = nullptr)
+			: m_factory(std::move(factory)), m_next(0), m_queued(0), m_unfinished(0), m_stop(false), m_onError(nullptr)
+		{
+			for (int i = 0; i < (size > 0 ? size : 1); ++i)
+			{
+				m_workers.emplace_back(new Worker());
+			}
+		}
+
+		LuaStatePool(const LuaStatePool&) = delete;
+		LuaStatePool& operator=(const LuaStatePool&) = delete;
+
+		// run remaining jobs, then close all states.
+		~LuaStatePool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_wake.notify_all();
+			for (auto & worker : m_workers)
+			{
+				if (worker->thread.joinable())
+				{
+					worker->thread.join();
+				}
+				if (worker->state)
+				{
+					lua_close(worker->state);
+				}
+			}
+		}
+
+		// register bindings (LuaClass, LuaModule, ...) to apply to each state, before start().
+		LuaStatePool& bind(Binding binding)
+		{
+			assert(!started());
+			m_bindings.push_back(std::move(binding));
+			return *this;
+		}
+
+		// create states and apply bindings on calling thread, then start workers.
+		void start()
+		{
+			assert(!started());
+			for (auto & worker : m_workers)
+			{
+				if (m_factory)
+				{
+					worker->state = m_factory();
+				}
+				else
+				{
+					worker->state = luaL_newstate();
+					luaL_openlibs(worker->state);
+				}
+				for (auto & binding : m_bindings)
+				{
+					binding(worker->state);
+				}
+				lua_settop(worker->state, 0);
+			}
+			for (auto & worker : m_workers)
+			{
+				worker->thread = std::thread(&LuaStatePool::work, this, worker.get());
+			}
+		}
+
+		// job submitted from a worker goes to its own deque, otherwise to workers by turns.
+		void submit(Job job)
+		{
+			Worker * worker = CurrentWorker();
+			if (worker == nullptr || worker->pool != this)
+			{
+				worker = m_workers[m_next++ % m_workers.size()].get();
+			}
+			++m_unfinished;
+			{
+				std::lock_guard<std::mutex> lock(worker->mutex);
+				worker->jobs.push_back(std::move(job));
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				++m_queued;
+			}
+			m_wake.notify_one();
+		}
+
+		// run script chunk on one of the states, error is passed to error handler.
+		void submit(const std::string& script)
+		{
+			ErrorHandler onError = m_onError;
+			submit([script, onError](lua_State * state) {
+				if (luaL_loadbuffer(state, script.data(), script.size(), "=pool") || lua_pcall(state, 0, 0, 0))
+				{
+					if (onError)
+					{
+						onError(state, lua_tostring(state, -1));
+					}
+				}
+			});
+		}
+
+		// block until all submitted jobs are done.
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_idle.wait(lock, [this] { return m_unfinished == 0; });
+		}
+
+		void setErrorHandler(ErrorHandler handler)
+		{
+			m_onError = handler;
+		}
+
+		int size() const
+		{
+			return int(m_workers.size());
+		}
+
+	private:
+		struct Worker
+		{
+			LuaStatePool * pool = nullptr;
+			lua_State * state = nullptr;
+			std::thread thread;
+			std::mutex mutex;
+			std::deque<Job> jobs;
+		};
+
+		static Worker *& CurrentWorker()
+		{
+			static thread_local Worker * worker = nullptr;
+			return worker;
+		}
+
+		bool started() const
+		{
+			return m_workers.front()->state != nullptr;
+		}
+
+		bool pop(Worker * worker, Job & job)
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+			if (worker->jobs.empty())
+			{
+				return false;
+			}
+			job = std::move(worker->jobs.back());
+			worker->jobs.pop_back();
+			return true;
+		}
+
+		bool steal(Worker * thief, Job & job)
+		{
+			size_t count = m_workers.size();
+			size_t start = size_t(thief - m_workers.front().get()) % count;
+			for (size_t i = 1; i <= count; ++i)
+			{
+				Worker * victim = m_workers[(start + i) % count].get();
+				if (victim == thief)
+				{
+					continue;
+				}
+				std::lock_guard<std::mutex> lock(victim->mutex);
+				if (!victim->jobs.empty())
+				{
+					job = std::move(victim->jobs.front());
+					victim->jobs.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void work(Worker * worker)
+		{
+			worker->pool = this;
+			CurrentWorker() = worker;
+			for (;;)
+			{
+				Job job;
+				if (pop(worker, job) || steal(worker, job))
+				{
+					--m_queued;
+					job(worker->state);
+					lua_settop(worker->state, 0);
+					if (--m_unfinished == 0)
+					{
+						std::lock_guard<std::mutex> lock(m_mutex);
+						m_idle.notify_all();
+					}
+					continue;
+				}
+
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait(lock, [this] { return m_stop || m_queued > 0; });
+				if (m_stop && m_queued == 0)
+				{
+					break;
+				}
+			}
+			CurrentWorker() = nullptr;
+		}
+
+	private:
+		std::vector<std::unique_ptr<Worker>> m_workers;
+		std::vector<Binding> m_bindings;
+		StateFactory m_factory;
+		std::atomic<size_t> m_next;
+		std::atomic<int> m_queued;
+		std::atomic<int> m_unfinished;
+		bool m_stop;
+		ErrorHandler m_onError;
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::condition_variable m_idle;
+	};
+
+	// -----------------------------------
+	// script loader
+	// -----------------------------------
+	// compiles a script once and keeps its lua_dump output in memory, and in cacheDir if given.
+	// entries are keyed by hash of source, chunk name and lua version, later loads skip the parser.
+	// on-disk bytecode is mapped (mmap) where available. bytecode is not verified by lua,
+	// so cacheDir must not be writable by others.
+	// one loader can be shared by states of different threads.
+	class ScriptLoader
+	{
+	public:
+		explicit ScriptLoader(std::string cacheDir = std::string())
+			: m_cacheDir(std::move(cacheDir)), m_hits(0), m_misses(0)
+		{
+		}
+
+		ScriptLoader(const ScriptLoader&) = delete;
+		ScriptLoader& operator=(const ScriptLoader&) = delete;
+
+		// like luaL_loadfile, push compiled chunk or error message, return lua status.
+		int loadFile(lua_State * state, const char * path)
+		{
+			std::string source;
+			if (!ReadFile(path, source))
+			{
+				lua_pushfstring(state, "cannot open %s", path);
+				return LUA_ERRFILE;
+			}
+			if (!source.empty() && source[0] == '#')
+			{
+				// skip shebang line, keep line numbers.
+				source.erase(0, std::min(source.find('\n'), source.size()));
+			}
+			std::string chunkName = std::string("@") + path;
+			return loadBuffer(state, source.data(), source.size(), chunkName.c_str());
+		}
+
+		// like luaL_loadbuffer.
+		int loadBuffer(lua_State * state, const char * data, size_t size, const char * chunkName)
+		{
+			unsigned long long key = Hash(data, size, chunkName);
+			std::shared_ptr<const Bytecode> code = find(key);
+			if (code)
+			{
+				if (Load(state, *code, chunkName) == 0)
+				{
+					++m_hits;
+					return 0;
+				}
+				lua_pop(state, 1);
+			}
+
+			++m_misses;
+			int status = luaL_loadbuffer(state, data, size, chunkName);
+			if (status != 0)
+			{
+				return status;
+			}
+
+			std::shared_ptr<Bytecode> dumped = std::make_shared<Bytecode>();
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 503
+			lua_dump(state, Write, &dumped->buffer, 0);
+#else
+			lua_dump(state, Write, &dumped->buffer);
+#endif
+			dumped->data = dumped->buffer.data();
+			dumped->size = dumped->buffer.size();
+			store(key, dumped);
+			return 0;
+		}
+
+		// like luaL_dofile, return lua status, error message is left on stack.
+		int doFile(lua_State * state, const char * path)
+		{
+			int status = loadFile(state, path);
+			return status != 0 ? status : lua_pcall(state, 0, LUA_MULTRET, 0);
+		}
+
+		// drop bytecode in memory, files in cacheDir are kept.
+		void clear()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_codes.clear();
+		}
+
+		size_t size() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_codes.size();
+		}
+
+		// loads served from cache / compiled from source.
+		size_t hits() const { return m_hits; }
+		size_t misses() const { return m_misses; }
+
+	private:
+		struct Bytecode
+		{
+			const char * data = nullptr;
+			size_t size = 0;
+			std::string buffer;
+#if LUAAA_WITH_MMAP
+			void * mapped = nullptr;
+
+			~Bytecode()
+			{
+				if (mapped)
+				{
+					munmap(mapped, size);
+				}
+			}
+#endif
+		};
+
+		struct Reader
+		{
+			const char * data;
+			size_t size;
+		};
+
+		static const char * Read(lua_State *, void * ud, size_t * size)
+		{
+			Reader * reader = static_cast<Reader*>(ud);
+			*size = reader->size;
+			reader->size = 0;
+			return *size ? reader->data : nullptr;
+		}
+
+		static int Write(lua_State *, const void * p, size_t size, void * ud)
+		{
+			static_cast<std::string*>(ud)->append(static_cast<const char*>(p), size);
+			return 0;
+		}
+
+		static int Load(lua_State * state, const Bytecode& code, const char * chunkName)
+		{
+			if (code.size < sizeof(LUA_SIGNATURE) - 1 || memcmp(code.data, LUA_SIGNATURE, sizeof(LUA_SIGNATURE) - 1) != 0)
+			{
+				lua_pushliteral(state, "bad bytecode");
+				return LUA_ERRSYNTAX;
+			}
+			Reader reader = { code.data, code.size };
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+			return lua_load(state, Read, &reader, chunkName, "b");
+#else
+			return lua_load(state, Read, &reader, chunkName);
+#endif
+		}
+
+		// fnv-1a, bytecode format depends on lua version and number types.
+		static unsigned long long Hash(const char * data, size_t size, const char * chunkName)
+		{
+			unsigned long long hash = 14695981039346656037ULL;
+			auto mix = [&hash](const void * p, size_t n) {
+				const unsigned char * bytes = static_cast<const unsigned char*>(p);
+				for (size_t i = 0; i < n; ++i)
+				{
+					hash = (hash ^ bytes[i]) * 1099511628211ULL;
+				}
+			};
+			const int tag[] = { LUA_VERSION_NUM, int(sizeof(lua_Number)), int(sizeof(lua_Integer)), int(sizeof(size_t)) };
+			mix(tag, sizeof(tag));
+			mix(chunkName, strlen(chunkName) + 1);
+			mix(data, size);
+			return hash;
+		}
+
+		static bool ReadFile(const char * path, std::string& content)
+		{
+			FILE * file = fopen(path, "rb");
+			if (file == nullptr)
+			{
+				return false;
+			}
+			char block[4096];
+			size_t count;
+			while ((count = fread(block, 1, sizeof(block), file)) > 0)
+			{
+				content.append(block, count);
+			}
+			bool ok = ferror(file) == 0;
+			fclose(file);
+			return ok;
+		}
+
+		std::string cachePath(unsigned long long key) const
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "/%016llx.luac", key);
+			return m_cacheDir + name;
+		}
+
+		std::shared_ptr<const Bytecode> find(unsigned long long key)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto it = m_codes.find(key);
+				if (it != m_codes.end())
+				{
+					return it->second;
+				}
+			}
+			if (m_cacheDir.empty())
+			{
+				return nullptr;
+			}
+
+			std::shared_ptr<Bytecode> code = std::make_shared<Bytecode>();
+			std::string path = cachePath(key);
+#if LUAAA_WITH_MMAP
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+			{
+				return nullptr;
+			}
+			struct stat info;
+			void * mapped = MAP_FAILED;
+			if (fstat(fd, &info) == 0 && info.st_size > 0)
+			{
+				mapped = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			}
+			close(fd);
+			if (mapped == MAP_FAILED)
+			{
+				return nullptr;
+			}
+			code->mapped = mapped;
+			code->data = static_cast<const char*>(mapped);
+			code->size = size_t(info.st_size);
+#else
+			if (!ReadFile(path.c_str(), code->buffer) || code->buffer.empty())
+			{
+				return nullptr;
+			}
+			code->data = code->buffer.data();
+			code->size = code->buffer.size();
+#endif
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_codes.emplace(key, code).first->second;
+		}
+
+		void store(unsigned long long key, const std::shared_ptr<const Bytecode>& code)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_codes[key] = code;
+			}
+			if (m_cacheDir.empty())
+			{
+				return;
+			}
+
+			// write to a temporary file and rename, readers never see a partial file.
+			static std::atomic<unsigned> serial(0);
+			std::string path = cachePath(key);
+			char suffix[32];
+			snprintf(suffix, sizeof(suffix), ".%u.tmp", serial++);
+			std::string temp = path + suffix;
+			FILE * file = fopen(temp.c_str(), "wb");
+			if (file == nullptr)
+			{
+				return;
+			}
+			bool ok = fwrite(code->data, 1, code->size, file) == code->size;
+			ok = (fclose(file) == 0) && ok;
+			if (!ok || std::rename(temp.c_str(), path.c_str()) != 0)
+			{
+				std::remove(temp.c_str());
+			}
+		}
+
+	private:
+		std::string m_cacheDir;
+		mutable std::mutex m_mutex;
+		std::unordered_map<unsigned long long, std::shared_ptr<const Bytecode>> m_codes;
+		std::atomic<size_t> m_hits;
+		std::atomic<size_t> m_misses;
+	};
+
+	// -----------------------------------
+	// gc controller
+	// -----------------------------------
+	// stops the automatic collector, host calls tick() once per frame to run incremental steps within a time budget.
+	// cost of a step is measured at runtime, step size follows allocation rate, so collection keeps up
+	// with garbage produced without spending the whole budget on idle frames.
+	class GcController
+	{
+	public:
+		enum { HistogramSize = 32 };
+
+		// pauses of tick(), histogram bucket i counts pauses in [2^(i-1), 2^i) microseconds.
+		struct Stats
+		{
+			unsigned long long ticks;
+			unsigned long long steps;
+			unsigned long long cycles;		// completed collection cycles
+			unsigned long long totalUs;
+			int maxUs;
+			unsigned long long histogram[HistogramSize];
+		};
+
+		explicit GcController(lua_State * state, int budgetUs = 1000)
+			: m_state(state), m_budgetUs(budgetUs), m_pace(2.0), m_usPerKb(1.0), m_allocKb(0.0), m_lastKb(countKb()), m_stats()
+		{
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 504
+			lua_gc(m_state, LUA_GCINC, 0, 0, 0);
+#endif
+			lua_gc(m_state, LUA_GCSTOP, 0);
+		}
+
+		// gives collection back to lua, must run before lua_close.
+		~GcController()
+		{
+			lua_gc(m_state, LUA_GCRESTART, 0);
+		}
+
+		GcController(const GcController&) = delete;
+		GcController& operator=(const GcController&) = delete;
+
+		void setBudget(int budgetUs)
+		{
+			m_budgetUs = budgetUs;
+		}
+
+		// KB collected per KB allocated, above 1 so collection catches up after busy frames.
+		void setPace(double pace)
+		{
+			m_pace = pace;
+		}
+
+		// run gc steps, return microseconds spent.
+		int tick()
+		{
+			double kb = countKb();
+			double allocated = kb > m_lastKb ? kb - m_lastKb : 0.0;
+			m_allocKb += (allocated - m_allocKb) * 0.125;
+
+			// work wanted this tick, and step size so one step takes about a quarter of budget.
+			double wantKb = m_allocKb * m_pace;
+			int stepKb = int(m_budgetUs * 0.25 / m_usPerKb);
+			stepKb = stepKb < 1 ? 1 : stepKb;
+			if (wantKb > 0 && stepKb > wantKb)
+			{
+				stepKb = int(wantKb) + 1;
+			}
+
+			Clock::time_point start = Clock::now();
+			double elapsedUs = 0.0;
+			double doneKb = 0.0;
+			do
+			{
+				Clock::time_point stepStart = Clock::now();
+				int finished = step(stepKb);
+				Clock::time_point stepEnd = Clock::now();
+
+				double stepUs = std::chrono::duration<double, std::micro>(stepEnd - stepStart).count();
+				// cost varies a lot between gc phases, follow rises at once and falls slowly.
+				double usPerKb = stepUs / stepKb;
+				m_usPerKb = usPerKb > m_usPerKb ? usPerKb : m_usPerKb + (usPerKb - m_usPerKb) * 0.05;
+				elapsedUs = std::chrono::duration<double, std::micro>(stepEnd - start).count();
+				doneKb += stepKb;
+				++m_stats.steps;
+				if (finished)
+				{
+					++m_stats.cycles;
+					break;
+				}
+			} while (doneKb < wantKb && elapsedUs + stepKb * m_usPerKb <= m_budgetUs);
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM <= 501
+			// a step restores the gc threshold on lua 5.1.
+			lua_gc(m_state, LUA_GCSTOP, 0);
+#endif
+			m_lastKb = countKb();
+
+			int pauseUs = int(elapsedUs);
+			record(pauseUs);
+			return pauseUs;
+		}
+
+		const Stats& stats() const
+		{
+			return m_stats;
+		}
+
+		// pause in microseconds below which fraction p (0..1) of ticks fall, upper bound from histogram.
+		int percentile(double p) const
+		{
+			unsigned long long rank = (unsigned long long)(p * double(m_stats.ticks));
+			unsigned long long seen = 0;
+			for (int i = 0; i < HistogramSize; ++i)
+			{
+				seen += m_stats.histogram[i];
+				if (seen > rank)
+				{
+					int bound = i == 0 ? 0 : (1 << i) - 1;
+					return bound < m_stats.maxUs ? bound : m_stats.maxUs;
+				}
+			}
+			return m_stats.maxUs;
+		}
+
+		void resetStats()
+		{
+			m_stats = Stats();
+		}
+
+	private:
+		typedef std::chrono::steady_clock Clock;
+
+		double countKb() const
+		{
+			return lua_gc(m_state, LUA_GCCOUNT, 0) + lua_gc(m_state, LUA_GCCOUNTB, 0) / 1024.0;
+		}
+
+		// one incremental step of about stepKb work, return 1 if a cycle finished.
+		int step(int& stepKb)
+		{
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 504
+			// lua 5.4 takes step size as log2 of bytes, data of LUA_GCSTEP only adds debt.
+			int sizeLog2 = 10;
+			while ((1 << (sizeLog2 - 10)) < stepKb && sizeLog2 < 30)
+			{
+				++sizeLog2;
+			}
+			stepKb = 1 << (sizeLog2 - 10);
+			lua_gc(m_state, LUA_GCINC, 0, 0, sizeLog2);
+			return lua_gc(m_state, LUA_GCSTEP, 0);
+#else
+			return lua_gc(m_state, LUA_GCSTEP, stepKb);
+#endif
+		}
+
+		void record(int pauseUs)
+		{
+			int bucket = 0;
+			while (bucket < HistogramSize - 1 && (pauseUs >> bucket) != 0)
+			{
+				++bucket;
+			}
+			++m_stats.histogram[bucket];
+			++m_stats.ticks;
+			m_stats.totalUs += pauseUs;
+			if (pauseUs > m_stats.maxUs)
+			{
+				m_stats.maxUs = pauseUs;
+			}
+		}
+
+	private:
+		lua_State * m_state;
+		int m_budgetUs;
+		double m_pace;
+		double m_usPerKb;
+		double m_allocKb;
+		double m_lastKb;
+		Stats m_stats;
+	};
+
+	// -----------------------------------
+	// watchdog
+	// -----------------------------------
+	// bounds instructions and wall-clock time of script runs with a count hook.
+	// the hook is installed only between arm() and disarm(), unarmed code runs at full speed.
+	// hook found installed when armed keeps its events and is restored by disarm(). one watchdog per state.
+	class Watchdog
+	{
+	public:
+		enum Action
+		{
+			Abort,	// raise "script budget exceeded", again on every instruction so scripts can't swallow it
+			Yield,	// yield the running coroutine, arm again before resuming it. aborts where yield is impossible
+		};
+
+		// armed hook runs every interval vm instructions.
+		explicit Watchdog(lua_State * state, int interval = 1000)
+			: m_state(state), m_thread(nullptr), m_interval(interval), m_hookInterval(interval),
+			m_maxInstructions(0), m_maxUs(0), m_action(Abort), m_instructions(0), m_armed(false), m_exceeded(false)
+		{
+			assert(Find(m_state) == nullptr && "one watchdog per state");
+			lua_pushlightuserdata(m_state, Key());
+			lua_pushlightuserdata(m_state, this);
+			lua_rawset(m_state, LUA_REGISTRYINDEX);
+		}
+
+		// must run before lua_close.
+		~Watchdog()
+		{
+			disarm();
+			if (Find(m_state) == this)
+			{
+				lua_pushlightuserdata(m_state, Key());
+				lua_pushnil(m_state);
+				lua_rawset(m_state, LUA_REGISTRYINDEX);
+			}
+		}
+
+		Watchdog(const Watchdog&) = delete;
+		Watchdog& operator=(const Watchdog&) = delete;
+
+		// budget of one armed run, 0 means unlimited.
+		void setBudget(long long instructions, int timeUs, Action action = Abort)
+		{
+			m_maxInstructions = instructions;
+			m_maxUs = timeUs;
+			m_action = action;
+		}
+
+		// start budget for code run on thread, main state by default. does nothing without budget.
+		void arm(lua_State * thread = nullptr)
+		{
+			disarm();
+			m_exceeded = false;
+			if (m_maxInstructions <= 0 && m_maxUs <= 0)
+			{
+				return;
+			}
+			m_thread = thread ? thread : m_state;
+			m_instructions = 0;
+			m_hookInterval = m_interval;
+			if (m_maxInstructions > 0 && m_maxInstructions < m_hookInterval)
+			{
+				m_hookInterval = int(m_maxInstructions);
+			}
+			m_start = Clock::now();
+			m_armed = true;
+			m_hooks.install(m_thread, Hook, LUA_MASKCOUNT, m_hookInterval);
+		}
+
+		// restore hook which was installed when armed.
+		void disarm()
+		{
+			m_armed = false;
+			if (m_thread)
+			{
+				m_hooks.remove(m_thread, Hook);
+				m_thread = nullptr;
+			}
+		}
+
+		// lua_pcall under budget.
+		int pcall(int nargs, int nresults, int msgh = 0)
+		{
+			arm();
+			int status = lua_pcall(m_state, nargs, nresults, msgh);
+			disarm();
+			return status;
+		}
+
+		// LuaResume under budget, on Yield action a coroutine over budget returns LUA_YIELD.
+		int resume(lua_State * thread, int nargs, int * nres = nullptr)
+		{
+			arm(thread);
+			int status = LuaResume(thread, m_state, nargs, nres);
+			disarm();
+			return status;
+		}
+
+		// last armed run went over budget.
+		bool exceeded() const
+		{
+			return m_exceeded;
+		}
+
+	private:
+		typedef std::chrono::steady_clock Clock;
+
+		static void * Key()
+		{
+			static char key = 0;
+			return &key;
+		}
+
+		static Watchdog * Find(lua_State * state)
+		{
+			lua_pushlightuserdata(state, Key());
+			lua_rawget(state, LUA_REGISTRYINDEX);
+			Watchdog * self = static_cast<Watchdog*>(lua_touserdata(state, -1));
+			lua_pop(state, 1);
+			return self;
+		}
+
+		static void Hook(lua_State * state, lua_Debug * ar)
+		{
+			Watchdog * self = Find(state);
+			if (self == nullptr)
+			{
+				lua_sethook(state, nullptr, 0, 0);
+				return;
+			}
+			if (!self->m_hooks.dispatch(state, ar))
+			{
+				return;
+			}
+			if (!self->m_armed)
+			{
+				// coroutine which inherited the hook, runs outside an armed run.
+				self->m_hooks.remove(state, Hook);
+				return;
+			}
+
+			if (!self->m_exceeded)
+			{
+				self->m_instructions += self->m_hookInterval;
+				bool over = self->m_maxInstructions > 0 && self->m_instructions >= self->m_maxInstructions;
+				if (!over && self->m_maxUs > 0)
+				{
+					over = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - self->m_start).count() >= self->m_maxUs;
+				}
+				if (!over)
+				{
+					return;
+				}
+				self->m_exceeded = true;
+			}
+
+			if (self->m_action == Yield && CanYield(state))
+			{
+				lua_yield(state, 0);
+				return;
+			}
+			self->m_hooks.install(state, Hook, LUA_MASKCOUNT, 1);
+			luaL_error(state, "script budget exceeded");
+		}
+
+		static bool CanYield(lua_State * state)
+		{
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 503
+			return lua_isyieldable(state) != 0;
+#else
+			// lua raises an error itself when yielding across a C call.
+			int isMain = lua_pushthread(state);
+			lua_pop(state, 1);
+			return !isMain;
+#endif
+		}
+
+	private:
+		lua_State * m_state;
+		lua_State * m_thread;
+		int m_interval;
+		int m_hookInterval;
+		long long m_maxInstructions;
+		long long m_maxUs;
+		Action m_action;
+		long long m_instructions;
+		bool m_armed;
+		bool m_exceeded;
+		Clock::time_point m_start;
+		LuaHookChain m_hooks;
+	};
+
+	// -----------------------------------
+	// sampling profiler
+	// -----------------------------------
+	// a timer thread asks for a sample at given rate, a count hook checks for it every interval vm instructions,
+	// and bound functions check when they return (with LUAAA_WITH_PROFILER, frame is tagged by binding name).
+	// the timer thread never touches the state, lua_sethook is not safe to call from other threads.
+	// coroutines created after start() inherit the hook, at the cost of slower vm (lua 5.4 traces each
+	// instruction while a hook is set). hook found installed by start() keeps its events and is restored by stop().
+	// start and stop it on the thread running the state.
+	class SamplingProfiler
+	{
+	public:
+		explicit SamplingProfiler(lua_State * state, int hz = 1000, int interval = 1000)
+			: m_state(state), m_hz(hz > 0 ? hz : 1000), m_interval(interval > 0 ? interval : 1000),
+			m_pending(false), m_tickNs(0), m_running(false), m_ticks(0), m_samples(0)
+		{
+		}
+
+		// must run before lua_close.
+		~SamplingProfiler()
+		{
+			stop();
+		}
+
+		SamplingProfiler(const SamplingProfiler&) = delete;
+		SamplingProfiler& operator=(const SamplingProfiler&) = delete;
+
+		void start()
+		{
+			if (m_running)
+			{
+				return;
+			}
+			m_running = true;
+			Current() = this;
+			m_hooks.install(m_state, Hook, LUA_MASKCOUNT, m_interval);
+			m_timer = std::thread(&SamplingProfiler::run, this);
+		}
+
+		void stop()
+		{
+			if (!m_running)
+			{
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_timerMutex);
+				m_running = false;
+			}
+			m_wake.notify_all();
+			m_timer.join();
+			m_hooks.remove(m_state, Hook);
+			if (Current() == this)
+			{
+				Current() = nullptr;
+			}
+		}
+
+		// folded stacks, one "root;...;leaf count" line per distinct stack, input of flamegraph.pl.
+		std::string folded() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::string text;
+			for (const auto & stack : m_stacks)
+			{
+				text += stack.first;
+				text += ' ';
+				text += std::to_string(stack.second);
+				text += '\n';
+			}
+			return text;
+		}
+
+		bool writeFolded(const char * path) const
+		{
+			FILE * file = fopen(path, "wb");
+			if (file == nullptr)
+			{
+				return false;
+			}
+			std::string text = folded();
+			bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+			return (fclose(file) == 0) && ok;
+		}
+
+		void clear()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stacks.clear();
+			m_samples = 0;
+			m_ticks = 0;
+		}
+
+		// timer ticks, and ticks sampled. ticks while no lua code runs are not sampled.
+		unsigned long long ticks() const { return m_ticks; }
+		unsigned long long samples() const { return m_samples; }
+
+		// take sample if the timer asked for one, tag is the binding returning.
+		void sample(lua_State * state, const char * tag)
+		{
+			if (!m_pending.load(std::memory_order_relaxed) || !m_pending.exchange(false, std::memory_order_relaxed))
+			{
+				return;
+			}
+			// a request made while no lua code ran is taken late, its stack doesn't belong to the tick.
+			long long tickNs = m_tickNs.load(std::memory_order_relaxed);
+			if (Now() - tickNs > 2000000000LL / m_hz)
+			{
+				return;
+			}
+
+			enum { MaxDepth = 128 };
+			lua_Debug ar;
+			int depth = 0;
+			while (depth < MaxDepth && lua_getstack(state, depth, &ar))
+			{
+				++depth;
+			}
+
+			std::string stack;
+			for (int level = depth - 1; level >= 0; --level)
+			{
+				if (!lua_getstack(state, level, &ar) || !lua_getinfo(state, "Sn", &ar))
+				{
+					continue;
+				}
+				if (!stack.empty())
+				{
+					stack += ';';
+				}
+				if (level == 0 && tag)
+				{
+					stack += tag;
+					stack += " [C++]";
+				}
+				else
+				{
+					AppendFrame(stack, ar);
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_stacks[stack.empty() ? std::string("?") : stack];
+			++m_samples;
+		}
+
+		// profiler started on calling thread.
+		static SamplingProfiler *& Current()
+		{
+			static thread_local SamplingProfiler * profiler = nullptr;
+			return profiler;
+		}
+
+	private:
+		static void Hook(lua_State * state, lua_Debug * ar)
+		{
+			SamplingProfiler * self = Current();
+			if (self == nullptr)
+			{
+				// coroutine which inherited the hook, outlived the profiler.
+				lua_sethook(state, nullptr, 0, 0);
+				return;
+			}
+			if (self->m_hooks.dispatch(state, ar))
+			{
+				self->sample(state, nullptr);
+			}
+		}
+
+		// "name (source:line)", ';' separates frames in folded format.
+		static void AppendFrame(std::string& stack, const lua_Debug& ar)
+		{
+			size_t start = stack.size();
+			if (strcmp(ar.what, "main") == 0)
+			{
+				stack += "main";
+			}
+			else
+			{
+				stack += ar.name ? ar.name : "?";
+			}
+			if (strcmp(ar.what, "C") == 0)
+			{
+				stack += " [C]";
+			}
+			else
+			{
+				stack += " (";
+				stack += ar.short_src;
+				stack += ':';
+				stack += std::to_string(ar.linedefined);
+				stack += ')';
+			}
+			std::replace(stack.begin() + start, stack.end(), ';', ',');
+		}
+
+		static long long Now()
+		{
+			return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		void run()
+		{
+			std::chrono::steady_clock::duration period = std::chrono::microseconds(1000000 / m_hz);
+			std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> lock(m_timerMutex);
+			while (m_running)
+			{
+				next += period;
+				if (m_wake.wait_until(lock, next, [this] { return !m_running; }))
+				{
+					break;
+				}
+				m_tickNs.store(Now(), std::memory_order_relaxed);
+				m_pending.store(true, std::memory_order_relaxed);
+				++m_ticks;
+			}
+		}
+
+	private:
+		lua_State * m_state;
+		int m_hz;
+		int m_interval;
+		std::atomic<bool> m_pending;
+		std::atomic<long long> m_tickNs;
+		bool m_running;
+		std::atomic<unsigned long long> m_ticks;
+		std::atomic<unsigned long long> m_samples;
+		std::thread m_timer;
+		std::mutex m_timerMutex;
+		std::condition_variable m_wake;
+		mutable std::mutex m_mutex;
+		std::unordered_map<std::string, unsigned long long> m_stacks;
+		LuaHookChain m_hooks;
+	};
+
+	// -----------------------------------
+	// allocation tracer
+	// -----------------------------------
+	// wraps lua_Alloc of a state and counts allocations and bytes by site: the binding running
+	// (with LUAAA_WITH_PROFILER), else the script line, which a line hook keeps track of,
+	// else "[host]" for allocations outside of lua code. reallocations count growth only.
+	// lines of coroutines are tracked if they were created after the tracer, like hooks are inherited.
+	// hook found installed keeps its events and is restored by the destructor. destroy the tracer before lua_close.
+	class AllocTracer
+	{
+	public:
+		struct Site
+		{
+			std::string name;
+			unsigned long long allocations;
+			unsigned long long bytes;
+		};
+
+		explicit AllocTracer(lua_State * state) : m_state(state), m_line(0), m_lineBinding(nullptr), m_site(nullptr)
+		{
+			m_source[0] = 0;
+			m_alloc = lua_getallocf(state, &m_ud);
+			lua_setallocf(state, Alloc, this);
+			m_hooks.install(state, Hook, LUA_MASKLINE, 0);
+		}
+
+		~AllocTracer()
+		{
+			void * ud = nullptr;
+			if (lua_getallocf(m_state, &ud) == Alloc && ud == this)
+			{
+				lua_setallocf(m_state, m_alloc, m_ud);
+			}
+			m_hooks.remove(m_state, Hook);
+		}
+
+		AllocTracer(const AllocTracer&) = delete;
+		AllocTracer& operator=(const AllocTracer&) = delete;
+
+		// sites sorted by bytes, or by count of allocations, at most n.
+		std::vector<Site> top(size_t n = 20, bool byBytes = true) const
+		{
+			std::vector<Site> sites;
+			for (auto it = m_sites.begin(); it != m_sites.end(); ++it)
+			{
+				sites.push_back(it->second);
+			}
+			std::sort(sites.begin(), sites.end(), [byBytes](const Site& a, const Site& b) {
+				return byBytes ? a.bytes > b.bytes : a.allocations > b.allocations;
+			});
+			if (sites.size() > n)
+			{
+				sites.resize(n);
+			}
+			return sites;
+		}
+
+		// print top n sites by bytes as table.
+		void report(FILE * file = stdout, size_t n = 20) const
+		{
+			fprintf(file, "%12s %14s  %s\n", "allocations", "bytes", "site");
+			std::vector<Site> sites = top(n);
+			for (auto it = sites.begin(); it != sites.end(); ++it)
+			{
+				fprintf(file, "%12llu %14llu  %s\n", it->allocations, it->bytes, it->name.c_str());
+			}
+		}
+
+		void clear()
+		{
+			m_sites.clear();
+			m_site = nullptr;
+#if LUAAA_WITH_PROFILER
+			m_bindings.clear();
+#endif
+		}
+
+	private:
+		static void * Alloc(void * ud, void * ptr, size_t osize, size_t nsize)
+		{
+			AllocTracer * self = static_cast<AllocTracer*>(ud);
+			void * block = self->m_alloc(self->m_ud, ptr, osize, nsize);
+			// since lua 5.2 osize is the object type for new blocks.
+			if (block && nsize > 0 && (ptr == nullptr || nsize > osize))
+			{
+				self->count(ptr == nullptr ? nsize : nsize - osize);
+			}
+			return block;
+		}
+
+		// last line of lua code run by the state, or its coroutines.
+		static void Hook(lua_State * state, lua_Debug * ar)
+		{
+			void * ud = nullptr;
+			if (lua_getallocf(state, &ud) != Alloc)
+			{
+				return;
+			}
+			AllocTracer * self = static_cast<AllocTracer*>(ud);
+			if (!self->m_hooks.dispatch(state, ar) || !lua_getinfo(state, "S", ar))
+			{
+				return;
+			}
+			self->m_line = ar->currentline;
+			strncpy(self->m_source, ar->short_src, sizeof(self->m_source) - 1);
+			self->m_source[sizeof(self->m_source) - 1] = 0;
+			self->m_site = nullptr;
+#if LUAAA_WITH_PROFILER
+			self->m_lineBinding = LuaProfileScope::current();
+#endif
+		}
+
+		// runs inside of the vm, which may be reallocating the stack: the stack mustn't be read here.
+		// lua_getstack only walks call infos.
+		void count(size_t bytes)
+		{
+			Site * site = nullptr;
+#if LUAAA_WITH_PROFILER
+			// a binding entered after the last line ran.
+			const LuaProfileRecord * binding = LuaProfileScope::current();
+			if (binding && binding != m_lineBinding)
+			{
+				auto found = m_bindings.find(binding);
+				if (found == m_bindings.end())
+				{
+					found = m_bindings.insert(std::make_pair(binding, &find(binding->name + " [C++]"))).first;
+				}
+				site = found->second;
+			}
+#endif
+			if (site == nullptr)
+			{
+				lua_Debug ar;
+				if (m_line <= 0 || !lua_getstack(m_state, 0, &ar))
+				{
+					site = &find("[host]");
+				}
+				else
+				{
+					if (m_site == nullptr)
+					{
+						char name[sizeof(m_source) + 16];
+						snprintf(name, sizeof(name), "%s:%d", m_source, m_line);
+						m_site = &find(name);
+					}
+					site = m_site;
+				}
+			}
+			++site->allocations;
+			site->bytes += bytes;
+		}
+
+		Site& find(const std::string& name)
+		{
+			Site& site = m_sites[name];
+			if (site.name.empty())
+			{
+				site.name = name;
+				site.allocations = 0;
+				site.bytes = 0;
+			}
+			return site;
+		}
+
+	private:
+		lua_State * m_state;
+		lua_Alloc m_alloc;
+		void * m_ud;
+		int m_line;
+		char m_source[LUA_IDSIZE];
+		const void * m_lineBinding;
+		Site * m_site;
+		std::unordered_map<std::string, Site> m_sites;
+#if LUAAA_WITH_PROFILER
+		std::unordered_map<const LuaProfileRecord*, Site*> m_bindings;
+#endif
+		LuaHookChain m_hooks;
+	};
+
+#if LUAAA_WITH_PROFILER
+    inline void LuaSampleBinding(lua_State * state, LuaProfileRecord * record)
+    {
+        SamplingProfiler * profiler = SamplingProfiler::Current();
+        if (profiler)
+        {
+            profiler->sample(state, record->name.c_str());
+        }
+    }
+#endif
 }
 
 #endif //#if !defined(LUAAA_WITHOUT_CPP_STDLIB)